@@ -0,0 +1,219 @@
+/*
+ *      Microbenchmark of CQDB lookups.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+/*
+ * Usage: bench_cqdb [DATA_FILE] [NUM_TOKENS]
+ *
+ * Builds attribute dictionaries with each combination of the hash function
+ * (lookup3 or CQDB_FASTHASH) and the perfect hash index (CQDB_MPH), and with
+ * the compressed keys (CQDB_COMPRESS), and reports the size and the
+ * nanoseconds per lookup with cqdb_to_id() and cqdb_to_ids().
+ * The attributes are read from a data file in the CRFsuite format if
+ * specified; otherwise, the attributes of NUM_TOKENS tokens are generated
+ * from the feature templates of the CoNLL chunking task (e.g., w[-1]=foo,
+ * pos[0]|pos[1]=NN|VB) with a Zipf-like vocabulary. The first half of the
+ * tokens builds the dictionary and the second half is looked up, so that
+ * the lookups include unknown attributes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cqdb.h>
+
+/* A Zipf-like word distribution: small ids are frequent. */
+static int draw(int n)
+{
+    double u = (rand() + 1.) / ((double)RAND_MAX + 2.);
+    return (int)((n - 1) * u * u * u);
+}
+
+static void generate(std::vector<std::string>& attrs, int num_tokens)
+{
+    static const char *tags[] = {
+        "NN", "NNS", "NNP", "VB", "VBD", "VBZ", "VBG", "JJ", "RB", "IN",
+        "DT", "CC", "PRP", "TO", "CD", "MD", ",", ".",
+    };
+    const int T = sizeof(tags) / sizeof(tags[0]);
+    const int W = 20000;
+    std::vector<std::string> words, pos;
+    char buffer[256];
+
+    srand(0);
+    for (int t = 0;t < num_tokens + 4;++t) {
+        snprintf(buffer, sizeof(buffer), "word%d", draw(W));
+        words.push_back(buffer);
+        pos.push_back(tags[draw(T)]);
+    }
+
+    for (int t = 2;t < num_tokens + 2;++t) {
+        for (int d = -2;d <= 2;++d) {
+            attrs.push_back("w[" + std::to_string(d) + "]=" + words[t+d]);
+            attrs.push_back("pos[" + std::to_string(d) + "]=" + pos[t+d]);
+        }
+        for (int d = -2;d < 2;++d) {
+            attrs.push_back("w[" + std::to_string(d) + "]|w[" + std::to_string(d+1) + "]=" + words[t+d] + "|" + words[t+d+1]);
+            attrs.push_back("pos[" + std::to_string(d) + "]|pos[" + std::to_string(d+1) + "]=" + pos[t+d] + "|" + pos[t+d+1]);
+        }
+    }
+}
+
+static int read_attributes(std::vector<std::string>& attrs, const char *filename)
+{
+    char line[65536];
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        /* Skip the label (the first field) and the attribute values. */
+        char *p = strchr(line, '\t');
+        while (p != NULL) {
+            char *field = p + 1;
+            size_t n = strcspn(field, "\t\n");
+            char *colon = (char*)memchr(field, ':', n);
+            if (colon != NULL && colon != field) {
+                n = colon - field;
+            }
+            if (0 < n) {
+                attrs.push_back(std::string(field, n));
+            }
+            p = strchr(field, '\t');
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run(const char *name, int flag, const std::set<std::string>& dict, const std::vector<std::string>& queries)
+{
+    std::vector<const char*> strs;
+    std::vector<size_t> lens;
+    std::vector<int> ids(queries.size()), batch(queries.size());
+    std::vector<char> image;
+    int id = 0, found = 0;
+    double begin, sec_single, sec_batch;
+
+    /* Build the dictionary on a temporary file and read it into memory. */
+    FILE *fp = tmpfile();
+    if (fp == NULL) {
+        return 1;
+    }
+    cqdb_writer_t *dbw = cqdb_writer(fp, flag);
+    for (const auto& s: dict) {
+        cqdb_writer_put(dbw, s.c_str(), id++);
+    }
+    if (cqdb_writer_close(dbw) != 0) {
+        fclose(fp);
+        return 1;
+    }
+    image.resize((size_t)ftell(fp));
+    rewind(fp);
+    if (fread(image.data(), 1, image.size(), fp) != image.size()) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    cqdb_t *db = cqdb_reader(image.data(), image.size());
+    if (db == NULL) {
+        return 1;
+    }
+
+    for (const auto& s: queries) {
+        strs.push_back(s.c_str());
+        lens.push_back(s.size());
+    }
+
+    begin = now();
+    for (size_t i = 0;i < queries.size();++i) {
+        ids[i] = cqdb_to_id(db, strs[i]);
+        found += (0 <= ids[i]);
+    }
+    sec_single = now() - begin;
+
+    begin = now();
+    for (size_t i = 0;i < queries.size();i += 256) {
+        int n = (int)((queries.size() - i < 256) ? queries.size() - i : 256);
+        cqdb_to_ids(db, &strs[i], &lens[i], n, &batch[i]);
+    }
+    sec_batch = now() - begin;
+
+    printf("%-22s %10zu bytes  %7.1f ns/lookup  %7.1f ns/lookup (batch)  %d found\n",
+        name, image.size(),
+        sec_single * 1e9 / queries.size(), sec_batch * 1e9 / queries.size(), found);
+
+    cqdb_delete(db);
+    return (ids == batch) ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> attrs;
+    int ret = 0;
+
+    if (1 < argc && strcmp(argv[1], "-") != 0) {
+        if (read_attributes(attrs, argv[1]) != 0) {
+            fprintf(stderr, "ERROR: failed to open %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        generate(attrs, (2 < argc) ? atoi(argv[2]) : 200000);
+    }
+
+    /* The first half builds the dictionary; the second half is looked up. */
+    const size_t half = attrs.size() / 2;
+    std::set<std::string> dict(attrs.begin(), attrs.begin() + half);
+    std::vector<std::string> queries(attrs.begin() + half, attrs.end());
+    printf("%zu distinct attributes, %zu lookups\n", dict.size(), queries.size());
+
+    ret |= run("lookup3", 0, dict, queries);
+    ret |= run("lookup3 + MPH", CQDB_MPH, dict, queries);
+    ret |= run("fasthash", CQDB_FASTHASH, dict, queries);
+    ret |= run("fasthash + MPH", CQDB_FASTHASH | CQDB_MPH, dict, queries);
+    ret |= run("fasthash + MPH + comp", CQDB_FASTHASH | CQDB_MPH | CQDB_COMPRESS, dict, queries);
+    return ret;
+}
@@ -0,0 +1,142 @@
+/*
+ *      Microbenchmark of the feature set (featureset_t).
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+/*
+ * Usage: bench_featureset [NUM_ITEMS] [NUM_ATTRS] [NUM_LABELS]
+ *
+ * Feeds the same stream of synthetic state/transition features into the
+ * flat open-addressing featureset_t and into the former implementation
+ * based on std::unordered_set, and reports the seconds and the number of
+ * distinct features for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unordered_set>
+
+#include "crf1d_featureset.h"
+
+/* The former implementation of the feature set. */
+struct FeatureEqual {
+    bool operator()(const crf1df_feature_t& lhs, const crf1df_feature_t& rhs) const {
+        return lhs.type == rhs.type && lhs.src == rhs.src && lhs.dst == rhs.dst;
+    }
+};
+
+struct FeatureHash {
+    size_t operator()(const crf1df_feature_t& f) const {
+        return f.type + f.src + f.dst;
+    }
+};
+
+struct featureset_unordered_t
+{
+    std::unordered_set<crf1df_feature_t, FeatureHash, FeatureEqual> m;
+
+    void add(const crf1df_feature_t& f)
+    {
+        auto p = this->m.find(f);
+        if (p != this->m.end()) {
+            crf1df_feature_t o = *p;
+            o.freq += f.freq;
+            this->m.erase(p);
+            this->m.insert(o);
+        } else {
+            this->m.insert(f);
+        }
+    }
+    size_t size() const { return this->m.size(); }
+};
+
+/* A Zipf-like attribute distribution: small ids are frequent. */
+static int draw(int n)
+{
+    double u = (rand() + 1.) / ((double)RAND_MAX + 2.);
+    return (int)((n - 1) * u * u * u);
+}
+
+template <class set_type>
+static double run(set_type& set, const std::vector<crf1df_feature_t>& stream)
+{
+    clock_t begin = clock();
+    for (const auto& f: stream) {
+        set.add(f);
+    }
+    return (clock() - begin) / (double)CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    const int N = (1 < argc) ? atoi(argv[1]) : 1000000;
+    const int A = (2 < argc) ? atoi(argv[2]) : 500000;
+    const int L = (3 < argc) ? atoi(argv[3]) : 40;
+    const int C = 20;   /* Number of attributes per item. */
+    std::vector<crf1df_feature_t> stream;
+    crf1df_feature_t f;
+    int prev = L;
+
+    /* Generate the feature stream in the same manner as crf1df_generate. */
+    srand(0);
+    stream.reserve((size_t)N * (C + 1));
+    for (int t = 0;t < N;++t) {
+        int cur = rand() % L;
+        if (prev != L) {
+            f.type = FT_TRANS;
+            f.src = prev;
+            f.dst = cur;
+            f.freq = 1;
+            stream.push_back(f);
+        }
+        for (int c = 0;c < C;++c) {
+            f.type = FT_STATE;
+            f.src = draw(A);
+            f.dst = cur;
+            f.freq = 1;
+            stream.push_back(f);
+        }
+        prev = (t % 30 == 29) ? L : cur;
+    }
+
+    featureset_t flat;
+    double sec_flat = run(flat, stream);
+    printf("featureset_t (flat):           %8.3f sec, %zu features\n", sec_flat, flat.size());
+
+    featureset_unordered_t unordered;
+    double sec_unordered = run(unordered, stream);
+    printf("featureset_t (unordered_set):  %8.3f sec, %zu features\n", sec_unordered, unordered.size());
+
+    if (0 < sec_flat) {
+        printf("Speedup: %.2f\n", sec_unordered / sec_flat);
+    }
+    return (flat.size() == unordered.size()) ? 0 : 1;
+}
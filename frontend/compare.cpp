@@ -0,0 +1,207 @@
+/*
+ *        Routines shared by the convert and compact commands.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <os.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <crfsuite.h>
+#include "iwa.h"
+#include "compare.h"
+
+char* mystrdup(const char *src)
+{
+    char *dst = (char*)malloc(strlen(src)+1);
+    if (dst != NULL) {
+        strcpy(dst, src);
+    }
+    return dst;
+}
+
+int parse_weight_type(const char *arg)
+{
+    if (strcmp(arg, "fp64") == 0) {
+        return CRFSUITE_WEIGHT_FP64;
+    } else if (strcmp(arg, "fp16") == 0) {
+        return CRFSUITE_WEIGHT_FP16;
+    } else if (strcmp(arg, "int8") == 0) {
+        return CRFSUITE_WEIGHT_INT8;
+    }
+    fprintf(stderr, "ERROR: Unknown weight type: %s\n", arg);
+    return -1;
+}
+
+static long file_size(const char *filename)
+{
+    long size = -1;
+    FILE *fp = fopen(filename, "rb");
+    if (fp != NULL) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    return size;
+}
+
+void report_size(FILE *fpo, const char *source, const char *output)
+{
+    const long size0 = file_size(source);
+    const long size1 = file_size(output);
+    fprintf(fpo, "Model size: %ld -> %ld bytes (%.2fx smaller)\n",
+        size0, size1, 0 < size1 ? (double)size0 / size1 : 0.);
+}
+
+/*
+    Tag labeled instances in the file, evaluate the predictions, and keep
+    them in outputs. The attributes are looked up in the dictionary of the
+    model because compaction renumbers them.
+ */
+static int evaluate(
+    const char *test,
+    crfsuite_model_t *model,
+    std::vector<std::vector<int> >& outputs,
+    crfsuite_evaluation_t* eval
+    )
+{
+    int lid = -1;
+    crfsuite_instance_t inst;
+    crfsuite_item_t item;
+    const iwa_token_t* token = NULL;
+
+    FILE *fp = fopen(test, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    iwa_t* iwa = iwa_reader(fp);
+    if (iwa == NULL) {
+        fclose(fp);
+        return 1;
+    }
+
+    auto labels = model->get_labels();
+    auto attrs = model->get_attrs();
+    const int L = labels->size();
+    crfsuite_tagger_t *tagger = model->get_tagger();
+    crfsuite_evaluation_init(eval, L);
+    outputs.clear();
+
+    while (token = iwa_read(iwa), token != NULL) {
+        switch (token->type) {
+        case IWA_BOI:
+            lid = -1;
+            item.clear();
+            break;
+        case IWA_EOI:
+            inst.append(item, lid);
+            item.clear();
+            break;
+        case IWA_ITEM:
+            if (lid == -1) {
+                /* The first field in a line presents a label. */
+                lid = labels->to_id(std::string_view(token->attr, token->attr_len));
+                if (lid < 0) lid = L;    /* #L stands for a unknown label. */
+            } else {
+                /* Ignore attributes 'unknown' to the model. */
+                int aid = attrs->to_id(std::string_view(token->attr, token->attr_len));
+                if (0 <= aid) {
+                    floatval_t value = (token->value && *token->value) ? atof(token->value) : 1.0;
+                    item.append(crfsuite_attribute_t(aid, value));
+                }
+            }
+            break;
+        case IWA_NONE:
+        case IWA_EOF:
+            if (!inst.empty()) {
+                outputs.emplace_back(inst.num_items());
+                tagger->set(inst);
+                tagger->viterbi(outputs.back());
+                crfsuite_evaluation_accmulate(eval, inst.labels, outputs.back(), inst.num_items());
+                inst.clear();
+            }
+            break;
+        }
+    }
+    crfsuite_evaluation_finalize(eval);
+
+    delete tagger;
+    delete attrs;
+    delete labels;
+    iwa_delete(iwa);
+    fclose(fp);
+    return 0;
+}
+
+int report_accuracy(FILE *fpo, const char *test, crfsuite_model_t *source, const char *output)
+{
+    int diff = 0, total = 0;
+    crfsuite_model_t *target = NULL;
+    crfsuite_evaluation_t eval0, eval1;
+    std::vector<std::vector<int> > out0, out1;
+
+    if (crfsuite_create_instance_from_file(output, (void**)&target)) {
+        return 1;
+    }
+    if (evaluate(test, source, out0, &eval0)) {
+        target->release();
+        return 1;
+    }
+    if (evaluate(test, target, out1, &eval1)) {
+        crfsuite_evaluation_finish(&eval0);
+        target->release();
+        return 1;
+    }
+
+    /* Count the items whose predictions changed. */
+    for (size_t n = 0;n < out0.size();++n) {
+        for (size_t t = 0;t < out0[n].size();++t) {
+            if (out0[n][t] != out1[n][t]) ++diff;
+            ++total;
+        }
+    }
+
+    fprintf(fpo, "Accuracy on %s (%d instances):\n", test, (int)out0.size());
+    fprintf(fpo, "  Item accuracy: %.4f -> %.4f (%+.4f)\n",
+        eval0.item_accuracy, eval1.item_accuracy, eval1.item_accuracy - eval0.item_accuracy);
+    fprintf(fpo, "  Instance accuracy: %.4f -> %.4f (%+.4f)\n",
+        eval0.inst_accuracy, eval1.inst_accuracy, eval1.inst_accuracy - eval0.inst_accuracy);
+    fprintf(fpo, "  Macro-average F1: %.4f -> %.4f (%+.4f)\n",
+        eval0.macro_fmeasure, eval1.macro_fmeasure, eval1.macro_fmeasure - eval0.macro_fmeasure);
+    fprintf(fpo, "  Changed predictions: %d / %d items\n", diff, total);
+
+    crfsuite_evaluation_finish(&eval0);
+    crfsuite_evaluation_finish(&eval1);
+    target->release();
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ *        Routines shared by the convert and compact commands.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef    __COMPARE_H__
+#define    __COMPARE_H__
+
+/**
+ * Duplicate a string with malloc().
+ */
+char* mystrdup(const char *src);
+
+/**
+ * Parse the argument of the --quantize option.
+ *  @return int         The weight type (CRFSUITE_WEIGHT_*), or -1 for an
+ *                      unknown type (an error message is printed).
+ */
+int parse_weight_type(const char *arg);
+
+/**
+ * Print the sizes of the model files (SOURCE and OUTPUT).
+ */
+void report_size(FILE *fpo, const char *source, const char *output);
+
+/**
+ * Print the accuracy of the model (SOURCE) and the model stored in the file
+ * (OUTPUT) on the labeled instances in the file (TEST), and the number of
+ * items whose predictions changed.
+ *  @return int         Zero if successful.
+ */
+int report_accuracy(FILE *fpo, const char *test, crfsuite_model_t *source, const char *output);
+
+#endif/*__COMPARE_H__*/
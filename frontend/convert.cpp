@@ -0,0 +1,186 @@
+/*
+ *      Model format converter.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* $Id$ */
+
+#include <os.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <crfsuite.h>
+#include "option.h"
+#include "compare.h"
+
+typedef struct {
+    int help;
+    int version;
+    int weight_type;
+    int dict_flag;
+    char *test;
+} convert_option_t;
+
+static void convert_option_init(convert_option_t* opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->version = 2;
+    opt->weight_type = CRFSUITE_WEIGHT_FP64;
+    opt->dict_flag = CRFSUITE_DICT_DEFAULT;
+}
+
+static void convert_option_finish(convert_option_t* opt)
+{
+    free(opt->test);
+}
+
+BEGIN_OPTION_MAP(parse_convert_options, convert_option_t)
+
+    ON_OPTION_WITH_ARG(SHORTOPT('f') || LONGOPT("format"))
+        opt->version = atoi(arg);
+
+    ON_OPTION_WITH_ARG(SHORTOPT('q') || LONGOPT("quantize"))
+        opt->weight_type = parse_weight_type(arg);
+        if (opt->weight_type < 0) {
+            return -1;
+        }
+
+    ON_OPTION(SHORTOPT('p') || LONGOPT("perfect-hash"))
+        opt->dict_flag |= CRFSUITE_DICT_MPH;
+
+    ON_OPTION(SHORTOPT('z') || LONGOPT("compress"))
+        opt->dict_flag |= CRFSUITE_DICT_COMPRESS;
+
+    ON_OPTION_WITH_ARG(SHORTOPT('t') || LONGOPT("test"))
+        free(opt->test);
+        opt->test = mystrdup(arg);
+
+    ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
+        opt->help = 1;
+
+END_OPTION_MAP()
+
+static void show_usage(FILE *fp, const char *argv0, const char *command)
+{
+    fprintf(fp, "USAGE: %s %s [OPTIONS] <INPUT> <OUTPUT>\n", argv0, command);
+    fprintf(fp, "Store the model in the file (INPUT) to the file (OUTPUT) in another format\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "OPTIONS:\n");
+    fprintf(fp, "    -f, --format=VERSION    Specify the format version of the output model:\n");
+    fprintf(fp, "                            1   the format written by the learn command\n");
+    fprintf(fp, "                            2   aligned sections with a dense transition\n");
+    fprintf(fp, "                                matrix (DEFAULT)\n");
+    fprintf(fp, "    -q, --quantize=TYPE     Store state weights in the type (version 2 only):\n");
+    fprintf(fp, "                            fp64    64-bit floating point (DEFAULT)\n");
+    fprintf(fp, "                            fp16    16-bit floating point\n");
+    fprintf(fp, "                            int8    8-bit integers with per-label scales\n");
+    fprintf(fp, "    -p, --perfect-hash      Add a minimal perfect hash index of attributes,\n");
+    fprintf(fp, "                            which bounds every lookup to one probe but is\n");
+    fprintf(fp, "                            not faster on average (8.5 bytes per attribute)\n");
+    fprintf(fp, "    -z, --compress          Front-code attribute strings for a smaller model\n");
+    fprintf(fp, "                            at slower lookups (version 2 only)\n");
+    fprintf(fp, "    -t, --test=DATA         Report the accuracy of both models on labeled\n");
+    fprintf(fp, "                            instances in the file (DATA)\n");
+    fprintf(fp, "    -h, --help      Show the usage of this command and exit\n");
+}
+
+int main_convert(int argc, char *argv[], const char *argv0)
+{
+    int ret = 0, arg_used = 0;
+    convert_option_t opt;
+    const char *command = argv[0];
+    FILE *fpo = stdout, *fpe = stderr;
+    crfsuite_model_t *model = NULL;
+
+    /* Parse the command-line option. */
+    convert_option_init(&opt);
+    arg_used = option_parse(++argv, --argc, parse_convert_options, &opt);
+    if (arg_used < 0) {
+        ret = 1;
+        goto force_exit;
+    }
+
+    /* Show the help message for this command if specified. */
+    if (opt.help) {
+        show_usage(fpo, argv0, command);
+        goto force_exit;
+    }
+
+    /* Check for the existence of the input and output files. */
+    if (argc <= arg_used + 1) {
+        fprintf(fpe, "ERROR: No input or output model specified.\n");
+        ret = 1;
+        goto force_exit;
+    }
+    if (opt.version != 1 && opt.version != 2) {
+        fprintf(fpe, "ERROR: Unsupported format version: %d\n", opt.version);
+        ret = 1;
+        goto force_exit;
+    }
+    if (opt.version == 1 && opt.weight_type != CRFSUITE_WEIGHT_FP64) {
+        fprintf(fpe, "ERROR: Quantized weights require the format version 2.\n");
+        ret = 1;
+        goto force_exit;
+    }
+    if (opt.version == 1 && (opt.dict_flag & CRFSUITE_DICT_COMPRESS)) {
+        fprintf(fpe, "ERROR: Compressed attributes require the format version 2.\n");
+        ret = 1;
+        goto force_exit;
+    }
+
+    /* Create a model instance corresponding to the model file. */
+    if ((ret = crfsuite_create_instance_from_file(argv[arg_used], (void**)&model)) != 0) {
+        goto force_exit;
+    }
+
+    /* Store the model in the specified format. */
+    if ((ret = model->write(argv[arg_used+1], opt.version, opt.weight_type, opt.dict_flag)) != 0) {
+        fprintf(fpe, "ERROR: Failed to write the model: %s\n", argv[arg_used+1]);
+        goto force_exit;
+    }
+
+    report_size(fpo, argv[arg_used], argv[arg_used+1]);
+
+    /* Compare the accuracy of the two models if specified. */
+    if (opt.test != NULL) {
+        if ((ret = report_accuracy(fpo, opt.test, model, argv[arg_used+1])) != 0) {
+            fprintf(fpe, "ERROR: Failed to evaluate the models on %s\n", opt.test);
+            goto force_exit;
+        }
+    }
+
+force_exit:
+    if (model != NULL) {
+        model->release();
+    }
+    convert_option_finish(&opt);
+    return ret;
+}
@@ -39,7 +39,7 @@
 #include <crfsuite.h>
 #include "option.h"
 
-#define    SAFE_RELEASE(obj)    if ((obj) != NULL) { (obj)->release(obj); (obj) = NULL; }
+#define    SAFE_RELEASE(obj)    if ((obj) != NULL) { (obj)->release(); (obj) = NULL; }
 
 typedef struct {
     int help;
@@ -108,6 +108,7 @@ int main_dump(int argc, char *argv[], const char *argv0)
     model->dump( fpo);
 
 force_exit:
+    SAFE_RELEASE(model);
     dump_option_finish(&opt);
     return ret;
 }
@@ -73,7 +73,8 @@ static void string_finish(iwa_string_t* str)
 
 static void string_clear(iwa_string_t* str)
 {
-    memset(str->value, 0, str->size);
+    /* Bytes beyond the offset are kept zero. */
+    memset(str->value, 0, str->offset);
     str->offset = 0;
 }
 
@@ -214,6 +215,7 @@ const iwa_token_t* iwa_read(iwa_t* iwa)
 
     /* Initialization. */
     token->attr = NULL;
+    token->attr_len = 0;
     token->value = NULL;
     string_clear(&iwa->attr);
     string_clear(&iwa->value);
@@ -262,6 +264,7 @@ const iwa_token_t* iwa_read(iwa_t* iwa)
                 read_item(iwa);
                 token->type = IWA_ITEM;
                 token->attr = iwa->attr.value;
+                token->attr_len = iwa->attr.offset;
                 token->value = iwa->value.value;
                 break;
             }
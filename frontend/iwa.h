@@ -50,6 +50,7 @@ enum {
 struct tag_iwa_token {
     int type;
     const char *attr;
+    size_t attr_len;    /* Length of attr (attr is also terminated by NUL). */
     const char *value;
 };
 typedef struct tag_iwa_token iwa_token_t;
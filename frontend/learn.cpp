@@ -334,6 +334,24 @@ int main_learn(int argc, char *argv[], const char *argv0)
     strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&ts));
     fprintf(fpo, "Start time of the training: %s\n", timestamp);
 
+    /* Obtain the settings of the feature hashing mode. */
+    AttributeHasher hasher;
+    {
+        int bits = 0, seed = 0;
+        crfsuite_params_t* params = trainer->params();
+        params->get_int(params, "feature.hash_bits", &bits);
+        params->get_int(params, "feature.hash_seed", &seed);
+        params->release(params);
+        try {
+            if (bits != 0) {
+                hasher = AttributeHasher(CRFSUITE_ATTRHASH_FNV1A, bits, (uint32_t)seed);
+            }
+        } catch (const std::exception& e) {
+            fprintf(fpe, "ERROR: %s: %d\n", e.what(), bits);
+            return 1;
+        }
+    }
+
     /* Read the training data. */
     fprintf(fpo, "Reading the data set(s)\n");
     dataset_t ds(0, 0);
@@ -348,7 +366,7 @@ int main_learn(int argc, char *argv[], const char *argv0)
 
         fprintf(fpo, "[%d] %s\n", i-arg_used+1, argv[i]);
         clk_begin = clock();
-        ds = read_data(&attrs, &labels, fp, fpo, i-arg_used);
+        ds = read_data(&attrs, &labels, fp, fpo, i-arg_used, &hasher);
         clk_current = clock();
         fprintf(fpo, "Number of instances: %d\n", n);
         fprintf(fpo, "Seconds required: %.3f\n", (clk_current - clk_begin) / (double)CLOCKS_PER_SEC);
@@ -43,6 +43,8 @@
 int main_learn(int argc, char *argv[], const char *argv0);
 int main_tag(int argc, char *argv[], const char *argv0);
 int main_dump(int argc, char *argv[], const char *argv0);
+int main_convert(int argc, char *argv[], const char *argv0);
+int main_compact(int argc, char *argv[], const char *argv0);
 
 
 
@@ -86,6 +88,8 @@ static void show_usage(FILE *fp, const char *argv0)
     fprintf(fp, "    learn       Obtain a model from a training set of instances\n");
     fprintf(fp, "    tag         Assign suitable labels to given instances by using a model\n");
     fprintf(fp, "    dump        Output a model in a plain-text format\n");
+    fprintf(fp, "    convert     Convert a model to another format version\n");
+    fprintf(fp, "    compact     Prune small weights of a model and re-pack it\n");
     fprintf(fp, "\n");
     fprintf(fp, "For the usage of each command, specify -h option in the command argument.\n");
 }
@@ -128,6 +132,10 @@ int main(int argc, char *argv[])
         return main_tag(argc-arg_used, argv+arg_used, argv0);
     } else if (strcmp(command, "dump") == 0) {
         return main_dump(argc-arg_used, argv+arg_used, argv0);
+    } else if (strcmp(command, "convert") == 0) {
+        return main_convert(argc-arg_used, argv+arg_used, argv0);
+    } else if (strcmp(command, "compact") == 0) {
+        return main_compact(argc-arg_used, argv+arg_used, argv0);
     } else {
         fprintf(fpe, "ERROR: Unrecognized command (%s) specified.\n", command);    
         return 1;
@@ -34,6 +34,6 @@
 #define    __READDATA_H__
 
 crfsuite_dataset_t read_data(TextVectorization*, TextVectorization*,
-    FILE *fpi, FILE *fpo, int group);
+    FILE *fpi, FILE *fpo, int group, const AttributeHasher *hasher = NULL);
 
 #endif/*__READDATA_H__*/
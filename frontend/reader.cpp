@@ -56,7 +56,7 @@ static int progress(FILE *fpo, int prev, int current)
     return prev;
 }
 
-dataset_t read_data(TextVectorization* attrs, TextVectorization*labels, FILE *fpi, FILE *fpo, int group)
+dataset_t read_data(TextVectorization* attrs, TextVectorization*labels, FILE *fpi, FILE *fpo, int group, const AttributeHasher *hasher)
 {
     int n = 0;
     int lid = -1;
@@ -94,14 +94,14 @@ dataset_t read_data(TextVectorization* attrs, TextVectorization*labels, FILE *fp
         case IWA_BOI:
             /* Initialize an item. */
             lid = -1;
-            item.contents.clear();
+            item.clear();
             break;
         case IWA_EOI:
             /* Append the item to the instance. */
             if (0 <= lid) {
                 inst.append(item, lid);
             }
-            item.contents.clear();
+            item.clear();
             break;
         case IWA_ITEM:
             if (lid == -1) {
@@ -119,10 +119,15 @@ dataset_t read_data(TextVectorization* attrs, TextVectorization*labels, FILE *fp
                     }
                 } else {
                     /* Label. */
-                    lid = labels->get(token->attr);
+                    lid = labels->get(std::string_view(token->attr, token->attr_len));
                 }
             } else {
-                cont.aid = attrs->get(token->attr);
+                /* Hash the attribute in the feature hashing mode. */
+                if (hasher != NULL && hasher->enabled()) {
+                    cont.aid = hasher->to_id(std::string_view(token->attr, token->attr_len));
+                } else {
+                    cont.aid = attrs->get(std::string_view(token->attr, token->attr_len));
+                }
                 if (token->value && *token->value) {
                     cont.value = atof(token->value);
                 } else {
@@ -151,5 +156,6 @@ dataset_t read_data(TextVectorization* attrs, TextVectorization*labels, FILE *fp
 
     iwa_delete(iwa);
 
-    return dataset_t(instances, labels->num(), attrs->num());
+    const size_t A = (hasher != NULL && hasher->enabled()) ? hasher->num() : attrs->num();
+    return dataset_t(instances, labels->num(), A);
 }
@@ -214,8 +214,13 @@ output_instance(
 
         for (j = 0;j < inst->items[i].num_contents();++j) {
             const char *attr = NULL;
-            attrs->to_string( inst->items[i].contents[j].aid, &attr);
-            fprintf(fpo, "\t%s:%f", attr, inst->items[i].contents[j].value);
+            attrs->to_string( inst->items[i].aid(j), &attr);
+            if (attr != NULL) {
+                fprintf(fpo, "\t%s:%f", attr, inst->items[i].value(j));
+            } else {
+                /* Hashed attributes have no strings. */
+                fprintf(fpo, "\t#%d:%f", inst->items[i].aid(j), inst->items[i].value(j));
+            }
         }
 
         fprintf(fpo, "\n");
@@ -239,6 +244,12 @@ static int tag(tagger_option_t* opt, crfsuite_model_t* model)
     crfsuite_item_t item;
     crfsuite_attribute_t cont;
     crfsuite_evaluation_t eval;
+    std::string keys;               /* Attribute names of the item. */
+    std::vector<size_t> offsets;    /* Offsets of the names in keys. */
+    std::vector<size_t> lens;       /* Lengths of the names. */
+    std::vector<floatval_t> values; /* Values of the attributes. */
+    std::vector<const char*> strs;
+    std::vector<int> aids;
     char *comment = NULL;
     iwa_t* iwa = NULL;
     const iwa_token_t* token = NULL;
@@ -284,34 +295,53 @@ static int tag(tagger_option_t* opt, crfsuite_model_t* model)
         case IWA_BOI:
             /* Initialize an item. */
             lid = -1;
-            item.contents.clear();
+            item.clear();
+            keys.clear();
+            offsets.clear();
+            lens.clear();
+            values.clear();
             free(comment);
             comment = NULL;
             break;
         case IWA_EOI:
+            /* Resolve the attributes of the item in a batch. */
+            strs.resize(offsets.size());
+            aids.resize(offsets.size());
+            for (size_t i = 0;i < offsets.size();++i) {
+                strs[i] = keys.c_str() + offsets[i];
+            }
+            attrs->to_ids(strs.data(), lens.data(), (int)strs.size(), aids.data());
+            for (size_t i = 0;i < aids.size();++i) {
+                /* Ignore attributes 'unknown' to the model. */
+                if (0 <= aids[i]) {
+                    /* Associate the attribute with the current item. */
+                    cont.aid = aids[i];
+                    cont.value = values[i];
+                    item.append(cont);
+                }
+            }
+
             /* Append the item to the instance. */
             inst.append(item, lid);
-            item.contents.clear();
+            item.clear();
             break;
         case IWA_ITEM:
             if (lid == -1) {
                 /* The first field in a line presents a label. */
-                lid = labels->to_id( token->attr);
+                lid = labels->to_id(std::string_view(token->attr, token->attr_len));
                 if (lid < 0) lid = L;    /* #L stands for a unknown label. */
             } else {
-                /* Fields after the first field present attributes. */
-                int aid = attrs->to_id(token->attr);
-                /* Ignore attributes 'unknown' to the model. */
-                if (0 <= aid) {
-                    /* Associate the attribute with the current item. */
-                    if (token->value && *token->value) {
-                        cont.aid = aid;
-                        cont.value = atof(token->value);
-                    } else {
-                        cont.aid = aid;
-                        cont.value = 1.0;
-                    }
-                    item.append(cont);
+                /*
+                    Fields after the first field present attributes, which
+                    are looked up at the end of the item.
+                 */
+                offsets.push_back(keys.size());
+                lens.push_back(token->attr_len);
+                keys.append(token->attr, token->attr_len);
+                if (token->value && *token->value) {
+                    values.push_back(atof(token->value));
+                } else {
+                    values.push_back(1.0);
                 }
             }
             break;
@@ -371,9 +401,9 @@ force_exit:
     inst.clear();
     crfsuite_evaluation_finish(&eval);
 
-    // SAFE_RELEASE(tagger);
-    // SAFE_RELEASE(attrs);
-    // SAFE_RELEASE(labels);
+    delete tagger;
+    delete attrs;
+    delete labels;
 
     return ret;
 }
@@ -422,7 +452,7 @@ int main_tag(int argc, char *argv[], const char *argv0)
     }
 
 force_exit:
-    // SAFE_RELEASE(model);
+    SAFE_RELEASE(model);
     tagger_option_finish(&opt);
     return ret;
 }
@@ -36,10 +36,16 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <cqdb.h>
+#include <algorithm>
 #include <vector>
 #include <map>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 
 /** 
  * \addtogroup crfsuite_api CRFSuite C API
@@ -90,18 +96,168 @@ enum {
 
 /**@}*/
 
+/**
+ * Hash functions for the feature hashing mode.
+ */
+enum {
+    /** No hashing (attributes are stored in a dictionary). */
+    CRFSUITE_ATTRHASH_NONE = 0,
+    /** 64-bit FNV-1a with a seed, finalized by the splitmix64 mixer. */
+    CRFSUITE_ATTRHASH_FNV1A,
+};
+
+/**
+ * The maximum number of bits of the hashed attribute space, so that
+ * attribute ids fit in int and the id space in memory.
+ */
+#define CRFSUITE_ATTRHASH_MAX_BITS  30
+
+/**
+ * Storage types of state-feature weights in a model file (version 2).
+ */
+enum {
+    /** 64-bit floating-point values. */
+    CRFSUITE_WEIGHT_FP64 = 0,
+    /** IEEE 754 half-precision values. */
+    CRFSUITE_WEIGHT_FP16,
+    /** 8-bit integers with a scale factor per label. */
+    CRFSUITE_WEIGHT_INT8,
+};
+
+/**
+ * Options of the attribute dictionary of a stored model (bitwise OR).
+ */
+enum {
+    /** A plain hash table. */
+    CRFSUITE_DICT_DEFAULT = 0,
+    /** A minimal perfect hash index in addition to the hash table, which
+        bounds every lookup to one probe but is not faster on average
+        (about 8.5 bytes per attribute). */
+    CRFSUITE_DICT_MPH = 0x01,
+    /** Front-coded attribute strings for a smaller dictionary at about
+        twice the lookup cost (version 2 only). */
+    CRFSUITE_DICT_COMPRESS = 0x02,
+};
+
+/**
+ * Parameters and statistics of model compaction.
+ *  @see    tag_crfsuite_model::compact().
+ */
+struct crfsuite_compact_t {
+    /** Drop state features whose absolute weights are smaller than this. */
+    floatval_t  threshold;
+    /** Keep at most this number of state features per attribute (0: all). */
+    int         top_k;
+    /** Drop the state features of the smallest absolute weights until the
+        estimated model size fits in this number of bytes (0: no limit). */
+    uint64_t    target_size;
+    /** The format version of the compacted model (1 or 2). */
+    int         version;
+    /** The storage type of state weights (CRFSUITE_WEIGHT_*). */
+    int         weight_type;
+    /** The options of the attribute dictionary (CRFSUITE_DICT_*). */
+    int         dict_flag;
+
+    /** Number of features before compaction (output). */
+    int         num_features_before;
+    /** Number of features after compaction (output). */
+    int         num_features_after;
+    /** Number of attributes before compaction (output). */
+    int         num_attrs_before;
+    /** Number of attributes after compaction (output). */
+    int         num_attrs_after;
+
+public:
+    crfsuite_compact_t() : threshold(0.), top_k(0), target_size(0), version(2), weight_type(CRFSUITE_WEIGHT_FP64),
+        dict_flag(CRFSUITE_DICT_DEFAULT), num_features_before(0), num_features_after(0), num_attrs_before(0), num_attrs_after(0) {}
+};
+
+/**
+ * Attribute hasher (feature hashing mode).
+ *  Attribute strings are mapped to ids in [0, 2^bits) without a dictionary.
+ */
+struct AttributeHasher {
+    int         type;           /**< Hash function (CRFSUITE_ATTRHASH_*). */
+    int         bits;           /**< Number of bits of the id space. */
+    uint32_t    seed;           /**< Seed of the hash function. */
+public:
+    AttributeHasher(int type = CRFSUITE_ATTRHASH_NONE, int bits = 0, uint32_t seed = 0)
+        : type(type), bits(bits), seed(seed)
+    {
+        if (type != CRFSUITE_ATTRHASH_NONE && (bits < 1 || CRFSUITE_ATTRHASH_MAX_BITS < bits)) {
+            throw std::runtime_error("feature.hash_bits must be in [1, 30] (or 0 to disable)");
+        }
+    }
+
+    bool enabled() const { return this->type != CRFSUITE_ATTRHASH_NONE; }
+
+    int to_id(const char *str) const
+    {
+        return this->to_id(std::string_view(str));
+    }
+
+    int to_id(std::string_view str) const
+    {
+        uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)this->seed * 0x9e3779b97f4a7c15ULL);
+        for (unsigned char c: str) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return (int)(h & (((uint64_t)1 << this->bits) - 1));
+    }
+
+    size_t num() const { return (size_t)1 << this->bits; }
+};
+
  struct StringLookup {
  private:
      cqdb_t*        db;
      size_t n;
+     AttributeHasher hasher;
  public:
      StringLookup(cqdb_t *db, size_t n): db(db), n(n) {}
+     StringLookup(const AttributeHasher& hasher): db(NULL), n(hasher.num()), hasher(hasher) {}
+
+     int to_id(const char *str) const
+     {
+         if (this->hasher.enabled()) {
+             return this->hasher.to_id(str);
+         }
+         return cqdb_to_id(db, str);
+     }
 
-     int to_id(const char *str) const { return cqdb_to_id(db, str); }
+     /* Look up a string that need not be terminated by NUL. */
+     int to_id(std::string_view str) const
+     {
+         if (this->hasher.enabled()) {
+             return this->hasher.to_id(str);
+         }
+         return cqdb_to_id_n(db, str.data(), str.size());
+     }
+
+     /* Look up n strings at once; ids receive negative values for unknown strings. */
+     int to_ids(const char * const *strs, const size_t *lens, int n, int *ids) const
+     {
+         if (this->hasher.enabled()) {
+             for (int i = 0;i < n;++i) {
+                 ids[i] = (lens != NULL) ?
+                     this->hasher.to_id(std::string_view(strs[i], lens[i])) :
+                     this->hasher.to_id(strs[i]);
+             }
+             return n;
+         }
+         return cqdb_to_ids(db, strs, lens, n, ids);
+     }
 
      int to_string(int id, char const **pstr) const
      {
-         *pstr = cqdb_to_string(db, id);
+         /* Attribute strings are not available in the hashing mode. */
+         *pstr = (this->db != NULL) ? cqdb_to_string(db, id) : NULL;
          return 0;
      }
 
@@ -111,23 +267,22 @@ enum {
 
 struct TextVectorization {
 public:
-    int get(const char *str)
+    /* A string is copied only when it is added to the vocabulary. */
+    int get(std::string_view str)
     {
-        auto s = std::string(str);
-        auto it = this->m.find(s);
+        auto it = this->m.find(str);
         if (it != this->m.end()) {
             return it->second;
         } else {
-            this->m[s] = this->v.size();
-            this->v.push_back(s);
+            this->m.emplace(str, this->v.size());
+            this->v.emplace_back(str);
             return this->v.size()-1;
         }
         return 0;
     }
-    int to_id(const char *str) const
+    int to_id(std::string_view str) const
     {
-        auto s = std::string(str);
-        auto it = this->m.find(s);
+        auto it = this->m.find(str);
         if (it != this->m.end()) {
             return it->second;
         }
@@ -149,7 +304,7 @@ public:
     }
     size_t num() const { return this->v.size();}
 private:
-    std::map<std::string, int> m;
+    std::map<std::string, int, std::less<>> m;
     std::vector<std::string> v;
 };
 
@@ -175,6 +330,10 @@ struct tag_crfsuite_params;
 /** CRFSuite parameter interface. */
 typedef struct tag_crfsuite_params crfsuite_params_t;
 
+struct tag_crfsuite_model_handle;
+/** CRFSuite model handle interface. */
+typedef struct tag_crfsuite_model_handle crfsuite_model_handle_t;
+
 /**@}*/
 
 
@@ -199,17 +358,50 @@ public:
 
 /**
  * An item.
- *  An item consists of an array of attributes.
+ *  An item consists of an array of attributes. Most attributes are binary
+ *  (value 1.0); as long as all attributes of an item are binary, the item
+ *  stores their ids only (aids). Once a non-binary attribute is appended,
+ *  all attributes are moved to contents.
  */
 struct crfsuite_item_t {
     /** Number of contents associated with the item. */
-    size_t             num_contents() const { return this->contents.size(); }
+    size_t             num_contents() const { return this->aids.size() + this->contents.size(); }
     /** Maximum number of contents (internal use). */
-    size_t             cap_contents() const { return this->contents.capacity(); }
-    /** Array of the attributes. */
+    size_t             cap_contents() const { return this->is_binary() ? this->aids.capacity() : this->contents.capacity(); }
+    /** Array of the attribute ids (binary items). */
+    std::vector<int>                     aids;
+    /** Array of the attributes (non-binary items). */
     std::vector<crfsuite_attribute_t>    contents;
 public:
-    void append(const crfsuite_attribute_t& cont) { this->contents.push_back(cont); }
+    /** Test whether all attributes in the item are binary. */
+    bool is_binary() const { return this->contents.empty(); }
+    /** Attribute id of the i-th content. */
+    int aid(int i) const { return this->is_binary() ? this->aids[i] : this->contents[i].aid; }
+    /** Value of the i-th content. */
+    floatval_t value(int i) const { return this->is_binary() ? 1.0 : this->contents[i].value; }
+
+    void append(const crfsuite_attribute_t& cont)
+    {
+        if (this->is_binary()) {
+            if (cont.value == 1.0) {
+                this->aids.push_back(cont.aid);
+                return;
+            }
+            /* Switch to the attribute array with values. */
+            this->contents.reserve(this->aids.size() + 1);
+            for (int aid: this->aids) {
+                this->contents.push_back(crfsuite_attribute_t(aid));
+            }
+            this->aids.clear();
+        }
+        this->contents.push_back(cont);
+    }
+
+    void clear()
+    {
+        this->aids.clear();
+        this->contents.clear();
+    }
 };
 
 /**
@@ -249,7 +441,9 @@ public:
 /**
  * A data set.
  *  A data set consists of an array of instances and dictionary objects
- *  for attributes and labels.
+ *  for attributes and labels. Instances are accessed through a permutation
+ *  (view) so that the visiting order can be changed without moving the
+ *  instances; see sort_by_length() and shuffle().
  */
 struct crfsuite_dataset_t{
 private:
@@ -257,12 +451,22 @@ private:
     size_t n_labels;
     size_t n_attrs;
     std::vector<crfsuite_instance_t>     instances;
+    /** Visiting order of the instances. */
+    std::vector<int>    perm;
+    /** Non-zero if the instances are bucketed by their lengths. */
+    int                 bucketed;
+    /** Random engine for shuffle(). */
+    std::mt19937        rng;
 public:
-    crfsuite_dataset_t(size_t L, size_t A) : instances(), n_labels(L), n_attrs(A) {}
-    crfsuite_dataset_t(std::vector<crfsuite_instance_t> v, size_t L, size_t A) : instances(v), n_labels(L), n_attrs(A) {}
+    crfsuite_dataset_t(size_t L, size_t A) : n_labels(L), n_attrs(A), instances(), bucketed(0), rng(0) {}
+    crfsuite_dataset_t(std::vector<crfsuite_instance_t> v, size_t L, size_t A) : n_labels(L), n_attrs(A), instances(v), bucketed(0), rng(0)
+    {
+        this->reset_order();
+    }
     void append(const crfsuite_instance_t& inst)
     {
         if (0 < inst.num_items()) {
+            this->perm.push_back((int)this->instances.size());
             this->instances.push_back(inst);
         }
     }
@@ -285,18 +489,78 @@ public:
             n += inst.num_items();
         return n;
     }
+
+    /**
+     * Restore the original (file) order of the instances.
+     */
+    void reset_order()
+    {
+        this->perm.resize(this->instances.size());
+        for (size_t i = 0;i < this->perm.size();++i) {
+            this->perm[i] = (int)i;
+        }
+        this->bucketed = 0;
+    }
+
+    /**
+     * Order the instances by their lengths.
+     *  Instances of the same length form a bucket, so that consecutive
+     *  instances touch context matrices of the same size. The sort is
+     *  stable, i.e., the file order is kept within a bucket.
+     */
+    void sort_by_length()
+    {
+        std::stable_sort(
+            this->perm.begin(), this->perm.end(),
+            [this](int x, int y) {
+                return this->instances[x].num_items() < this->instances[y].num_items();
+            });
+        this->bucketed = 1;
+    }
+
+    /**
+     * Shuffle the visiting order of the instances.
+     *  If the instances are bucketed by lengths, the instances are shuffled
+     *  within each bucket, and the order of the buckets is shuffled.
+     *  Otherwise, the instances are kept in the file order. The shuffle
+     *  draws from an engine with a fixed seed so that training is
+     *  reproducible.
+     */
     void shuffle() {
-        //     int i;
-        // for (i = 0;i < this->num_instances;++i) {
-        //     int j = rand() % this->num_instances;
-        //     int tmp = this->perm[j];
-        //     this->perm[j] = this->perm[i];
-        //     this->perm[i] = tmp;
-        // }
+        const int n = (int)this->perm.size();
+
+        if (!this->bucketed) {
+            return;
+        }
+
+        /* Shuffle the instances within each bucket. */
+        std::vector<std::pair<int, int> > buckets;
+        for (int i = 0;i < n;) {
+            int j = i + 1;
+            const size_t T = this->instances[this->perm[i]].num_items();
+            while (j < n && this->instances[this->perm[j]].num_items() == T) {
+                ++j;
+            }
+            std::shuffle(this->perm.begin() + i, this->perm.begin() + j, this->rng);
+            buckets.push_back(std::make_pair(i, j));
+            i = j;
+        }
+
+        /* Shuffle the order of the buckets. */
+        std::shuffle(buckets.begin(), buckets.end(), this->rng);
+        std::vector<int> order;
+        order.reserve(n);
+        for (const auto& bucket: buckets) {
+            order.insert(order.end(), this->perm.begin() + bucket.first, this->perm.begin() + bucket.second);
+        }
+        this->perm.swap(order);
     }
+
+    int is_bucketed() const { return this->bucketed; }
+
     crfsuite_instance_t *get(int i)
     {
-        return &this->instances[i];
+        return &this->instances[this->perm[i]];
     }
     size_t size() const { return this->instances.size(); }
     size_t num_labels() const { return this->n_labels; }
@@ -389,8 +653,30 @@ typedef int (*crfsuite_logging_callback)(void *user, const char *format, va_list
  * CRFSuite model interface.
  */
 struct tag_crfsuite_model {
+    virtual ~tag_crfsuite_model() {}
+
+    /**
+     * Increment the reference counter.
+     *  A model is immutable and can be shared by threads; it is created
+     *  with the reference count of one.
+     *  @param  model       The pointer to this model instance.
+     *  @return int         The reference count after this operation.
+     */
+    virtual int addref() = 0;
+
+    /**
+     * Decrement the reference counter.
+     *  The model is destroyed when the count reaches zero.
+     *  @param  model       The pointer to this model instance.
+     *  @return int         The reference count after this operation.
+     */
+    virtual int release() = 0;
+
     /**
      * Obtain the pointer to crfsuite_tagger_t interface.
+     *  A tagger holds a reference to the model and shares its transition
+     *  scores, so it is cheap to create. A tagger must be used by one thread
+     *  at a time; delete it when finished.
      *  @param  model       The pointer to this model instance.
      *  @param  ptr_tagger  The pointer that receives a crfsuite_tagger_t
      *                      pointer.
@@ -423,6 +709,32 @@ struct tag_crfsuite_model {
      *  @return int         The status code.
      */
     virtual void dump(FILE *fpo) = 0;
+
+    /**
+     * Store the model to a file in the specified format version.
+     *  @param  filename    The file name.
+     *  @param  version     The format version (1 or 2).
+     *  @param  weight_type The storage type of state weights
+     *                      (CRFSUITE_WEIGHT_*); quantized types require
+     *                      version 2.
+     *  @param  dict_flag   The options of the attribute dictionary
+     *                      (CRFSUITE_DICT_*).
+     *  @return int         The status code.
+     */
+    virtual int write(const char *filename, int version, int weight_type = CRFSUITE_WEIGHT_FP64, int dict_flag = CRFSUITE_DICT_DEFAULT) = 0;
+
+    /**
+     * Store a compacted model to a file.
+     *  State features are pruned by the magnitudes of their weights, and
+     *  attributes without state features are removed; the remaining
+     *  attributes and features are renumbered. Transition features are
+     *  kept. Attributes are not renumbered in the feature hashing mode.
+     *  @param  filename    The file name.
+     *  @param  param       The parameters, which also receive the
+     *                      statistics of the compaction.
+     *  @return int         The status code.
+     */
+    virtual int compact(const char *filename, crfsuite_compact_t *param) = 0;
 };
 
 /**
@@ -464,6 +776,8 @@ public:
  * CRFSuite tagger interface.
  */
 struct tag_crfsuite_tagger {
+    virtual ~tag_crfsuite_tagger() {}
+
     /**
      * Set an instance to the tagger.
      *  @param  tagger      The pointer to this tagger instance.
@@ -540,6 +854,68 @@ struct tag_crfsuite_tagger {
     virtual floatval_t score(std::vector<int>& path) = 0;
 };
 
+/**
+ * CRFSuite model handle interface.
+ *  A handle refers to the current version of a model, which can be replaced
+ *  with a newly loaded one while taggers are running. Readers take a
+ *  reference to the current version; a reload loads the new version first,
+ *  swaps it in, and drops the reference of the handle to the old version,
+ *  which is destroyed when its last tagger is deleted.
+ */
+struct tag_crfsuite_model_handle {
+    virtual ~tag_crfsuite_model_handle() {}
+
+    /**
+     * Obtain the current version of the model.
+     *  @param  handle      The pointer to this handle instance.
+     *  @return crfsuite_model_t*   The model with its reference count
+     *                      incremented; call release() when finished.
+     */
+    virtual crfsuite_model_t* acquire() = 0;
+
+    /**
+     * Obtain a tagger of the current version of the model.
+     *  The tagger keeps using this version even if the model is reloaded.
+     *  @param  handle      The pointer to this handle instance.
+     *  @return crfsuite_tagger_t*  The tagger; delete it when finished.
+     */
+    virtual crfsuite_tagger_t* get_tagger() = 0;
+
+    /**
+     * Load a model and make it the current version.
+     *  The current version is kept if the model cannot be loaded.
+     *  @param  handle      The pointer to this handle instance.
+     *  @param  filename    The filename of the model, or \c NULL to reload
+     *                      the file of the current version.
+     *  @return int         \c 0 if succeeded, \c 1 otherwise.
+     */
+    virtual int reload(const char *filename) = 0;
+
+    /**
+     * Obtain the number of successful reloads.
+     *  @param  handle      The pointer to this handle instance.
+     *  @return int         The generation of the current version.
+     */
+    virtual int generation() const = 0;
+
+    /**
+     * Obtain the latency of the last reload.
+     *  This is the time from the start of loading the new version until the
+     *  swap, which is also reported to the message callback.
+     *  @param  handle      The pointer to this handle instance.
+     *  @return double      The latency in seconds.
+     */
+    virtual double reload_latency() const = 0;
+
+    /**
+     * Set the callback function and user-defined data.
+     *  @param  handle      The pointer to this handle instance.
+     *  @param  user        The pointer to the user-defined data.
+     *  @param  cbm         The pointer to the callback function.
+     */
+    virtual void set_message_callback(void *user, crfsuite_logging_callback cbm) = 0;
+};
+
 /**
  * CRFSuite parameter interface.
  */
@@ -736,6 +1112,16 @@ int crfsuite_create_instance_from_file(const char *filename, void **ptr);
  */
 int crfsuite_create_instance_from_memory(const void *data, size_t size, void **ptr);
 
+/**
+ * Create a model handle that supports hot reload from a model file.
+ *  @param  filename    The filename of the model.
+ *  @param  ptr         The pointer that receives the handle if successful,
+ *                      \c NULL otherwise.
+ *  @return int         \c 0 if this function creates a handle successfully,
+ *                      \c 1 otherwise.
+ */
+int crfsuite_create_model_handle(const char *filename, crfsuite_model_handle_t **ptr);
+
 /**
  * Create instances of tagging object from a model file.
  *  @param  filename    The filename of the model.
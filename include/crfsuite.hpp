@@ -368,47 +368,50 @@ StringList Tagger::tag(const ItemSequence& xseq)
 
 void Tagger::set(const ItemSequence& xseq)
 {
-    int ret;
-    StringList yseq;
     crfsuite_instance_t _inst;
-    crfsuite_dictionary_t *attrs = NULL;
+    std::vector<const char*> strs;
+    std::vector<size_t> lens;
+    std::vector<int> aids;
 
     if (model == NULL || tagger == NULL) {
         throw std::invalid_argument("The tagger is not opened");
     }
 
     // Obtain the dictionary interface representing the attributes in the model.
-    if ((ret = model->get_attrs(model, &attrs))) {
+    const StringLookup* attrs = model->get_attrs();
+    if (attrs == NULL) {
         throw std::runtime_error("Failed to obtain the dictionary interface for attributes");
     }
 
     // Build an instance.
-    crfsuite_instance_init_n(&_inst, xseq.size());
     for (size_t t = 0;t < xseq.size();++t) {
         const Item& item = xseq[t];
-        crfsuite_item_t* _item = &_inst.items[t];
+        crfsuite_item_t _item;
+
+        // Look up the attributes of the item in a batch.
+        strs.resize(item.size());
+        lens.resize(item.size());
+        aids.resize(item.size());
+        for (size_t i = 0;i < item.size();++i) {
+            strs[i] = item[i].attr.c_str();
+            lens[i] = item[i].attr.size();
+        }
+        attrs->to_ids(strs.data(), lens.data(), (int)item.size(), aids.data());
 
         // Set the attributes in the item.
-        crfsuite_item_init(_item);
         for (size_t i = 0;i < item.size();++i) {
-            int aid = attrs->to_id(attrs, item[i].attr.c_str());
-            if (0 <= aid) {
-                crfsuite_attribute_t cont;
-                crfsuite_attribute_set(&cont, aid, item[i].value);
-                crfsuite_item_append_attribute(_item, &cont);
+            if (0 <= aids[i]) {
+                _item.append(crfsuite_attribute_t(aids[i], item[i].value));
             }
         }
+        _inst.append(_item, 0);
     }
+    delete attrs;
 
     // Set the instance to the tagger.
-    if ((ret = tagger->set(tagger, &_inst))) {
-        crfsuite_instance_finish(&_inst);
-        attrs->release(attrs);
+    if (tagger->set(_inst)) {
         throw std::runtime_error("Failed to set the instance to the tagger.");
     }
-
-    crfsuite_instance_finish(&_inst);
-    attrs->release(attrs);
 }
 
 StringList Tagger::viterbi()
@@ -55,6 +55,10 @@ extern "C" {
 enum {
     CQDB_NONE = 0,                        /**< No flag. */
     CQDB_ONEWAY = 0x00000001,            /**< A reverse lookup array is omitted. */
+    CQDB_OFFSET64 = 0x00000002,          /**< Offsets are 64-bit (chunks larger than 4 GB). */
+    CQDB_MPH = 0x00000004,               /**< A minimal perfect hash index is appended. */
+    CQDB_FASTHASH = 0x00000008,          /**< Keys are hashed by the 64-bit fast hash. */
+    CQDB_COMPRESS = 0x00000010,          /**< Key strings are stored front-coded in sorted blocks. */
     CQDB_ERROR_OCCURRED = 0x00010000,    /**< An error has occurred. */
 };
 
@@ -70,6 +74,7 @@ enum {
     CQDB_ERROR_FILETELL,                /**< Error in ftell() operations. */
     CQDB_ERROR_FILESEEK,                /**< Error in fseek() operations. */
     CQDB_ERROR_INVALIDID,                /**< Invalid parameters. */
+    CQDB_ERROR_OVERFLOW,                /**< Offsets overflow (use ::CQDB_OFFSET64). */
 };
 
 /** @} */
@@ -89,7 +94,38 @@ enum {
  *    By default, the function cqdb_writer() constructs a database with forward
  *    (string to integer identifier) and backward (integer identifier to string)
  *    lookups. The data for reverse lookup is omitted with ::CQDB_ONEWAY flag
- *    specified.
+ *    specified. Offsets in the chunk are 32-bit by default; specify
+ *    ::CQDB_OFFSET64 for a chunk that may exceed 4 GB. The reader detects the
+ *    offset width from the chunk header. Such a chunk has a different chunk
+ *    identifier, so that readers that predate the flag reject it.
+ *
+ *    Specifying ::CQDB_MPH appends a minimal perfect hash index of the keys
+ *    to the chunk, which maps every key to a distinct slot holding the hash
+ *    value and the offset of its record; a lookup then reads a pilot, a slot
+ *    and the record, and never probes more than one slot. This bounds the
+ *    cost of a lookup but does not reduce it on average: the hash tables are
+ *    half full, so most keys are already resolved by a bucket read and a
+ *    record read, and bench_cqdb measures lookups with the index at the same
+ *    or a slightly higher cost. The index takes about 8.5 bytes per key on
+ *    top of the hash tables (about 15% of an attribute dictionary) and is
+ *    built by cqdb_writer_close(). The hash tables are still written, so
+ *    that readers unaware of the index can use the chunk as before. If the
+ *    index cannot be built, the chunk is written without it.
+ *
+ *    Keys are hashed by lookup3 by default. Specifying ::CQDB_FASTHASH
+ *    selects a 64-bit hash function in the style of wyhash, which reads
+ *    keys in words and is several times faster on short keys. The reader
+ *    detects the hash function from the chunk header, so chunks written
+ *    without the flag are read as before. Such a chunk has a different
+ *    chunk identifier, so that readers that predate the flag reject it.
+ *
+ *    Specifying ::CQDB_COMPRESS stores the keys sorted in blocks of 16 keys
+ *    with front coding (each key as the length of the prefix shared with the
+ *    previous key and the rest), instead of a record per key. The writer
+ *    keeps the keys in memory until cqdb_writer_close(). A lookup verifies
+ *    the key against its block without decompressing it; cqdb_to_string()
+ *    decodes a key on the first request and caches it until cqdb_delete().
+ *    The chunk identifier is the same as that of ::CQDB_FASTHASH.
  *
  *    It is recommended to keep the maximum number of identifiers as smallest as
  *    possible because reverse lookup is maintained by a array with the size of
@@ -134,6 +170,28 @@ cqdb_writer_t* cqdb_writer(FILE *fp, int flag);
  */
 int cqdb_writer_put(cqdb_writer_t* dbw, const char *str, int id);
 
+/**
+ * Put an array of string/identifier associations to the database.
+ *
+ *    This function is equivalent to calling cqdb_writer_put() for the
+ *    strings in order, and yields the same database. The strings are hashed,
+ *    partitioned to the hash tables, and serialized by \a num_threads
+ *    threads, and the records are written with a single write for every
+ *    million strings. The threads also encode the hash tables in
+ *    cqdb_writer_close(). The identifiers must be distinct.
+ *
+ *    @param    dbw            The pointer to the ::cqdb_writer_t instance.
+ *    @param    strs           The array of \a n strings; \c NULL elements are
+ *                             skipped.
+ *    @param    ids            The array of \a n identifiers, or \c NULL to use
+ *                             the indices of the strings.
+ *    @param    n              The number of strings.
+ *    @param    num_threads    The number of threads (including the calling
+ *                             thread).
+ *    @retval    int            Zero if successful, or a status code otherwise.
+ */
+int cqdb_writer_put_many(cqdb_writer_t* dbw, const char * const *strs, const int *ids, int n, int num_threads);
+
 /**
  * Close a CQDB writer.
  *
@@ -179,7 +237,10 @@ typedef struct tag_cqdb cqdb_t;        /**< Typedef of a CQDB reader. */
  * Open a new CQDB reader on a memory block.
  *
  *    This function initializes a database on a memory block and returns the
- *    pointer to a ::cqdb_t instance to access the database.
+ *    pointer to a ::cqdb_t instance to access the database. The hash tables
+ *    and the backward links are used in place without being copied, so
+ *    this function takes a constant time; the memory block must be kept
+ *    until the reader is deleted.
  *
  *    @param    buffer        The pointer to the memory block.
  *    @param    size        The size of the memory block.
@@ -199,7 +260,8 @@ void cqdb_delete(cqdb_t* db);
 /**
  * Retrieve the identifier associated with a string.
  *
- *    This function returns the identifier associated with a string.
+ *    This function returns the identifier associated with a string. The
+ *    minimal perfect hash index is used if the chunk has one.
  *
  *    @param    db            The pointer to the ::cqdb_t instance.
  *    @param    str            The pointer to a string.
@@ -208,6 +270,42 @@ void cqdb_delete(cqdb_t* db);
  */
 int cqdb_to_id(cqdb_t* db, const char *str);
 
+/**
+ * Retrieve the identifier associated with a string of a given length.
+ *
+ *    This function is equivalent to cqdb_to_id() except that the string is
+ *    given by a pointer and a length; the string need not be terminated by
+ *    NUL, e.g., a token in an input buffer.
+ *
+ *    @param    db            The pointer to the ::cqdb_t instance.
+ *    @param    str            The pointer to the string.
+ *    @param    len            The length of the string in bytes.
+ *    @retval    int            The non-negative identifier if successful, negative
+ *                        status code otherwise.
+ */
+int cqdb_to_id_n(cqdb_t* db, const char *str, size_t len);
+
+/**
+ * Retrieve the identifiers associated with strings in a batch.
+ *
+ *    This function is equivalent to calling cqdb_to_id() for each string,
+ *    but hashes a batch of keys first, then prefetches their buckets and
+ *    their records before resolving them, so that the memory accesses of
+ *    independent keys overlap. If the lengths of the strings are given, the
+ *    strings need not be terminated by NUL (see cqdb_to_id_n()); otherwise
+ *    the lengths are computed by strlen().
+ *
+ *    @param    db            The pointer to the ::cqdb_t instance.
+ *    @param    strs        The array of pointers to the strings.
+ *    @param    lens        The array of the string lengths, or \c NULL.
+ *    @param    n            The number of the strings.
+ *    @param    ids            The array that receives the identifiers, or
+ *                        ::CQDB_ERROR_NOTFOUND for unknown strings.
+ *    @retval    int            The number of strings found, or a negative
+ *                        status code.
+ */
+int cqdb_to_ids(cqdb_t* db, const char * const *strs, const size_t *lens, int n, int *ids);
+
 /**
  * Retrieve the string associated with an identifier.
  *
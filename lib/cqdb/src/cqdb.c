@@ -38,20 +38,91 @@
 
 #include <cqdb.h>
 
+#if     defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #define CHUNKID             "CQDB"
+#define CHUNKID_EXT         "CQDF"  /* Readers unaware of FLAG_EXT reject the chunk. */
+#define FLAG_EXT            (CQDB_OFFSET64 | CQDB_FASTHASH | CQDB_COMPRESS)
 #define BYTEORDER_CHECK     (0x62445371)
 #define NUM_TABLES          (256)
-#define OFFSET_REFS         (0 + sizeof(header_t))
-#define OFFSET_DATA         (OFFSET_REFS + sizeof(tableref_t) * NUM_TABLES)
+
+/*
+    On-disk sizes of the structures. With CQDB_OFFSET64, the header has the
+    upper halves of size and bwd_offset appended, and offsets in table
+    references, buckets and the backlink array are 64-bit.
+ */
+#define HEADER_SIZE(flag)   (((flag) & CQDB_OFFSET64) ? 32u : 24u)
+#define TABLEREF_SIZE(flag) (((flag) & CQDB_OFFSET64) ? 12u : 8u)
+#define BUCKET_SIZE(flag)   (((flag) & CQDB_OFFSET64) ? 12u : 8u)
+#define OFFSET_SIZE(flag)   (((flag) & CQDB_OFFSET64) ? 8u : 4u)
+#define OFFSET_REFS(flag)   (HEADER_SIZE(flag))
+#define OFFSET_DATA(flag)   (OFFSET_REFS(flag) + TABLEREF_SIZE(flag) * NUM_TABLES)
+
+/*
+    Parameters of the minimal perfect hash index (CQDB_MPH). Keys are
+    distributed to buckets of MPH_KEYS_PER_BUCKET keys on average, skewed so
+    that MPH_DENSE_KEYS percent of the keys fall into MPH_DENSE_BUCKETS
+    percent of the buckets; the slots are searched with a load factor of
+    MPH_LOAD_FACTOR percent. A pilot is stored in 16 bits.
+ */
+#define MPH_KEYS_PER_BUCKET (5)
+#define MPH_DENSE_KEYS      (60)
+#define MPH_DENSE_BUCKETS   (30)
+#define MPH_LOAD_FACTOR     (97)
+#define MPH_MAX_PILOT       (0xFFFF)
+#define MPH_MAX_SEEDS       (8)
+#define MPH_HEADER_SIZE     (16)
+
+/*
+    Parameters of the compressed records (CQDB_COMPRESS). Sorted keys are
+    front-coded in blocks of BLOCK_SIZE keys; strings decoded for reverse
+    lookups are cached in groups of CACHE_BLOCK_SIZE identifiers.
+ */
+#define BLOCK_SIZE          (16)
+#define BLOCKS_HEADER_SIZE  (8)
+#define CACHE_BLOCK_SIZE    (4096)
+
+/*
+    Parameters of cqdb_writer_put_many(). Keys are processed in rounds of
+    ROUND_SIZE keys to bound the memory for the records; a thread handles
+    at least MIN_THREAD_KEYS keys of a round.
+ */
+#define ROUND_SIZE          (1 << 20)
+#define MIN_THREAD_KEYS     (16384)
+
+#if     defined(_WIN32)
+#define cqdb_ftell(fp)              _ftelli64(fp)
+#define cqdb_fseek(fp, off, whence) _fseeki64(fp, off, whence)
+#else
+#define cqdb_ftell(fp)              ftello(fp)
+#define cqdb_fseek(fp, off, whence) fseeko(fp, off, whence)
+#endif
 
 /**
  * An element of a hash table.
  */
 typedef struct {
     uint32_t    hash;       /**< Hash value of the record. */
-    uint32_t    offset;     /**< Offset address to the actual record. */
+    uint32_t    hash2;      /**< Secondary hash value (for CQDB_MPH). */
+    uint64_t    offset;     /**< Offset address to the actual record. */
 } bucket_t;
 
+/**
+ * A key kept by a writer until the keys are sorted (CQDB_COMPRESS).
+ */
+typedef struct {
+    const char* str;        /**< Key string (set when the keys are sorted). */
+    uint64_t    pos;        /**< Position of the key string in the pool. */
+    uint32_t    len;        /**< Length of the key string. */
+    uint32_t    id;         /**< Identifier. */
+    uint32_t    hash;       /**< Hash value of the key. */
+    uint32_t    hash2;      /**< Secondary hash value of the key. */
+} entry_t;
+
 /**
  * A hash table.
  */
@@ -61,23 +132,73 @@ typedef struct {
     bucket_t*   bucket;     /**< Bucket (array of bucket_t). */
 } table_t;
 
+/**
+ * A minimal perfect hash index under construction.
+ */
+typedef struct {
+    uint32_t    num;        /**< Number of keys (slots). */
+    uint32_t    size;       /**< Number of positions searched by pilots. */
+    uint32_t    buckets;    /**< Number of buckets (pilots). */
+    uint32_t    seed;       /**< Seed of the key hash. */
+    uint16_t*   pilot;      /**< Pilots of the buckets. */
+    uint32_t*   remap;      /**< Slots for positions beyond num. */
+    bucket_t*   slot;       /**< Slots. */
+} mph_t;
+
+/**
+ * A hash table of a reader.
+ *  The buckets are used in place in the memory block.
+ */
+typedef struct {
+    uint32_t        num;        /**< Number of buckets in the table. */
+    const uint8_t*  bucket;     /**< Buckets in the memory block. */
+} reader_table_t;
+
+/**
+ * A minimal perfect hash index of a reader.
+ *  The pilots, the remap array and the slots are used in place.
+ */
+typedef struct {
+    uint32_t        num;        /**< Number of keys (slots). */
+    uint32_t        size;       /**< Number of positions searched by pilots. */
+    uint32_t        buckets;    /**< Number of buckets (pilots). */
+    uint32_t        seed;       /**< Seed of the key hash. */
+    const uint8_t*  pilot;      /**< Pilots (16-bit) of the buckets. */
+    const uint8_t*  remap;      /**< Slots for positions beyond num. */
+    const uint8_t*  slot;       /**< Slots (hash value and record offset). */
+} reader_mph_t;
+
+/**
+ * Compressed records of a reader.
+ *  The blocks are decoded in place; strings for reverse lookups are decoded
+ *  on demand and cached.
+ */
+typedef struct {
+    uint32_t        num;        /**< Number of keys. */
+    uint32_t        block_size; /**< Number of keys in a block. */
+    uint32_t        num_blocks; /**< Number of blocks. */
+    const uint8_t*  offsets;    /**< Offsets to the blocks. */
+    void* volatile* cache;      /**< Groups of decoded strings. */
+    uint32_t        cache_size; /**< Number of the groups. */
+} reader_blocks_t;
+
 /**
  * CQDB chunk header.
  */
 typedef struct {
     int8_t      chunkid[4]; /**< Chunk identifier, "CQDB". */
-    uint32_t    size;       /**< Chunk size including this header. */
+    uint64_t    size;       /**< Chunk size including this header. */
     uint32_t    flag;       /**< Global flags. */
     uint32_t    byteorder;  /**< Byte-order indicator. */
     uint32_t    bwd_size;   /**< Number of elements in the backward array. */
-    uint32_t    bwd_offset; /**< Offset to the backward array. */
+    uint64_t    bwd_offset; /**< Offset to the backward array. */
 } header_t;
 
 /**
  * Reference to a hash table.
  */
 typedef struct {
-    uint32_t    offset;     /**< Offset to a hash table. */
+    uint64_t    offset;     /**< Offset to a hash table. */
     uint32_t    num;        /**< Number of elements in the hash table. */
 } tableref_t;
 
@@ -87,13 +208,22 @@ typedef struct {
 struct tag_cqdb_writer {
     uint32_t    flag;           /**< Operation flag. */
     FILE*       fp;             /**< File pointer. */
-    uint32_t    begin;          /**< Offset address to the head of this database. */
-    uint32_t    cur;            /**< Offset address to a new key/data pair. */
+    uint64_t    begin;          /**< Offset address to the head of this database. */
+    uint64_t    cur;            /**< Offset address to a new key/data pair. */
     table_t     ht[NUM_TABLES]; /**< Hash tables (string -> id). */
 
-    uint32_t*   bwd;            /**< Backlink array. */
+    uint64_t*   bwd;            /**< Backlink array. */
     uint32_t    bwd_num;        /**< */
     uint32_t    bwd_size;       /**< Number of elements in the backlink array. */
+
+    entry_t*    keys;           /**< Keys to be compressed (CQDB_COMPRESS). */
+    uint32_t    num_keys;       /**< Number of the keys. */
+    uint32_t    size_keys;      /**< Number of elements in the key array. */
+    char*       pool;           /**< Pool of the key strings. */
+    uint64_t    pool_used;      /**< Used size of the pool. */
+    uint64_t    pool_size;      /**< Size of the pool. */
+
+    int         num_threads;    /**< Number of threads for cqdb_writer_close(). */
 };
 
 /**
@@ -104,18 +234,216 @@ struct tag_cqdb {
     size_t         size;           /**< Size of the memory block. */
 
     header_t       header;         /**< Chunk header. */
-    table_t        ht[NUM_TABLES]; /**< Hash tables (string -> id). */
+    reader_table_t ht[NUM_TABLES]; /**< Hash tables (string -> id). */
 
-    uint32_t*      bwd;            /**< Array for backward look-up (id -> string). */
+    const uint8_t* bwd;            /**< Array for backward look-up (id -> string), in the memory block. */
+    reader_mph_t   mph;            /**< Minimal perfect hash index (string -> id), if any. */
+    reader_blocks_t blocks;        /**< Compressed records, if any. */
 
     int            num;            /**< Number of key/data pairs. */
 };
 
 
+/*
+    The reader resolves buckets and backlinks directly in the memory block,
+    and the fast hash function reads keys in words. Little-endian hosts load
+    the values natively (the block may not be aligned); other hosts assemble
+    them byte by byte.
+ */
+#if     defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CQDB_NATIVE_LOAD    1
+#elif   defined(_WIN32)
+#define CQDB_NATIVE_LOAD    1
+#endif
+
+static uint32_t read_uint32(const uint8_t* p)
+{
+#ifdef  CQDB_NATIVE_LOAD
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+#else
+    uint32_t value;
+    value  = ((uint32_t)p[0]);
+    value |= ((uint32_t)p[1] << 8);
+    value |= ((uint32_t)p[2] << 16);
+    value |= ((uint32_t)p[3] << 24);
+    return value;
+#endif
+}
+
+static uint64_t read_uint64(const uint8_t* p)
+{
+    return (uint64_t)read_uint32(p) | ((uint64_t)read_uint32(p + 4) << 32);
+}
+
 uint32_t hashlittle(const void *key, size_t length, uint32_t initval);
+void hashlittle2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
+
+/*
+    The fast hash function (CQDB_FASTHASH), after wyhash by Wang Yi (public
+    domain). Keys are read in 32-bit or 64-bit little-endian words, so the
+    hash values do not depend on the byte order of the host.
+ */
+static const uint64_t FASTHASH_SECRET[4] = {
+    0x2D358DCCAA6C78A5ULL, 0x8BB84B93962EACC9ULL,
+    0x4B33A62ED433D4A3ULL, 0x4D5A2DA51DE1AA47ULL,
+};
+
+static void fasthash_mum(uint64_t* a, uint64_t* b)
+{
+#if     defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = (t < rl);
+    uint64_t lo = t + (rm1 << 32);
+    c += (lo < t);
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
 
+static uint64_t fasthash_mix(uint64_t a, uint64_t b)
+{
+    fasthash_mum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t fasthash(const void *key, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)key;
+    const uint64_t* secret = FASTHASH_SECRET;
+    uint64_t seed = fasthash_mix(secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = ((uint64_t)read_uint32(p) << 32) | read_uint32(p + ((len >> 3) << 2));
+            b = ((uint64_t)read_uint32(p + len - 4) << 32) | read_uint32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = fasthash_mix(read_uint64(p) ^ secret[1], read_uint64(p + 8) ^ seed);
+                see1 = fasthash_mix(read_uint64(p + 16) ^ secret[2], read_uint64(p + 24) ^ see1);
+                see2 = fasthash_mix(read_uint64(p + 32) ^ secret[3], read_uint64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = fasthash_mix(read_uint64(p) ^ secret[1], read_uint64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read_uint64(p + i - 16);
+        b = read_uint64(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    fasthash_mum(&a, &b);
+    return fasthash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
 
+/*
+    Compute the hash values of a key of len bytes. The lower and upper
+    halves of the fast hash are used with CQDB_FASTHASH. Otherwise, the
+    values of hashlittle2() cover the terminating NUL of the key; a key that
+    may not be terminated by NUL is copied to a buffer with a NUL appended.
+ */
+#define KEY_BUFFER_SIZE (256)
 
+static int hash_key(uint32_t flag, const char *str, size_t len, int terminated, uint32_t* hv, uint32_t* hv2)
+{
+    if (flag & CQDB_FASTHASH) {
+        uint64_t h = fasthash(str, len);
+        *hv = (uint32_t)h;
+        *hv2 = (uint32_t)(h >> 32);
+    } else if (terminated) {
+        *hv = *hv2 = 0;
+        hashlittle2(str, len + 1, hv, hv2);
+    } else {
+        char buffer[KEY_BUFFER_SIZE];
+        char *key = (len < sizeof(buffer)) ? buffer : (char*)malloc(len + 1);
+
+        if (key == NULL) {
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+        memcpy(key, str, len);
+        key[len] = 0;
+        *hv = *hv2 = 0;
+        hashlittle2(key, len + 1, hv, hv2);
+        if (key != buffer) {
+            free(key);
+        }
+    }
+    return 0;
+}
+
+/*
+    Hash functions of the minimal perfect hash index. A key is identified by
+    the two hash values from hash_key(); the primary one is the value used
+    by the hash tables. A bucket and a
+    position are taken from independent halves of the mixed values.
+ */
+static uint64_t mph_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t mph_key(uint32_t hv, uint32_t hv2, uint32_t seed)
+{
+    return mph_mix(((uint64_t)hv2 << 32 | hv) ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL));
+}
+
+static uint32_t mph_bucket(uint64_t key, uint32_t buckets)
+{
+    /* Put MPH_DENSE_KEYS% of keys into MPH_DENSE_BUCKETS% of buckets. */
+    const uint64_t dense = (uint64_t)buckets * MPH_DENSE_BUCKETS / 100;
+    const uint64_t x = key >> 32;
+    const uint64_t threshold = (uint64_t)0x100000000ULL * MPH_DENSE_KEYS / 100;
+    if (x < threshold) {
+        return (uint32_t)(x * dense / threshold);
+    } else {
+        return (uint32_t)(dense + (x - threshold) * (buckets - dense) / (0x100000000ULL - threshold));
+    }
+}
+
+static uint32_t mph_position(uint64_t key, uint32_t pilot, uint32_t size)
+{
+    uint64_t x = mph_mix(key ^ ((uint64_t)pilot * 0xC2B2AE3D27D4EB4FULL));
+    return (uint32_t)(((x & 0xFFFFFFFF) * size) >> 32);
+}
+
+
+
+
+static uint8_t* encode_uint32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)(value & 0xFF);
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + 4;
+}
 
 static size_t write_uint32(cqdb_writer_t* wt, uint32_t value)
 {
@@ -127,6 +455,24 @@ static size_t write_uint32(cqdb_writer_t* wt, uint32_t value)
     return fwrite(buffer, sizeof(uint8_t), 4, wt->fp) / sizeof(value);
 }
 
+static size_t write_uint16(cqdb_writer_t* wt, uint16_t value)
+{
+    uint8_t buffer[2];
+    buffer[0] = (uint8_t)(value & 0xFF);
+    buffer[1] = (uint8_t)(value >> 8);
+    return fwrite(buffer, sizeof(uint8_t), 2, wt->fp) / sizeof(value);
+}
+
+static size_t write_offset(cqdb_writer_t* wt, uint64_t value)
+{
+    /* Offsets are written in 32 or 64 bits, depending on the flag. */
+    size_t ret = write_uint32(wt, (uint32_t)(value & 0xFFFFFFFF));
+    if (wt->flag & CQDB_OFFSET64) {
+        ret &= write_uint32(wt, (uint32_t)(value >> 32));
+    }
+    return ret;
+}
+
 static size_t write_data(cqdb_writer_t* wt, const void *data, size_t size)
 {
     return fwrite(data, size, 1, wt->fp);
@@ -142,8 +488,8 @@ cqdb_writer_t* cqdb_writer(FILE *fp, int flag)
         memset(dbw, 0, sizeof(*dbw));
         dbw->flag = flag;
         dbw->fp = fp;
-        dbw->begin = ftell(dbw->fp);
-        dbw->cur = OFFSET_DATA;
+        dbw->begin = (uint64_t)cqdb_ftell(dbw->fp);
+        dbw->cur = OFFSET_DATA(flag);
 
         /* Initialize the hash tables.*/
         for (i = 0;i < NUM_TABLES;++i) {
@@ -153,9 +499,10 @@ cqdb_writer_t* cqdb_writer(FILE *fp, int flag)
         dbw->bwd = NULL;
         dbw->bwd_num = 0;
         dbw->bwd_size = 0;
+        dbw->num_threads = 1;
 
         /* Move the file pointer to the offset to the first key/data pair. */
-        if (fseek(dbw->fp, dbw->begin + dbw->cur, SEEK_SET) != 0) {
+        if (cqdb_fseek(dbw->fp, dbw->begin + dbw->cur, SEEK_SET) != 0) {
             goto error_exit;    /* Seek error. */
         }
     }
@@ -176,89 +523,864 @@ static int cqdb_writer_delete(cqdb_writer_t* dbw)
         free(dbw->ht[i].bucket);
     }
     free(dbw->bwd);
+    free(dbw->keys);
+    free(dbw->pool);
     free(dbw);
     return 0;
 }
 
+static int table_put(table_t* ht, uint32_t hv, uint32_t hv2, uint64_t offset)
+{
+    /* Expand the bucket if necessary. */
+    if (ht->size <= ht->num) {
+        ht->size = (ht->size+1) * 2;
+        ht->bucket = (bucket_t*)realloc(ht->bucket, sizeof(bucket_t) * ht->size);
+        if (ht->bucket == NULL) {
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+    }
+
+    /* Set the hash value and the offset position. */
+    ht->bucket[ht->num].hash = hv;
+    ht->bucket[ht->num].hash2 = hv2;
+    ht->bucket[ht->num].offset = offset;
+    ++ht->num;
+    return 0;
+}
+
+static int keep_key(cqdb_writer_t* dbw, const char *str, uint32_t len, int id, uint32_t hv, uint32_t hv2)
+{
+    entry_t* entry = NULL;
+
+    /* Expand the key array and the string pool if necessary. */
+    if (dbw->size_keys <= dbw->num_keys) {
+        dbw->size_keys = (dbw->size_keys+1) * 2;
+        dbw->keys = (entry_t*)realloc(dbw->keys, sizeof(entry_t) * dbw->size_keys);
+        if (dbw->keys == NULL) {
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+    }
+    if (dbw->pool_size < dbw->pool_used + len) {
+        while (dbw->pool_size < dbw->pool_used + len) {
+            dbw->pool_size = (dbw->pool_size+1) * 2;
+        }
+        dbw->pool = (char*)realloc(dbw->pool, (size_t)dbw->pool_size);
+        if (dbw->pool == NULL) {
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+    }
+
+    memcpy(dbw->pool + dbw->pool_used, str, len);
+    entry = &dbw->keys[dbw->num_keys++];
+    entry->str = NULL;
+    entry->pos = dbw->pool_used;
+    entry->len = len;
+    entry->id = (uint32_t)id;
+    entry->hash = hv;
+    entry->hash2 = hv2;
+    dbw->pool_used += len;
+    return 0;
+}
+
+static int expand_backlinks(cqdb_writer_t* dbw, int id)
+{
+    if (dbw->bwd_size <= (uint32_t)id) {
+        uint32_t size = dbw->bwd_size;
+
+        while (size <= (uint32_t)id) size = (size + 1) * 2;
+        dbw->bwd = (uint64_t*)realloc(dbw->bwd, sizeof(uint64_t) * size);
+        if (dbw->bwd == NULL) {
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+        while (dbw->bwd_size < size) {
+            dbw->bwd[dbw->bwd_size++] = 0;
+        }
+    }
+
+    if (dbw->bwd_num <= (uint32_t)id) {
+        dbw->bwd_num = (uint32_t)id+1;
+    }
+    return 0;
+}
+
 int cqdb_writer_put(cqdb_writer_t* dbw, const char *str, int id)
 {
     int ret = 0;
     const void *key = str;
     uint32_t ksize = (uint32_t)(strlen(str) + 1);
 
-    /* Compute the hash value and choose a hash table. */
-    uint32_t hv = hashlittle(key, ksize, 0);
-    table_t* ht = &dbw->ht[hv % 256];
+    /* Compute the hash values. */
+    uint32_t hv = 0, hv2 = 0;
+    hash_key(dbw->flag, str, ksize - 1, 1, &hv, &hv2);
+
+    /* Check for non-negative identifier. */
+    if (id < 0) {
+        ret = CQDB_ERROR_INVALIDID;
+        goto error_exit;
+    }
+
+    if (dbw->flag & CQDB_COMPRESS) {
+        /* Keep the key until the keys are sorted by cqdb_writer_close(). */
+        ret = keep_key(dbw, str, ksize - 1, id, hv, hv2);
+        if (ret != 0) {
+            goto error_exit;
+        }
+    } else {
+        /* Write out the current data. */
+        write_uint32(dbw, (uint32_t)id);
+        write_uint32(dbw, (uint32_t)ksize);
+        write_data(dbw, key, ksize);
+        if (ferror(dbw->fp)) {
+            ret = CQDB_ERROR_FILEWRITE;
+            goto error_exit;
+        }
+
+        /* Put the hash value and current offset position to a hash table. */
+        ret = table_put(&dbw->ht[hv % 256], hv, hv2, dbw->cur);
+        if (ret != 0) {
+            goto error_exit;
+        }
+    }
+
+    /* Store the backlink if specified. */
+    if (!(dbw->flag & CQDB_ONEWAY)) {
+        /* Expand the backlink array if necessary. */
+        ret = expand_backlinks(dbw, id);
+        if (ret != 0) {
+            goto error_exit;
+        }
+
+        /* The backlink of a compressed key is set by cqdb_writer_close(). */
+        dbw->bwd[id] = (dbw->flag & CQDB_COMPRESS) ? 0 : dbw->cur;
+    }
+
+    /* Increment the current position. */
+    if (!(dbw->flag & CQDB_COMPRESS)) {
+        dbw->cur += sizeof(uint32_t) + sizeof(uint32_t) + ksize;
+    }
+    return 0;
+
+error_exit:
+    dbw->flag |= CQDB_ERROR_OCCURRED;
+    return ret;
+}
+
+/*
+    Tasks run by run_tasks(): func(ctx, t) for t = 0, ..., n-1. The calling
+    thread runs the task #0; a task whose thread cannot be started is run
+    by the calling thread as well.
+ */
+typedef void (*task_func_t)(void* ctx, int t);
+
+typedef struct {
+    task_func_t func;       /**< Task function. */
+    void*       ctx;        /**< Context shared by the tasks. */
+    int         t;          /**< Task number. */
+    int         started;    /**< Non-zero if a thread runs the task. */
+#if     defined(_WIN32)
+    HANDLE      thread;     /**< Thread handle. */
+#else
+    pthread_t   thread;     /**< Thread handle. */
+#endif
+} worker_t;
+
+#if     defined(_WIN32)
+static DWORD WINAPI worker_main(LPVOID arg)
+{
+    worker_t* worker = (worker_t*)arg;
+    worker->func(worker->ctx, worker->t);
+    return 0;
+}
+#else
+static void* worker_main(void* arg)
+{
+    worker_t* worker = (worker_t*)arg;
+    worker->func(worker->ctx, worker->t);
+    return NULL;
+}
+#endif
+
+static void run_tasks(task_func_t func, void* ctx, int n)
+{
+    int t;
+    worker_t* workers = (1 < n) ? (worker_t*)calloc(n, sizeof(worker_t)) : NULL;
+
+    if (workers == NULL) {
+        for (t = 0;t < n;++t) {
+            func(ctx, t);
+        }
+        return;
+    }
+
+    for (t = 1;t < n;++t) {
+        workers[t].func = func;
+        workers[t].ctx = ctx;
+        workers[t].t = t;
+#if     defined(_WIN32)
+        workers[t].thread = CreateThread(NULL, 0, worker_main, &workers[t], 0, NULL);
+        workers[t].started = (workers[t].thread != NULL);
+#else
+        workers[t].started = (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) == 0);
+#endif
+    }
+
+    func(ctx, 0);
+
+    for (t = 1;t < n;++t) {
+        if (workers[t].started) {
+#if     defined(_WIN32)
+            WaitForSingleObject(workers[t].thread, INFINITE);
+            CloseHandle(workers[t].thread);
+#else
+            pthread_join(workers[t].thread, NULL);
+#endif
+        } else {
+            func(ctx, t);
+        }
+    }
+    free(workers);
+}
+
+/**
+ * The keys of a round of cqdb_writer_put_many() handled by a thread.
+ */
+typedef struct {
+    int         begin;              /**< Index of the first key. */
+    int         end;                /**< Index of the last key plus one. */
+    uint32_t    num[NUM_TABLES];    /**< Number of the keys for each table. */
+    uint32_t    pos[NUM_TABLES];    /**< Position of the next bucket in each table. */
+    uint32_t    count;              /**< Number of the keys. */
+    uint32_t    key;                /**< Index of the next kept key (CQDB_COMPRESS). */
+    uint64_t    size;               /**< Size of the records (or the key strings). */
+    uint64_t    offset;             /**< Offset of the next record (or the position in the pool). */
+    int         max_id;             /**< Maximum identifier. */
+    int         ret;                /**< Status code. */
+} share_t;
+
+/**
+ * A round of cqdb_writer_put_many().
+ */
+typedef struct {
+    cqdb_writer_t*      dbw;        /**< Writer. */
+    const char * const *strs;       /**< Key strings. */
+    const int*          ids;        /**< Identifiers (or NULL for the indices). */
+    int                 begin;      /**< Index of the first key of the round. */
+    uint32_t*           hash;       /**< Hash values of the keys of the round. */
+    uint32_t*           ksize;      /**< Sizes of the keys of the round. */
+    uint8_t*            data;       /**< Records of the round. */
+    share_t*            shares;     /**< Keys handled by the threads. */
+} round_t;
+
+/* Hash the keys and count them for each table. */
+static void hash_share(void* ctx, int t)
+{
+    int i;
+    round_t* round = (round_t*)ctx;
+    share_t* share = &round->shares[t];
+    const uint32_t flag = round->dbw->flag;
+
+    for (i = share->begin;i < share->end;++i) {
+        const int k = i - round->begin;
+        const int id = (round->ids != NULL) ? round->ids[i] : i;
+        const char *str = round->strs[i];
+        size_t len;
+
+        if (str == NULL) {
+            continue;
+        }
+        if (id < 0) {
+            share->ret = CQDB_ERROR_INVALIDID;
+            return;
+        }
+
+        len = strlen(str);
+        hash_key(flag, str, len, 1, &round->hash[2*k], &round->hash[2*k+1]);
+        round->ksize[k] = (uint32_t)(len + 1);
+        ++share->count;
+        if (flag & CQDB_COMPRESS) {
+            /* The buckets of compressed keys are filled by cqdb_writer_close(). */
+            share->size += len;
+        } else {
+            ++share->num[round->hash[2*k] % 256];
+            share->size += sizeof(uint32_t) * 2 + len + 1;
+        }
+        if (share->max_id < id) {
+            share->max_id = id;
+        }
+    }
+}
+
+/* Serialize the records (or keep the keys) and fill the buckets. */
+static void put_share(void* ctx, int t)
+{
+    int i;
+    round_t* round = (round_t*)ctx;
+    share_t* share = &round->shares[t];
+    cqdb_writer_t* dbw = round->dbw;
+    const uint64_t base = dbw->cur;
+
+    for (i = share->begin;i < share->end;++i) {
+        const int k = i - round->begin;
+        const int id = (round->ids != NULL) ? round->ids[i] : i;
+        const char *str = round->strs[i];
+        const uint32_t hv = round->hash[2*k], hv2 = round->hash[2*k+1];
+        const uint32_t ksize = round->ksize[k];
+
+        if (str == NULL) {
+            continue;
+        }
+
+        if (dbw->flag & CQDB_COMPRESS) {
+            entry_t* entry = &dbw->keys[share->key++];
+            memcpy(dbw->pool + share->offset, str, ksize - 1);
+            entry->str = NULL;
+            entry->pos = share->offset;
+            entry->len = ksize - 1;
+            entry->id = (uint32_t)id;
+            entry->hash = hv;
+            entry->hash2 = hv2;
+            share->offset += ksize - 1;
+            if (!(dbw->flag & CQDB_ONEWAY)) {
+                dbw->bwd[id] = 0;
+            }
+        } else {
+            uint8_t* p = round->data + (share->offset - base);
+            bucket_t* bucket = &dbw->ht[hv % 256].bucket[share->pos[hv % 256]++];
+            p = encode_uint32(p, (uint32_t)id);
+            p = encode_uint32(p, ksize);
+            memcpy(p, str, ksize);
+            bucket->hash = hv;
+            bucket->hash2 = hv2;
+            bucket->offset = share->offset;
+            if (!(dbw->flag & CQDB_ONEWAY)) {
+                dbw->bwd[id] = share->offset;
+            }
+            share->offset += sizeof(uint32_t) * 2 + ksize;
+        }
+    }
+}
+
+/* Make room for the keys of a round counted by hash_share(). */
+static int reserve_round(round_t* round, int T, uint64_t* data_size)
+{
+    int i, t;
+    cqdb_writer_t* dbw = round->dbw;
+    uint64_t size = 0, offset = 0;
+    uint32_t count = 0;
+    int max_id = -1;
+
+    for (t = 0;t < T;++t) {
+        if (round->shares[t].ret != 0) {
+            return round->shares[t].ret;
+        }
+        if (max_id < round->shares[t].max_id) {
+            max_id = round->shares[t].max_id;
+        }
+    }
+
+    /* Positions of the buckets of each thread in the tables. */
+    for (i = 0;i < NUM_TABLES;++i) {
+        table_t* ht = &dbw->ht[i];
+        uint32_t num = ht->num;
+        for (t = 0;t < T;++t) {
+            round->shares[t].pos[i] = num;
+            num += round->shares[t].num[i];
+        }
+        if (ht->size < num) {
+            uint32_t size = ht->size;
+            while (size < num) size = (size+1) * 2;
+            ht->bucket = (bucket_t*)realloc(ht->bucket, sizeof(bucket_t) * size);
+            if (ht->bucket == NULL) {
+                return CQDB_ERROR_OUTOFMEMORY;
+            }
+            ht->size = size;
+        }
+        ht->num = num;
+    }
+
+    /* Offsets of the records (or positions in the pool) of each thread. */
+    offset = (dbw->flag & CQDB_COMPRESS) ? dbw->pool_used : dbw->cur;
+    for (t = 0;t < T;++t) {
+        round->shares[t].offset = offset;
+        round->shares[t].key = dbw->num_keys + count;
+        offset += round->shares[t].size;
+        size += round->shares[t].size;
+        count += round->shares[t].count;
+    }
+
+    if (dbw->flag & CQDB_COMPRESS) {
+        if (dbw->size_keys < dbw->num_keys + count) {
+            dbw->size_keys = dbw->num_keys + count;
+            dbw->keys = (entry_t*)realloc(dbw->keys, sizeof(entry_t) * dbw->size_keys);
+            if (dbw->keys == NULL) {
+                return CQDB_ERROR_OUTOFMEMORY;
+            }
+        }
+        if (dbw->pool_size < dbw->pool_used + size) {
+            while (dbw->pool_size < dbw->pool_used + size) {
+                dbw->pool_size = (dbw->pool_size+1) * 2;
+            }
+            dbw->pool = (char*)realloc(dbw->pool, (size_t)dbw->pool_size);
+            if (dbw->pool == NULL) {
+                return CQDB_ERROR_OUTOFMEMORY;
+            }
+        }
+    } else if (*data_size < size) {
+        free(round->data);
+        round->data = (uint8_t*)malloc((size_t)size);
+        if (round->data == NULL) {
+            *data_size = 0;
+            return CQDB_ERROR_OUTOFMEMORY;
+        }
+        *data_size = size;
+    }
+
+    if (0 <= max_id && !(dbw->flag & CQDB_ONEWAY)) {
+        return expand_backlinks(dbw, max_id);
+    }
+    return 0;
+}
+
+int cqdb_writer_put_many(cqdb_writer_t* dbw, const char * const *strs, const int *ids, int n, int num_threads)
+{
+    int t, ret = 0;
+    round_t round;
+    uint64_t data_size = 0;
+    const int max_threads = (1 < num_threads) ? num_threads : 1;
+
+    memset(&round, 0, sizeof(round));
+    round.dbw = dbw;
+    round.strs = strs;
+    round.ids = ids;
+    round.hash = (uint32_t*)malloc(sizeof(uint32_t) * 2 * ROUND_SIZE);
+    round.ksize = (uint32_t*)malloc(sizeof(uint32_t) * ROUND_SIZE);
+    round.shares = (share_t*)malloc(sizeof(share_t) * max_threads);
+    if (round.hash == NULL || round.ksize == NULL || round.shares == NULL) {
+        ret = CQDB_ERROR_OUTOFMEMORY;
+        goto error_exit;
+    }
+
+    /* cqdb_writer_close() encodes the hash tables with the same threads. */
+    if (dbw->num_threads < max_threads) {
+        dbw->num_threads = max_threads;
+    }
+
+    for (round.begin = 0;round.begin < n;round.begin += ROUND_SIZE) {
+        const int m = (n - round.begin < ROUND_SIZE) ? n - round.begin : ROUND_SIZE;
+        int T = m / MIN_THREAD_KEYS;
+        uint64_t size = 0;
+        uint32_t count = 0;
+
+        /* Split the round into contiguous ranges, one for each thread. */
+        T = (T < 1) ? 1 : ((max_threads < T) ? max_threads : T);
+        memset(round.shares, 0, sizeof(share_t) * T);
+        for (t = 0;t < T;++t) {
+            round.shares[t].begin = round.begin + (int)((int64_t)m * t / T);
+            round.shares[t].end = round.begin + (int)((int64_t)m * (t+1) / T);
+            round.shares[t].max_id = -1;
+        }
+
+        run_tasks(hash_share, &round, T);
+        ret = reserve_round(&round, T, &data_size);
+        if (ret != 0) {
+            goto error_exit;
+        }
+        run_tasks(put_share, &round, T);
+
+        /*
+            The records and the buckets are in the same order as those put
+            by cqdb_writer_put() for the keys one by one.
+         */
+        for (t = 0;t < T;++t) {
+            size += round.shares[t].size;
+            count += round.shares[t].count;
+        }
+        if (dbw->flag & CQDB_COMPRESS) {
+            dbw->num_keys += count;
+            dbw->pool_used += size;
+        } else {
+            if (0 < size) {
+                write_data(dbw, round.data, (size_t)size);
+            }
+            if (ferror(dbw->fp)) {
+                ret = CQDB_ERROR_FILEWRITE;
+                goto error_exit;
+            }
+            dbw->cur += size;
+        }
+    }
+
+    free(round.data);
+    free(round.shares);
+    free(round.ksize);
+    free(round.hash);
+    return 0;
+
+error_exit:
+    free(round.data);
+    free(round.shares);
+    free(round.ksize);
+    free(round.hash);
+    dbw->flag |= CQDB_ERROR_OCCURRED;
+    return ret;
+}
+
+static int compare_entries(const void *x, const void *y)
+{
+    const entry_t* a = (const entry_t*)x;
+    const entry_t* b = (const entry_t*)y;
+    int ret = memcmp(a->str, b->str, (a->len < b->len) ? a->len : b->len);
+    if (ret == 0) {
+        ret = (a->len < b->len) ? -1 : (a->len > b->len);
+    }
+    return ret;
+}
+
+static size_t put_varint(uint8_t* p, uint32_t value)
+{
+    size_t n = 0;
+    while (0x80 <= value) {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+/*
+    Sort the keys and write them in blocks of BLOCK_SIZE keys with front
+    coding. An entry in a block consists of the length of the prefix shared
+    with the previous key, the length and the bytes of the remaining suffix,
+    and the identifier, with the lengths and the identifier stored in
+    variable-length integers. The blocks are preceded by the number of keys,
+    the block size, and the offsets to the blocks. Buckets and backlinks of
+    the compressed keys hold the rank of the key in the sorted order plus
+    one, instead of the offset to the record.
+ */
+static int write_blocks(cqdb_writer_t* dbw)
+{
+    int ret = 0;
+    uint32_t i, b;
+    const uint32_t n = dbw->num_keys;
+    const uint32_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t* offsets = (uint64_t*)malloc(sizeof(uint64_t) * (num_blocks + 1));
+    uint8_t* data = NULL;
+    uint64_t used = 0, size = 0, base = 0;
+
+    if (offsets == NULL) {
+        return CQDB_ERROR_OUTOFMEMORY;
+    }
+
+    for (i = 0;i < n;++i) {
+        dbw->keys[i].str = dbw->pool + dbw->keys[i].pos;
+    }
+    qsort(dbw->keys, n, sizeof(entry_t), compare_entries);
+
+    for (i = 0;i < n;++i) {
+        const entry_t* entry = &dbw->keys[i];
+        uint32_t prefix = 0;
+
+        /* Put the rank of the key to a hash table and the backlink array. */
+        ret = table_put(&dbw->ht[entry->hash % 256], entry->hash, entry->hash2, (uint64_t)i + 1);
+        if (ret != 0) {
+            goto exit;
+        }
+        if (!(dbw->flag & CQDB_ONEWAY)) {
+            dbw->bwd[entry->id] = (uint64_t)i + 1;
+        }
+
+        /* Compute the prefix shared with the previous key in the block. */
+        if (i % BLOCK_SIZE == 0) {
+            offsets[i / BLOCK_SIZE] = used;
+        } else {
+            const entry_t* prev = entry - 1;
+            const uint32_t m = (prev->len < entry->len) ? prev->len : entry->len;
+            while (prefix < m && prev->str[prefix] == entry->str[prefix]) {
+                ++prefix;
+            }
+        }
+
+        /* Expand the buffer if necessary, and encode the entry. */
+        if (size < used + 15 + (entry->len - prefix)) {
+            while (size < used + 15 + (entry->len - prefix)) {
+                size = (size+1) * 2;
+            }
+            data = (uint8_t*)realloc(data, (size_t)size);
+            if (data == NULL) {
+                ret = CQDB_ERROR_OUTOFMEMORY;
+                goto exit;
+            }
+        }
+        used += put_varint(data + used, prefix);
+        used += put_varint(data + used, entry->len - prefix);
+        memcpy(data + used, entry->str + prefix, entry->len - prefix);
+        used += entry->len - prefix;
+        used += put_varint(data + used, entry->id);
+    }
+
+    /* Write the number of keys, the block size, the offsets and the blocks. */
+    base = OFFSET_DATA(dbw->flag) + BLOCKS_HEADER_SIZE + (uint64_t)num_blocks * OFFSET_SIZE(dbw->flag);
+    write_uint32(dbw, n);
+    write_uint32(dbw, BLOCK_SIZE);
+    for (b = 0;b < num_blocks;++b) {
+        write_offset(dbw, base + offsets[b]);
+    }
+    if (0 < used) {
+        write_data(dbw, data, (size_t)used);
+    }
+    if (ferror(dbw->fp)) {
+        ret = CQDB_ERROR_FILEWRITE;
+        goto exit;
+    }
+    dbw->cur = base + used;
+
+exit:
+    free(data);
+    free(offsets);
+    return ret;
+}
+
+static void mph_finish(mph_t* mph)
+{
+    free(mph->pilot);
+    free(mph->remap);
+    free(mph->slot);
+    memset(mph, 0, sizeof(*mph));
+}
 
-    /* Check for non-negative identifier. */
-    if (id < 0) {
-        ret = CQDB_ERROR_INVALIDID;
-        goto error_exit;
+/*
+    Build a minimal perfect hash index of the keys in the hash tables, in
+    the way of PTHash: buckets are processed in the descending order of
+    their sizes, and each bucket gets the smallest pilot that places all
+    of its keys at vacant positions. Positions beyond the number of keys
+    are then remapped to the vacant slots so that the index is minimal.
+    This returns CQDB_ERROR if no pilot is found with any seed.
+ */
+static int mph_build(mph_t* mph, const cqdb_writer_t* dbw)
+{
+    int ret = CQDB_ERROR;
+    uint32_t i, j, k, n = 0, seed;
+    bucket_t* src = NULL;       /* Keys. */
+    uint64_t* hkey = NULL;      /* Key hashes for the current seed. */
+    uint32_t* kbucket = NULL;   /* Buckets of the keys. */
+    uint32_t* start = NULL;     /* Offsets of the buckets in order. */
+    uint32_t* order = NULL;     /* Keys sorted by buckets. */
+    uint32_t* sorted = NULL;    /* Buckets sorted by sizes. */
+    uint32_t* pos = NULL;       /* Positions of the keys. */
+    uint8_t* taken = NULL;      /* Occupied positions. */
+
+    memset(mph, 0, sizeof(*mph));
+    for (i = 0;i < NUM_TABLES;++i) {
+        n += dbw->ht[i].num;
+    }
+    if (n == 0) {
+        return CQDB_ERROR;
     }
 
-    /* Write out the current data. */
-    write_uint32(dbw, (uint32_t)id);
-    write_uint32(dbw, (uint32_t)ksize);
-    write_data(dbw, key, ksize);
-    if (ferror(dbw->fp)) {
-        ret = CQDB_ERROR_FILEWRITE;
-        goto error_exit;
+    mph->num = n;
+    mph->size = (uint32_t)((uint64_t)n * 100 / MPH_LOAD_FACTOR);
+    mph->buckets = (n + MPH_KEYS_PER_BUCKET - 1) / MPH_KEYS_PER_BUCKET;
+
+    src = (bucket_t*)malloc(sizeof(bucket_t) * n);
+    hkey = (uint64_t*)malloc(sizeof(uint64_t) * n);
+    kbucket = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    start = (uint32_t*)malloc(sizeof(uint32_t) * ((size_t)mph->buckets + 1));
+    order = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    sorted = (uint32_t*)malloc(sizeof(uint32_t) * mph->buckets);
+    pos = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    taken = (uint8_t*)malloc(mph->size);
+    mph->pilot = (uint16_t*)calloc(mph->buckets, sizeof(uint16_t));
+    mph->remap = (uint32_t*)calloc((size_t)(mph->size - n) + 1, sizeof(uint32_t));
+    mph->slot = (bucket_t*)calloc(n, sizeof(bucket_t));
+    if (src == NULL || hkey == NULL || kbucket == NULL || start == NULL ||
+        order == NULL || sorted == NULL || pos == NULL || taken == NULL ||
+        mph->pilot == NULL || mph->remap == NULL || mph->slot == NULL) {
+        ret = CQDB_ERROR_OUTOFMEMORY;
+        goto exit;
     }
 
-    /* Expand the bucket if necessary. */
-    if (ht->size <= ht->num) {
-        ht->size = (ht->size+1) * 2;
-        ht->bucket = (bucket_t*)realloc(ht->bucket, sizeof(bucket_t) * ht->size);
-        if (ht->bucket == NULL) {
-            ret = CQDB_ERROR_OUTOFMEMORY;
-            goto error_exit;
+    for (i = 0, k = 0;i < NUM_TABLES;++i) {
+        for (j = 0;j < dbw->ht[i].num;++j) {
+            src[k++] = dbw->ht[i].bucket[j];
         }
     }
 
-    /* Set the hash value and current offset position. */
-    ht->bucket[ht->num].hash = hv;
-    ht->bucket[ht->num].offset = dbw->cur;
-    ++ht->num;
+    for (seed = 0;seed < MPH_MAX_SEEDS;++seed) {
+        uint32_t b, maxsize = 0;
+        int found = 1;
 
-    /* Store the backlink if specified. */
-    if (!(dbw->flag & CQDB_ONEWAY)) {
-        /* Expand the backlink array if necessary. */
-        if (dbw->bwd_size <= (uint32_t)id) {
-            uint32_t size = dbw->bwd_size;
+        /* Distribute the keys to the buckets (counting sort). */
+        memset(start, 0, sizeof(uint32_t) * ((size_t)mph->buckets + 1));
+        for (k = 0;k < n;++k) {
+            hkey[k] = mph_key(src[k].hash, src[k].hash2, seed);
+            kbucket[k] = mph_bucket(hkey[k], mph->buckets);
+            ++start[kbucket[k]+1];
+        }
+        for (b = 0;b < mph->buckets;++b) {
+            if (maxsize < start[b+1]) maxsize = start[b+1];
+            start[b+1] += start[b];
+        }
+        for (k = 0;k < n;++k) {
+            order[start[kbucket[k]]++] = k;
+        }
+        for (b = mph->buckets;0 < b;--b) {
+            start[b] = start[b-1];
+        }
+        start[0] = 0;
 
-            while (size <= (uint32_t)id) size = (size + 1) * 2;
-            dbw->bwd = (uint32_t*)realloc(dbw->bwd, sizeof(uint32_t) * size);
-            if (dbw->bwd == NULL) {
-                ret = CQDB_ERROR_OUTOFMEMORY;
-                goto error_exit;
+        /* Sort the buckets in the descending order of their sizes. */
+        for (k = 0, i = maxsize;0 < i;--i) {
+            for (b = 0;b < mph->buckets;++b) {
+                if (start[b+1] - start[b] == i) {
+                    sorted[k++] = b;
+                }
             }
-            while (dbw->bwd_size < size) {
-                dbw->bwd[dbw->bwd_size++] = 0;
+        }
+
+        /* Find the pilot of each bucket. */
+        memset(taken, 0, mph->size);
+        for (i = 0;i < k && found;++i) {
+            uint32_t pilot;
+            b = sorted[i];
+            found = 0;
+            for (pilot = 0;pilot <= MPH_MAX_PILOT;++pilot) {
+                for (j = start[b];j < start[b+1];++j) {
+                    uint32_t q = mph_position(hkey[order[j]], pilot, mph->size);
+                    if (taken[q]) break;
+                    taken[q] = 1;
+                    pos[order[j]] = q;
+                }
+                if (j == start[b+1]) {
+                    mph->pilot[b] = (uint16_t)pilot;
+                    found = 1;
+                    break;
+                }
+                /* Release the positions taken by this pilot. */
+                while (start[b] < j) {
+                    taken[pos[order[--j]]] = 0;
+                }
             }
         }
 
-        if (dbw->bwd_num <= (uint32_t)id) {
-            dbw->bwd_num = (uint32_t)id+1;
+        if (found) {
+            break;
         }
+    }
 
-        dbw->bwd[id] = dbw->cur;
+    if (seed == MPH_MAX_SEEDS) {
+        ret = CQDB_ERROR;
+        goto exit;
     }
+    mph->seed = seed;
 
-    /* Increment the current position. */
-    dbw->cur += sizeof(uint32_t) + sizeof(uint32_t) + ksize;
-    return 0;
+    /* Remap the positions beyond the number of keys to vacant slots. */
+    for (i = n, j = 0;i < mph->size;++i) {
+        if (taken[i]) {
+            while (taken[j]) ++j;
+            mph->remap[i - n] = j++;
+        }
+    }
 
-error_exit:
-    dbw->flag |= CQDB_ERROR_OCCURRED;
+    /* Store the keys in their slots. */
+    for (k = 0;k < n;++k) {
+        uint32_t q = pos[k];
+        if (n <= q) {
+            q = mph->remap[q - n];
+        }
+        mph->slot[q] = src[k];
+    }
+    ret = 0;
+
+exit:
+    free(taken);
+    free(pos);
+    free(sorted);
+    free(order);
+    free(start);
+    free(kbucket);
+    free(hkey);
+    free(src);
+    if (ret != 0) {
+        mph_finish(mph);
+    }
     return ret;
 }
 
+/**
+ * Images of the hash tables encoded in parallel by cqdb_writer_close().
+ */
+typedef struct {
+    const cqdb_writer_t*    dbw;                /**< Writer. */
+    uint32_t                first;              /**< Index of the first table. */
+    uint32_t                num;                /**< Number of the tables. */
+    uint8_t*                image[NUM_TABLES];  /**< Images of the tables. */
+} images_t;
+
+static void encode_table(void* ctx, int t)
+{
+    uint32_t j, k;
+    images_t* images = (images_t*)ctx;
+    const uint32_t flag = images->dbw->flag;
+    const table_t* ht = &images->dbw->ht[images->first + t];
+
+    /* Do not write empty hash tables. */
+    if (ht->bucket != NULL) {
+        /*
+            Actual bucket will have the double size; half elements
+            in the bucket are kept empty.
+         */
+        const uint32_t n = ht->num * 2;
+        bucket_t* dst = NULL;
+        uint8_t* p = NULL;
+
+        /* Allocate the bucket and the image. */
+        dst = (bucket_t*)calloc(n, sizeof(bucket_t));
+        p = (uint8_t*)malloc((size_t)n * BUCKET_SIZE(flag) + 1);
+        if (dst == NULL || p == NULL) {
+            free(dst);
+            free(p);
+            return;
+        }
+        images->image[t] = p;
+
+        /*
+            Put hash elements to the bucket with the open-address method.
+         */
+        for (j = 0;j < ht->num;++j) {
+            const bucket_t* src = &ht->bucket[j];
+            k = (src->hash >> 8) % n;
+
+            /* Find a vacant element. */
+            while (dst[k].offset != 0) {
+                k = (k+1) % n;
+            }
+
+            /* Store the hash element. */
+            dst[k].hash = src->hash;
+            dst[k].offset = src->offset;
+        }
+
+        /* Encode the bucket. */
+        for (k = 0;k < n;++k) {
+            p = encode_uint32(p, dst[k].hash);
+            p = encode_uint32(p, (uint32_t)(dst[k].offset & 0xFFFFFFFF));
+            if (flag & CQDB_OFFSET64) {
+                p = encode_uint32(p, (uint32_t)(dst[k].offset >> 32));
+            }
+        }
+
+        /* Free the bucket. */
+        free(dst);
+    }
+}
+
 int cqdb_writer_close(cqdb_writer_t* dbw)
 {
     uint32_t i, j;
-    int k, ret = 0;
-    long offset = 0;
+    int ret = 0;
+    int64_t offset = 0;
     header_t header;
+    images_t images;
 
     /* If an error have occurred, just free the memory blocks. */
     if (dbw->flag & CQDB_ERROR_OCCURRED) {
@@ -267,69 +1389,91 @@ int cqdb_writer_close(cqdb_writer_t* dbw)
     }
 
     /* Initialize the file header. */
-    strncpy((char*)header.chunkid, CHUNKID, 4);
-    header.flag = 0;
+    strncpy((char*)header.chunkid, (dbw->flag & FLAG_EXT) ? CHUNKID_EXT : CHUNKID, 4);
+    header.flag = dbw->flag & (CQDB_OFFSET64 | CQDB_MPH | FLAG_EXT);
     header.byteorder = BYTEORDER_CHECK;
     header.bwd_offset = 0;
     header.bwd_size = dbw->bwd_num;
 
+    /* Write the compressed records if specified. */
+    if (dbw->flag & CQDB_COMPRESS) {
+        ret = write_blocks(dbw);
+        if (ret != 0) {
+            goto error_exit;
+        }
+    }
+
     /*
         Store the hash tables. At this moment, the file pointer refers to
-        the offset succeeding the last key/data pair.
+        the offset succeeding the last key/data pair. The images of the
+        tables are encoded by dbw->num_threads threads at a time.
      */
-    for (i = 0;i < NUM_TABLES;++i) {
-        table_t* ht = &dbw->ht[i];
-
-        /* Do not write empty hash tables. */
-        if (ht->bucket != NULL) {
-            /*
-                Actual bucket will have the double size; half elements
-                in the bucket are kept empty.
-             */
-            int n = ht->num * 2;
-
-            /* Allocate the bucket. */
-            bucket_t* dst = (bucket_t*)calloc(n, sizeof(bucket_t));
-            if (dst == NULL) {
+    memset(&images, 0, sizeof(images));
+    images.dbw = dbw;
+    for (i = 0;i < NUM_TABLES;i += images.num) {
+        images.first = i;
+        images.num = (NUM_TABLES - i < (uint32_t)dbw->num_threads) ? NUM_TABLES - i : (uint32_t)dbw->num_threads;
+        run_tasks(encode_table, &images, (int)images.num);
+
+        for (j = 0;j < images.num;++j) {
+            const table_t* ht = &dbw->ht[i+j];
+            if (ht->bucket != NULL && images.image[j] == NULL) {
                 ret = CQDB_ERROR_OUTOFMEMORY;
-                goto error_exit;
-            }
-
-            /*
-                Put hash elements to the bucket with the open-address method.
-             */
-            for (j = 0;j < ht->num;++j) {
-                const bucket_t* src = &ht->bucket[j];
-                int k = (src->hash >> 8) % n;
-
-                /* Find a vacant element. */
-                while (dst[k].offset != 0) {
-                    k = (k+1) % n;
-                }
-
-                /* Store the hash element. */
-                dst[k].hash = src->hash;
-                dst[k].offset = src->offset;
-            }
-
-            /* Write the bucket. */
-            for (k = 0;k < n;++k) {
-                write_uint32(dbw, dst[k].hash);
-                write_uint32(dbw, dst[k].offset);
+            } else if (ht->bucket != NULL) {
+                write_data(dbw, images.image[j], (size_t)ht->num * 2 * BUCKET_SIZE(dbw->flag));
             }
-
-            /* Free the bucket. */
-            free(dst);
+            free(images.image[j]);
+            images.image[j] = NULL;
+        }
+        if (ret != 0) {
+            goto error_exit;
         }
     }
 
     /* Write the backlink array if specified. */
     if (!(dbw->flag & CQDB_ONEWAY) && 0 < dbw->bwd_size) {
         /* Store the offset to the head of this array. */
-        header.bwd_offset = ftell(dbw->fp) - dbw->begin;
+        header.bwd_offset = (uint64_t)cqdb_ftell(dbw->fp) - dbw->begin;
         /* Store the contents of the backlink array. */
         for (i = 0;i < dbw->bwd_num;++i) {
-            write_uint32(dbw, dbw->bwd[i]);
+            write_offset(dbw, dbw->bwd[i]);
+        }
+    }
+
+    /*
+        Write the minimal perfect hash index if specified. The offset to
+        the index is stored at the end of the chunk. The index is omitted
+        if it cannot be built for the keys.
+     */
+    if (dbw->flag & CQDB_MPH) {
+        mph_t mph;
+        int rc = mph_build(&mph, dbw);
+        if (rc == CQDB_ERROR_OUTOFMEMORY) {
+            ret = rc;
+            goto error_exit;
+        } else if (rc != 0) {
+            header.flag &= ~CQDB_MPH;
+        } else {
+            uint64_t mph_offset = (uint64_t)cqdb_ftell(dbw->fp) - dbw->begin;
+            write_uint32(dbw, mph.num);
+            write_uint32(dbw, mph.size);
+            write_uint32(dbw, mph.buckets);
+            write_uint32(dbw, mph.seed);
+            for (i = 0;i < mph.buckets;++i) {
+                write_uint16(dbw, mph.pilot[i]);
+            }
+            if (mph.buckets & 1) {
+                write_uint16(dbw, 0);   /* Align to 4 bytes. */
+            }
+            for (i = 0;i < mph.size - mph.num;++i) {
+                write_uint32(dbw, mph.remap[i]);
+            }
+            for (i = 0;i < mph.num;++i) {
+                write_uint32(dbw, mph.slot[i].hash);
+                write_offset(dbw, mph.slot[i].offset);
+            }
+            write_offset(dbw, mph_offset);
+            mph_finish(&mph);
         }
     }
 
@@ -340,26 +1484,36 @@ int cqdb_writer_close(cqdb_writer_t* dbw)
     }
 
     /* Store the current position. */
-    offset = ftell(dbw->fp);
+    offset = (int64_t)cqdb_ftell(dbw->fp);
     if (offset == -1) {
         ret = CQDB_ERROR_FILETELL;
         goto error_exit;
     }
-    header.size = (uint32_t)offset - dbw->begin;
+    header.size = (uint64_t)offset - dbw->begin;
+
+    /* A chunk with 32-bit offsets must not exceed 4 GB. */
+    if (!(dbw->flag & CQDB_OFFSET64) && 0xFFFFFFFF < header.size) {
+        ret = CQDB_ERROR_OVERFLOW;
+        goto error_exit;
+    }
 
     /* Rewind the current position to the beginning. */
-    if (fseek(dbw->fp, dbw->begin, SEEK_SET) != 0) {
+    if (cqdb_fseek(dbw->fp, dbw->begin, SEEK_SET) != 0) {
         ret = CQDB_ERROR_FILESEEK;
         goto error_exit;
     }
 
     /* Write the file header. */
     write_data(dbw, header.chunkid, 4);
-    write_uint32(dbw, header.size);
+    write_uint32(dbw, (uint32_t)(header.size & 0xFFFFFFFF));
     write_uint32(dbw, header.flag);
     write_uint32(dbw, header.byteorder);
     write_uint32(dbw, header.bwd_size);
-    write_uint32(dbw, header.bwd_offset);
+    write_uint32(dbw, (uint32_t)(header.bwd_offset & 0xFFFFFFFF));
+    if (dbw->flag & CQDB_OFFSET64) {
+        write_uint32(dbw, (uint32_t)(header.size >> 32));
+        write_uint32(dbw, (uint32_t)(header.bwd_offset >> 32));
+    }
 
     /*
         Write references to hash tables. At this moment, dbw->cur points
@@ -367,11 +1521,11 @@ int cqdb_writer_close(cqdb_writer_t* dbw)
      */
     for (i = 0;i < NUM_TABLES;++i) {
         /* Offset to the hash table (or zero for non-existent tables). */
-        write_uint32(dbw, dbw->ht[i].num ? dbw->cur : 0);
+        write_offset(dbw, dbw->ht[i].num ? dbw->cur : 0);
         /* Bucket size is double to the number of elements. */
         write_uint32(dbw, dbw->ht[i].num * 2);
         /* Advance the offset counter. */
-        dbw->cur += (dbw->ht[i].num * 2) * sizeof(bucket_t);
+        dbw->cur += (uint64_t)(dbw->ht[i].num * 2) * BUCKET_SIZE(dbw->flag);
     }
 
     /* Check an occurrence of a file-related error. */
@@ -381,7 +1535,7 @@ int cqdb_writer_close(cqdb_writer_t* dbw)
     }
 
     /* Seek to the last position. */
-    if (fseek(dbw->fp, offset, SEEK_SET) != 0) {
+    if (cqdb_fseek(dbw->fp, offset, SEEK_SET) != 0) {
         ret = CQDB_ERROR_FILESEEK;
         goto error_exit;
     }
@@ -391,54 +1545,108 @@ int cqdb_writer_close(cqdb_writer_t* dbw)
 
 error_exit:
     /* Seek to the first position. */
-    fseek(dbw->fp, dbw->begin, SEEK_SET);
+    cqdb_fseek(dbw->fp, dbw->begin, SEEK_SET);
     cqdb_writer_delete(dbw);
     return ret;
 }
 
 
 
-static uint32_t read_uint32(const uint8_t* p)
+static uint64_t read_offset(const uint8_t* p, uint32_t flag)
 {
-    uint32_t value;
-    value  = ((uint32_t)p[0]);
-    value |= ((uint32_t)p[1] << 8);
-    value |= ((uint32_t)p[2] << 16);
-    value |= ((uint32_t)p[3] << 24);
+    uint64_t value = read_uint32(p);
+    if (flag & CQDB_OFFSET64) {
+        value |= (uint64_t)read_uint32(p + sizeof(uint32_t)) << 32;
+    }
     return value;
 }
 
-static const uint8_t *read_tableref(tableref_t* ref, const uint8_t *p)
+static uint32_t read_uint16(const uint8_t* p)
 {
-    ref->offset = read_uint32(p);
-    p += sizeof(uint32_t);
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static const uint8_t *read_tableref(tableref_t* ref, const uint8_t *p, uint32_t flag)
+{
+    ref->offset = read_offset(p, flag);
+    p += OFFSET_SIZE(flag);
     ref->num = read_uint32(p);
     p += sizeof(uint32_t);
     return p;
 }
 
-static bucket_t* read_bucket(const uint8_t* p, uint32_t num)
+static int read_mph(reader_mph_t* mph, const uint8_t* buffer, uint64_t size, uint32_t flag)
 {
-    uint32_t i;
-    bucket_t *bucket = (bucket_t*)calloc(num, sizeof(bucket_t));
-    for (i = 0;i < num;++i) {
-        bucket[i].hash = read_uint32(p);
-        p += sizeof(uint32_t);
-        bucket[i].offset = read_uint32(p);
-        p += sizeof(uint32_t);
+    uint64_t offset, avail, need;
+    const uint8_t* p = NULL;
+
+    /* The offset to the index is stored at the end of the chunk. */
+    if (size < OFFSET_DATA(flag) + OFFSET_SIZE(flag)) {
+        return -1;
+    }
+    size -= OFFSET_SIZE(flag);
+    offset = read_offset(buffer + size, flag);
+    if (size < offset || size - offset < MPH_HEADER_SIZE) {
+        return -1;
+    }
+
+    p = buffer + offset;
+    mph->num = read_uint32(p);
+    mph->size = read_uint32(p + 4);
+    mph->buckets = read_uint32(p + 8);
+    mph->seed = read_uint32(p + 12);
+    p += MPH_HEADER_SIZE;
+    if (mph->num == 0 || mph->buckets == 0 || mph->size < mph->num) {
+        return -1;
     }
-    return bucket;
+
+    /* Make sure that the index lies within the chunk. */
+    avail = size - offset - MPH_HEADER_SIZE;
+    need = (((uint64_t)mph->buckets + 1) & ~(uint64_t)1) * sizeof(uint16_t);
+    need += (uint64_t)(mph->size - mph->num) * sizeof(uint32_t);
+    need += (uint64_t)mph->num * BUCKET_SIZE(flag);
+    if (avail < need) {
+        return -1;
+    }
+
+    mph->pilot = p;
+    p += (((size_t)mph->buckets + 1) & ~(size_t)1) * sizeof(uint16_t);
+    mph->remap = p;
+    p += (size_t)(mph->size - mph->num) * sizeof(uint32_t);
+    mph->slot = p;
+    return 0;
 }
 
-static uint32_t* read_backward_links(const uint8_t* p, uint32_t num)
+static int read_blocks(reader_blocks_t* blk, const uint8_t* buffer, uint64_t size, uint32_t flag, uint32_t num_ids)
 {
-    uint32_t i;
-    uint32_t *bwd = (uint32_t*)calloc(num, sizeof(uint32_t));
-    for (i = 0;i < num;++i) {
-        bwd[i] = read_uint32(p);
-        p += sizeof(uint32_t);
+    const uint64_t offset = OFFSET_DATA(flag);
+
+    if (size < offset + BLOCKS_HEADER_SIZE) {
+        return -1;
+    }
+    blk->num = read_uint32(buffer + offset);
+    blk->block_size = read_uint32(buffer + offset + 4);
+    if (blk->block_size == 0) {
+        return -1;
+    }
+    blk->num_blocks = (uint32_t)(((uint64_t)blk->num + blk->block_size - 1) / blk->block_size);
+
+    /* Make sure that the offsets to the blocks lie within the chunk. */
+    if ((size - offset - BLOCKS_HEADER_SIZE) / OFFSET_SIZE(flag) < blk->num_blocks) {
+        return -1;
+    }
+    blk->offsets = buffer + offset + BLOCKS_HEADER_SIZE;
+
+    /* Allocate the cache of the strings decoded for reverse lookups. */
+    blk->cache_size = (num_ids + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    blk->cache = NULL;
+    if (blk->cache_size) {
+        blk->cache = (void* volatile*)calloc(blk->cache_size, sizeof(void*));
+        if (blk->cache == NULL) {
+            return -1;
+        }
     }
-    return bwd;
+    return 0;
 }
 
 cqdb_t* cqdb_reader(const void *buffer, size_t size)
@@ -447,12 +1655,12 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
     cqdb_t* db = NULL;
 
     /* The minimum size of a valid CQDB is OFFSET_DATA. */
-    if (size < OFFSET_DATA) {
+    if (size < OFFSET_DATA(0)) {
         return NULL;
     }
 
     /* Check the file chunkid. */
-    if (memcmp(buffer, CHUNKID, 4) != 0) {
+    if (memcmp(buffer, CHUNKID, 4) != 0 && memcmp(buffer, CHUNKID_EXT, 4) != 0) {
         return NULL;
     }
     
@@ -461,7 +1669,7 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
         const uint8_t* p = NULL;
 
         /* Set memory block and size. */
-        db->buffer = buffer;
+        db->buffer = (const uint8_t*)buffer;
         db->size = size;
 
         /* Read the database header. */
@@ -478,6 +1686,16 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
         p += sizeof(uint32_t);
         db->header.bwd_offset = read_uint32(p);
         p += sizeof(uint32_t);
+        if (db->header.flag & CQDB_OFFSET64) {
+            if (size < OFFSET_DATA(db->header.flag)) {
+                free(db);
+                return NULL;
+            }
+            db->header.size |= (uint64_t)read_uint32(p) << 32;
+            p += sizeof(uint32_t);
+            db->header.bwd_offset |= (uint64_t)read_uint32(p) << 32;
+            p += sizeof(uint32_t);
+        }
 
         /* Check the consistency of byte order. */
         if (db->header.byteorder != BYTEORDER_CHECK) {
@@ -485,21 +1703,35 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
             return NULL;
         }
 
+        /* The chunk identifier must agree with the extended flags. */
+        if ((memcmp(db->header.chunkid, CHUNKID_EXT, 4) == 0) != ((db->header.flag & FLAG_EXT) != 0)) {
+            free(db);
+            return NULL;
+        }
+
         /* Check the chunk size. */
         if (size < db->header.size) {
             free(db);
             return NULL;
         }
 
-        /* Set pointers to the hash tables. */
+        /*
+            Set pointers to the hash tables. Nothing is decoded here, so
+            that opening a database takes a constant time.
+         */
         db->num = 0;    /* Number of records. */
-        p = (db->buffer + OFFSET_REFS);
+        p = (db->buffer + OFFSET_REFS(db->header.flag));
         for (i = 0;i < NUM_TABLES;++i) {
             tableref_t ref;
-            p = read_tableref(&ref, p);
-            if (ref.offset) {
-                /* Set buckets. */
-                db->ht[i].bucket = read_bucket(db->buffer + ref.offset, ref.num);
+            p = read_tableref(&ref, p, db->header.flag);
+            if (ref.offset && ref.num) {
+                /* Make sure that the buckets lie within the chunk. */
+                if (db->header.size < ref.offset ||
+                    (db->header.size - ref.offset) / BUCKET_SIZE(db->header.flag) < ref.num) {
+                    free(db);
+                    return NULL;
+                }
+                db->ht[i].bucket = db->buffer + ref.offset;
                 db->ht[i].num = ref.num;
             } else {
                 /* An empty hash table. */
@@ -513,10 +1745,32 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
 
         /* Set the pointer to the backlink array if any. */
         if (db->header.bwd_offset) {
-            db->bwd = read_backward_links(db->buffer + db->header.bwd_offset, db->num);
+            if (db->header.size < db->header.bwd_offset ||
+                (db->header.size - db->header.bwd_offset) / OFFSET_SIZE(db->header.flag) < db->header.bwd_size) {
+                free(db);
+                return NULL;
+            }
+            db->bwd = db->buffer + db->header.bwd_offset;
         } else {
             db->bwd = NULL;
         }
+
+        /* Set the pointers to the minimal perfect hash index if any. */
+        if (db->header.flag & CQDB_MPH) {
+            if (read_mph(&db->mph, db->buffer, db->header.size, db->header.flag) != 0) {
+                free(db);
+                return NULL;
+            }
+        }
+
+        /* Set the pointers to the compressed records if any. */
+        if (db->header.flag & CQDB_COMPRESS) {
+            uint32_t num_ids = db->bwd ? db->header.bwd_size : 0;
+            if (read_blocks(&db->blocks, db->buffer, db->header.size, db->header.flag, num_ids) != 0) {
+                free(db);
+                return NULL;
+            }
+        }
     }
 
     return db;
@@ -524,54 +1778,379 @@ cqdb_t* cqdb_reader(const void *buffer, size_t size)
 
 void cqdb_delete(cqdb_t* db)
 {
-    int i;
+    uint32_t i, j;
 
-    if (db != NULL) {
-        for (i = 0;i < NUM_TABLES;++i) {
-            free(db->ht[i].bucket);
+    /* The hash tables and the backlinks belong to the memory block. */
+    for (i = 0;i < db->blocks.cache_size;++i) {
+        void** group = (void**)db->blocks.cache[i];
+        if (group != NULL) {
+            for (j = 0;j < CACHE_BLOCK_SIZE;++j) {
+                free(group[j]);
+            }
+            free(group);
+        }
+    }
+    free((void*)db->blocks.cache);
+    free(db);
+}
+
+/*
+    Lookups are resolved in three steps, each of which touches one memory
+    block: the bucket (or the pilot and the slot of the perfect hash index)
+    is located from the hash value, the offset of a candidate record is read
+    from it, and the record is compared with the key. cqdb_to_ids() runs each
+    step over a batch of keys with the next blocks prefetched, so that the
+    cache misses of independent keys overlap.
+ */
+#define BATCH_SIZE  (32)
+
+#if     defined(__GNUC__) || defined(__clang__)
+#define cqdb_prefetch(p)    __builtin_prefetch(p)
+#elif   defined(_MSC_VER)
+#include <xmmintrin.h>
+#define cqdb_prefetch(p)    _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define cqdb_prefetch(p)
+#endif
+
+/*
+    Strings decoded by cqdb_to_string() are published to the cache with a
+    compare-and-swap, so that concurrent readers may share a database.
+ */
+#if     defined(__GNUC__) || defined(__clang__)
+#define cqdb_load_ptr(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define cqdb_cas_ptr(p, old, new)   __sync_bool_compare_and_swap((p), (old), (new))
+#elif   defined(_MSC_VER)
+#include <intrin.h>
+#define cqdb_load_ptr(p)            (*(p))
+#define cqdb_cas_ptr(p, old, new)   (_InterlockedCompareExchangePointer((p), (new), (old)) == (old))
+#else
+#define cqdb_load_ptr(p)            (*(p))
+#define cqdb_cas_ptr(p, old, new)   (*(p) == (old) ? (*(p) = (new), 1) : 0)
+#endif
+
+static const uint8_t* mph_pilot(const cqdb_t* db, uint64_t key)
+{
+    return db->mph.pilot + sizeof(uint16_t) * mph_bucket(key, db->mph.buckets);
+}
+
+static const uint8_t* mph_slot(const cqdb_t* db, uint64_t key, const uint8_t* pilot)
+{
+    const reader_mph_t* mph = &db->mph;
+    uint32_t q = mph_position(key, read_uint16(pilot), mph->size);
+    if (mph->num <= q) {
+        q = read_uint32(mph->remap + sizeof(uint32_t) * (q - mph->num));
+    }
+    return mph->slot + (size_t)BUCKET_SIZE(db->header.flag) * q;
+}
+
+/* Find the next bucket with the hash value from the k-th bucket; zero if none. */
+static uint64_t table_probe(const cqdb_t* db, const reader_table_t* ht, uint32_t hv, uint32_t* k)
+{
+    const uint32_t flag = db->header.flag;
+    const size_t bucket_size = BUCKET_SIZE(flag);
+    const uint8_t* p = NULL;
+    uint64_t offset;
+
+    while (p = ht->bucket + bucket_size * *k, (offset = read_offset(p + sizeof(uint32_t), flag)) != 0) {
+        if (read_uint32(p) == hv) {
+            return offset;
+        }
+        *k = (*k + 1) % ht->num;
+    }
+    return 0;
+}
+
+static uint32_t read_varint(const uint8_t** p)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        value |= (uint32_t)(*(*p)++ & 0x7F) << shift;
+        shift += 7;
+    }
+    value |= (uint32_t)*(*p)++ << shift;
+    return value;
+}
+
+/* The block of the compressed key of the rank (offset - 1). */
+static const uint8_t* block_address(const cqdb_t* db, uint64_t offset)
+{
+    const reader_blocks_t* blk = &db->blocks;
+    const uint32_t b = (uint32_t)((offset - 1) / blk->block_size);
+    return db->buffer + read_offset(blk->offsets + (size_t)OFFSET_SIZE(db->header.flag) * b, db->header.flag);
+}
+
+static const uint8_t* record_address(const cqdb_t* db, uint64_t offset)
+{
+    return (db->header.flag & CQDB_COMPRESS) ? block_address(db, offset) : db->buffer + offset;
+}
+
+/*
+    Compare the compressed key with the key of len bytes by walking the
+    block up to the key. m tracks the length of the prefix shared by the
+    key and the current entry, so that each byte of the key is compared
+    at most once.
+ */
+static int match_block(const cqdb_t* db, uint64_t offset, const char *str, size_t len)
+{
+    uint32_t i, idx;
+    size_t m = 0;
+    const uint8_t* p = NULL;
+
+    if (offset == 0 || db->blocks.num < offset) {
+        return CQDB_ERROR_NOTFOUND;
+    }
+    idx = (uint32_t)((offset - 1) % db->blocks.block_size);
+    p = block_address(db, offset);
+
+    for (i = 0;;++i) {
+        const uint32_t prefix = read_varint(&p);
+        const uint32_t suffix = read_varint(&p);
+        uint32_t id;
+        if (prefix < m) {
+            m = prefix;
+        } else if (prefix == m) {
+            while (m < len && m - prefix < suffix && (uint8_t)str[m] == p[m - prefix]) {
+                ++m;
+            }
+        }
+        p += suffix;
+        id = read_varint(&p);
+        if (i == idx) {
+            return (m == len && prefix + suffix == len) ? (int)id : CQDB_ERROR_NOTFOUND;
+        }
+    }
+}
+
+/* Decode the compressed key of the rank (offset - 1). */
+static char* decode_block(const cqdb_t* db, uint64_t offset)
+{
+    uint32_t i, idx;
+    size_t size = 0;
+    const uint8_t* begin = NULL;
+    const uint8_t* p = NULL;
+    char* str = NULL;
+
+    if (offset == 0 || db->blocks.num < offset) {
+        return NULL;
+    }
+    idx = (uint32_t)((offset - 1) % db->blocks.block_size);
+    begin = block_address(db, offset);
+
+    /* Find the size of the buffer for the entries up to the key. */
+    for (i = 0, p = begin;i <= idx;++i) {
+        const uint32_t prefix = read_varint(&p);
+        const uint32_t suffix = read_varint(&p);
+        if (size < (size_t)prefix + suffix) {
+            size = (size_t)prefix + suffix;
+        }
+        p += suffix;
+        read_varint(&p);
+    }
+
+    /* Reconstruct the key from the suffixes. */
+    str = (char*)malloc(size + 1);
+    if (str != NULL) {
+        for (i = 0, p = begin;i <= idx;++i) {
+            const uint32_t prefix = read_varint(&p);
+            const uint32_t suffix = read_varint(&p);
+            memcpy(str + prefix, p, suffix);
+            str[prefix + suffix] = 0;
+            p += suffix;
+            read_varint(&p);
+        }
+    }
+    return str;
+}
+
+/* Compare the record with the key of len bytes. */
+static int match_record(const cqdb_t* db, uint64_t offset, const char *str, size_t len)
+{
+    const uint8_t *q = NULL;
+    if (db->header.flag & CQDB_COMPRESS) {
+        return match_block(db, offset, str, len);
+    }
+    q = db->buffer + offset;
+    if (read_uint32(q + sizeof(uint32_t)) == len + 1 &&
+        memcmp(str, q + sizeof(uint32_t) * 2, len) == 0) {
+        return (int)read_uint32(q);
+    }
+    return CQDB_ERROR_NOTFOUND;
+}
+
+static int table_lookup(const cqdb_t* db, const char *str, size_t len, uint32_t hv)
+{
+    const reader_table_t* ht = &db->ht[hv % 256];
+
+    if (ht->num) {
+        uint32_t k = (hv >> 8) % ht->num;
+        uint64_t offset;
+
+        while ((offset = table_probe(db, ht, hv, &k)) != 0) {
+            int value = match_record(db, offset, str, len);
+            if (0 <= value) {
+                return value;
+            }
+            k = (k+1) % ht->num;
+        }
+    }
+
+    return CQDB_ERROR_NOTFOUND;
+}
+
+static int lookup(const cqdb_t* db, const char *str, size_t len, uint32_t hv, uint32_t hv2)
+{
+    /* A minimal perfect hash index locates the only candidate slot. */
+    if (db->mph.num) {
+        uint64_t key = mph_key(hv, hv2, db->mph.seed);
+        const uint8_t* p = mph_slot(db, key, mph_pilot(db, key));
+        if (read_uint32(p) == hv) {
+            return match_record(db, read_offset(p + sizeof(uint32_t), db->header.flag), str, len);
         }
-        free(db->bwd);
-        free(db);
+        return CQDB_ERROR_NOTFOUND;
     }
+
+    return table_lookup(db, str, len, hv);
 }
 
 int cqdb_to_id(cqdb_t* db, const char *str)
 {
-    uint32_t hv = hashlittle(str, strlen(str)+1, 0);
-    int t = hv % 256;
-    table_t* ht = &db->ht[t];
-
-    if (ht->num && ht->bucket != NULL) {
-        int n = ht->num;
-        int k = (hv >> 8) % n;
-        bucket_t* p = NULL;
-
-        while (p = &ht->bucket[k], p->offset) {
-            if (p->hash == hv) {
-                int value;
-                uint32_t ksize;
-                const uint8_t *q = db->buffer + p->offset;
-                value = (int)read_uint32(q);
-                q += sizeof(uint32_t);
-                ksize = read_uint32(q);
-                q += sizeof(uint32_t);
-                if (strcmp(str, (const char *)q) == 0) {
-                    return value;
+    uint32_t hv = 0, hv2 = 0;
+    const size_t len = strlen(str);
+
+    hash_key(db->header.flag, str, len, 1, &hv, &hv2);
+    return lookup(db, str, len, hv, hv2);
+}
+
+int cqdb_to_id_n(cqdb_t* db, const char *str, size_t len)
+{
+    uint32_t hv = 0, hv2 = 0;
+    int ret = hash_key(db->header.flag, str, len, 0, &hv, &hv2);
+    return (ret != 0) ? ret : lookup(db, str, len, hv, hv2);
+}
+
+int cqdb_to_ids(cqdb_t* db, const char * const *strs, const size_t *lens, int n, int *ids)
+{
+    int i, j, found = 0;
+    const uint32_t flag = db->header.flag;
+    uint32_t hv[BATCH_SIZE], k[BATCH_SIZE];
+    uint64_t key[BATCH_SIZE], offset[BATCH_SIZE];
+    size_t len[BATCH_SIZE];
+    const uint8_t* p[BATCH_SIZE];
+
+    for (i = 0;i < n;i += BATCH_SIZE) {
+        const int m = (n - i < BATCH_SIZE) ? n - i : BATCH_SIZE;
+        const char * const *str = strs + i;
+
+        /* Hash the keys, and prefetch the pilots or the first buckets. */
+        for (j = 0;j < m;++j) {
+            uint32_t hv2 = 0;
+            hv[j] = 0;
+            len[j] = (lens != NULL) ? lens[i+j] : strlen(str[j]);
+            if (hash_key(flag, str[j], len[j], lens == NULL, &hv[j], &hv2) != 0) {
+                return CQDB_ERROR_OUTOFMEMORY;
+            }
+            if (db->mph.num) {
+                key[j] = mph_key(hv[j], hv2, db->mph.seed);
+                p[j] = mph_pilot(db, key[j]);
+            } else {
+                const reader_table_t* ht = &db->ht[hv[j] % 256];
+                k[j] = ht->num ? (hv[j] >> 8) % ht->num : 0;
+                p[j] = ht->num ? ht->bucket + (size_t)BUCKET_SIZE(flag) * k[j] : NULL;
+            }
+            if (p[j] != NULL) {
+                cqdb_prefetch(p[j]);
+            }
+        }
+
+        /* Locate the slots of the perfect hash index and prefetch them. */
+        if (db->mph.num) {
+            for (j = 0;j < m;++j) {
+                p[j] = mph_slot(db, key[j], p[j]);
+                cqdb_prefetch(p[j]);
+            }
+        }
+
+        /* Read the offsets of the candidate records and prefetch them. */
+        for (j = 0;j < m;++j) {
+            offset[j] = 0;
+            if (db->mph.num) {
+                if (read_uint32(p[j]) == hv[j]) {
+                    offset[j] = read_offset(p[j] + sizeof(uint32_t), flag);
+                }
+            } else if (p[j] != NULL) {
+                offset[j] = table_probe(db, &db->ht[hv[j] % 256], hv[j], &k[j]);
+            }
+            if (offset[j]) {
+                cqdb_prefetch(record_address(db, offset[j]));
+            }
+        }
+
+        /* Verify the records. */
+        for (j = 0;j < m;++j) {
+            int value = CQDB_ERROR_NOTFOUND;
+            if (offset[j]) {
+                value = match_record(db, offset[j], str[j], len[j]);
+                if (value < 0 && !db->mph.num) {
+                    /* A collision of hash values; continue probing. */
+                    value = table_lookup(db, str[j], len[j], hv[j]);
                 }
             }
-            k = (k+1) % n;
+            ids[i+j] = value;
+            if (0 <= value) {
+                ++found;
+            }
         }
     }
 
-    return CQDB_ERROR_NOTFOUND;
+    return found;
+}
+
+static const char* cached_string(cqdb_t* db, int id, uint64_t offset)
+{
+    void* volatile* slot = NULL;
+    void* volatile* group = NULL;
+    char* str = NULL;
+
+    /* Allocate the group of the identifier in the cache if necessary. */
+    slot = &db->blocks.cache[id / CACHE_BLOCK_SIZE];
+    group = (void* volatile*)cqdb_load_ptr(slot);
+    if (group == NULL) {
+        void* fresh = calloc(CACHE_BLOCK_SIZE, sizeof(void*));
+        if (fresh == NULL) {
+            return NULL;
+        }
+        if (!cqdb_cas_ptr(slot, NULL, fresh)) {
+            free(fresh);
+        }
+        group = (void* volatile*)cqdb_load_ptr(slot);
+    }
+
+    /* Decode the string unless another call has done it. */
+    slot = &group[id % CACHE_BLOCK_SIZE];
+    str = (char*)cqdb_load_ptr(slot);
+    if (str == NULL) {
+        char* fresh = decode_block(db, offset);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        if (!cqdb_cas_ptr(slot, NULL, (void*)fresh)) {
+            free(fresh);
+        }
+        str = (char*)cqdb_load_ptr(slot);
+    }
+    return str;
 }
 
 const char* cqdb_to_string(cqdb_t* db, int id)
 {
     /* Check if the current database supports the backward look-up. */
     if (db->bwd != NULL && (uint32_t)id < db->header.bwd_size) {
-        uint32_t offset = db->bwd[id];
-        if (offset) {
+        uint64_t offset = read_offset(db->bwd + (size_t)OFFSET_SIZE(db->header.flag) * id, db->header.flag);
+        if (offset && (db->header.flag & CQDB_COMPRESS)) {
+            return cached_string(db, id, offset);
+        } else if (offset) {
             const uint8_t *p = db->buffer + offset;
             p += sizeof(uint32_t);  /* Skip key data. */
             p += sizeof(uint32_t);  /* Skip value size. */
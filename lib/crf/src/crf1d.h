@@ -33,9 +33,11 @@
 #ifndef    __CRF1D_H__
 #define    __CRF1D_H__
 
+#include <string.h>
 #include <crfsuite.h>
 #include <cqdb.h>
 #include "crfsuite_internal.h"
+#include <atomic>
 #include <vector>
 
 
@@ -52,6 +54,7 @@ enum {
     CTXF_BASE       = 0x01,
     CTXF_VITERBI    = 0x01,
     CTXF_MARGINALS  = 0x02,
+    CTXF_SHARED_TRANS = 0x04,   /**< Transition matrices are supplied by crf1dc_share_transition(). */
     CTXF_ALL        = 0xFF,
 };
 
@@ -107,8 +110,10 @@ struct crf1d_context_t {
      * Transition scores.
      *  This is a [L][L] matrix whose element [i][j] represents the total
      *  score of transition features associating labels #i and #j.
+     *  This points to trans_storage, or to the matrix shared by a model
+     *  with CTXF_SHARED_TRANS flag.
      */
-    std::vector<floatval_t> trans;
+    floatval_t* trans;
 
     /**
      * Alpha score matrix.
@@ -159,7 +164,7 @@ struct crf1d_context_t {
      *  of the total score of transition features associating labels #i and #j.
      *  This member is available only with CTXF_MARGINALS flag.
      */
-    std::vector<floatval_t> exp_trans;
+    floatval_t* exp_trans;
 
     /**
      * Model expectations of states.
@@ -176,19 +181,47 @@ struct crf1d_context_t {
      *  This member is available only with CTXF_MARGINALS flag.
      */
     std::vector<floatval_t> mexp_trans;
+
+    /**
+     * Storage of the transition scores and their exponents.
+     *  This is empty with CTXF_SHARED_TRANS flag.
+     */
+    std::vector<floatval_t> trans_storage;
         
 public:
-    crf1d_context_t(int flag, int L, int T) : flag(flag), num_labels(L), trans(L*L)
+    crf1d_context_t(int flag, int L, int T) : flag(flag), num_labels(L), num_items(0), cap_items(0), log_norm(0), trans(NULL), exp_trans(NULL)
     {
-        if (this->flag & CTXF_MARGINALS) {
-            this->exp_trans = std::vector<floatval_t>(L*L);
-            this->mexp_trans = std::vector<floatval_t>(L*L);
+        /*
+            A context with CTXF_SHARED_TRANS flag only computes marginals of
+            an instance, which do not need the model expectations of
+            transitions.
+         */
+        if (!(this->flag & CTXF_SHARED_TRANS)) {
+            const int n = (this->flag & CTXF_MARGINALS) ? 2 : 1;
+            this->trans_storage = std::vector<floatval_t>(n*L*L);
+            this->trans = this->trans_storage.data();
+            if (this->flag & CTXF_MARGINALS) {
+                this->exp_trans = this->trans + L*L;
+                this->mexp_trans = std::vector<floatval_t>(L*L);
+            }
         }
 
         crf1dc_set_num_items(T);
         /* T gives the 'hint' for maximum length of items. */
         this->num_items = 0;
     }
+    crf1d_context_t(const crf1d_context_t&) = delete;
+    crf1d_context_t& operator=(const crf1d_context_t&) = delete;
+
+    /**
+     * Use the transition scores (and their exponents) owned by a model.
+     *  The matrices must outlive the context, which never modifies them.
+     */
+    void crf1dc_share_transition(const floatval_t* trans, const floatval_t* exp_trans)
+    {
+        this->trans = const_cast<floatval_t*>(trans);
+        this->exp_trans = const_cast<floatval_t*>(exp_trans);
+    }
     floatval_t crf1dc_lognorm() const { return this->log_norm; }
     void crf1dc_set_num_items( int T);
     void crf1dc_reset( int flag);
@@ -288,20 +321,26 @@ enum {
 
 /**
  * Feature references.
- *    This is a collection of feature ids used for faster accesses.
+ *    This is a range [offset, offset + num_features) of an array of feature
+ *    ids shared by all references (CSR layout). Because the features of an
+ *    encoder are sorted by (type, src, dst), the ids referred by an
+ *    attribute (or a label) are contiguous there, i.e., the array is the
+ *    identity and the feature id of the r-th reference is (offset + r).
  */
  struct feature_refs_t {
+    int        offset;          /**< Offset to the first reference. */
     int        num_features;    /**< Number of features referred */
-    // int*    fids;            /**< Array of feature ids */
-    std::vector<int> fids;
 };
 
 void crf1df_generate(
     std::vector<crf1df_feature_t>& features,
     dataset_t &ds,
     int connect_all_attrs,
+    int skip_states,
     int connect_all_edges,
     floatval_t minfreq,
+    int sketch_memory,
+    int num_threads,
     crfsuite_logging_callback func,
     void *instance
     );
@@ -316,6 +355,17 @@ int crf1df_init_references(
 
 
 
+/**
+ * \defgroup crf1d_encode.c
+ */
+/** @{ */
+
+void crf1de_debug_minibatch(FILE *fp);
+
+/** @} */
+
+
+
 /**
  * \defgroup crf1d_model.c
  */
@@ -324,6 +374,29 @@ int crf1df_init_references(
 struct tag_crf1dm;
 typedef struct tag_crf1dm crf1dm_t;
 
+/**
+ * Convert an IEEE 754 half-precision value to floatval_t.
+ */
+inline floatval_t crf1dm_half_to_float(uint16_t h)
+{
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1F, man = h & 0x3FF;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0) {
+        /* Zero or a subnormal number: man * 2^-24. */
+        f = (float)man * (1.f / 16777216.f);
+        return sign ? -f : f;
+    } else if (exp == 31) {
+        bits = sign | 0x7F800000 | (man << 13);
+    } else {
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    }
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
  struct crf1dm_feature_t {
     int        type;
     int        src;
@@ -331,19 +404,48 @@ typedef struct tag_crf1dm crf1dm_t;
     floatval_t weight;
 } ;
 
+/*
+    State features of an attribute in a version-1 model, decoded on the
+    first use of the attribute (see crf1dm_get_attr_states()).
+ */
+struct crf1dm_state_t {
+    int        dst;
+    floatval_t weight;
+};
+
+struct crf1dm_attr_states_t {
+    int                     num;        /**< Number of state features. */
+    const crf1dm_state_t*   states;     /**< State features [num]. */
+};
+
+ /*
+    The file header in memory. Sizes and offsets are 64-bit so that they can
+    hold the values of version-201 (large) models; version 1xx and 200
+    files store them in 32 bits.
+ */
  struct header_t{
     uint8_t     magic[4];       /* File magic. */
-    uint32_t    size;           /* File size. */
+    uint64_t    size;           /* File size. */
     uint8_t     type[4];        /* Model type */
     uint32_t    version;        /* Version number. */
     uint32_t    num_features;   /* Number of features. */
     uint32_t    num_labels;     /* Number of labels. */
     uint32_t    num_attrs;      /* Number of attributes. */
-    uint32_t    off_features;   /* Offset to features. */
-    uint32_t    off_labels;     /* Offset to label CQDB. */
-    uint32_t    off_attrs;      /* Offset to attribute CQDB. */
-    uint32_t    off_labelrefs;  /* Offset to label feature references. */
-    uint32_t    off_attrrefs;   /* Offset to attribute feature references. */
+    uint64_t    off_features;   /* Offset to features. */
+    uint64_t    off_labels;     /* Offset to label CQDB. */
+    uint64_t    off_attrs;      /* Offset to attribute CQDB. */
+    uint64_t    off_labelrefs;  /* Offset to label feature references. */
+    uint64_t    off_attrrefs;   /* Offset to attribute feature references. */
+    uint32_t    attr_hash;      /* Attribute hash function (version >= 101). */
+    uint32_t    attr_hash_bits; /* Bits of the hashed attribute space. */
+    uint32_t    attr_hash_seed; /* Seed of the attribute hash function. */
+    uint32_t    num_states;     /* Number of state features (version >= 200). */
+    uint64_t    off_attr_offsets; /* Offset to the CSR offsets of attributes. */
+    uint64_t    off_state_dst;  /* Offset to the labels of state features. */
+    uint64_t    off_state_weight; /* Offset to the weights of state features. */
+    uint64_t    off_trans;      /* Offset to the L x L transition matrix. */
+    uint32_t    state_weight_type; /* Storage type of state weights (CRFSUITE_WEIGHT_*). */
+    uint64_t    off_state_scale; /* Offset to the per-label scales of int8 weights. */
 } ;
 
  struct featureref_header_t {
@@ -362,6 +464,8 @@ typedef struct tag_crf1dm crf1dm_t;
  /*
  *    Implementation of crfsuite_model_t object.
  *    This object is instantiated by crf1m_model_create() function.
+ *    The model is immutable once constructed and reference-counted, so that
+ *    taggers on different threads can share it.
  */
 
 struct tag_crf1dm: tag_crfsuite_model {
@@ -370,12 +474,85 @@ struct tag_crf1dm: tag_crfsuite_model {
     cqdb_t*        attrs;
 
 private:
-    std::vector<feature_refs_t> attr_refs;
-    std::vector<feature_refs_t> label_refs;
-    std::vector<crf1dm_feature_t> features;
+    /*
+        The model reads features and feature references directly from the
+        model image (zero copy). The image is either memory-mapped from a
+        file, read into an owned buffer (if mapping fails), or supplied by
+        the caller, who must keep it alive while the model is used.
+     */
+    const uint8_t*  buffer;         /**< Model image. */
+    size_t          size;           /**< Size of the model image. */
+    uint8_t*        owned;          /**< Buffer owned by the model, or NULL. */
+    void*           mapped;         /**< Mapped address of the file, or NULL. */
+    size_t          mapped_size;    /**< Size of the mapping. */
+    uint8_t*        aligned;        /**< Aligned copy of a version-2 image, or NULL. */
+    bool            v2;             /**< Whether the image is in the version-2 format. */
+
+    /*
+        Sections of a version-2 image (structure of arrays). State features
+        of attribute #a are [attr_offsets[a], attr_offsets[a+1]); the
+        transition features follow them in the feature id space as a dense
+        L x L matrix.
+     */
+    const uint32_t*   attr_offsets; /**< CSR offsets of attributes [A+1]. */
+    const uint32_t*   state_dst;    /**< Labels of state features [S]. */
+    const floatval_t* state_weight; /**< Weights of state features [S] (FP64). */
+    const uint16_t*   state_half;   /**< Weights of state features [S] (FP16). */
+    const int8_t*     state_int8;   /**< Weights of state features [S] (INT8). */
+    const floatval_t* state_scale;  /**< Scales of INT8 weights per label [L]. */
+    const floatval_t* trans_weight; /**< Transition weights [L*L]. */
+
+    /*
+        Transition scores and their exponents, computed once and shared by
+        all taggers of the model.
+     */
+    std::vector<floatval_t> trans;      /**< Transition scores [L*L]. */
+    std::vector<floatval_t> exp_trans;  /**< Exponents of transition scores [L*L]. */
+    std::atomic<int>        nref;       /**< Reference counter. */
+
+    /*
+        Decoded state features of version-1 attributes. Blocks of entries
+        are allocated on demand, and every pointer is set once with a
+        compare-and-swap, so that concurrent taggers need no lock and the
+        memory grows with the attributes in use, not with the model size.
+     */
+    enum { ATTR_BLOCK_SIZE = 4096 };
+    struct attr_block_t {
+        std::atomic<const crf1dm_attr_states_t*> entries[ATTR_BLOCK_SIZE];
+    };
+    mutable std::vector<std::atomic<attr_block_t*> > attr_cache;
+
+    void load(const char *filename);
+    void init(const uint8_t* buffer, size_t size);
+    void init_v2(const uint8_t* buffer, size_t size);
+    void init_transition();
+    void clear();
+    void collect_features(
+        std::vector<const char*>& labels,
+        std::vector<const char*>& attrs,
+        std::vector<crf1dm_feature_t>& trans,
+        std::vector<crf1dm_feature_t>& states,
+        std::vector<uint32_t>& label_offsets,
+        std::vector<uint32_t>& attr_offsets
+        ) const;
+    feature_refs_t get_ref(uint32_t off_chunk, int i) const;
+
 public:
     tag_crf1dm(const char *filename);
     tag_crf1dm(const void *data, size_t size);
+    virtual ~tag_crf1dm();
+    tag_crf1dm(const tag_crf1dm&) = delete;
+    tag_crf1dm& operator=(const tag_crf1dm&) = delete;
+
+    int addref() { return ++this->nref; }
+    int release()
+    {
+        int count = --this->nref;
+        if (count == 0) {
+            delete this;
+        }
+        return count;
+    }
 
     int crf1dm_get_num_attrs() { return this->header->num_attrs; }
     int crf1dm_get_num_labels() { return this->header->num_labels; }
@@ -400,7 +577,9 @@ public:
 
     int tcrf1dm_to_aid(const char *value)
     {
-        if (this->attrs != NULL) {
+        if (this->header->attr_hash != CRFSUITE_ATTRHASH_NONE) {
+            return this->get_hasher().to_id(value);
+        } else if (this->attrs != NULL) {
             return cqdb_to_id(this->attrs, value);
         } else {
             return -1;
@@ -416,33 +595,79 @@ public:
         }
     }
 
-    const feature_refs_t& crf1dm_get_labelref(int lid) {return this->label_refs[lid];}
-    const feature_refs_t& crf1dm_get_attrref(int aid) {return this->attr_refs[aid];}
-    int crf1dm_get_featureid(const feature_refs_t& ref, int i) { return ref.fids[i]; }
-    const crf1dm_feature_t& crf1dm_get_feature(int fid)    {return this->features[fid]; }
+    /* Whether the model uses the version-2 (SoA) layout. */
+    bool is_v2() const { return this->v2; }
+    const uint32_t* get_attr_offsets() const { return this->attr_offsets; }
+    const uint32_t* get_state_dst() const { return this->state_dst; }
+    int get_state_weight_type() const { return (int)this->header->state_weight_type; }
+    const floatval_t* get_state_weight() const { return this->state_weight; }
+    const uint16_t* get_state_half() const { return this->state_half; }
+    const int8_t* get_state_int8() const { return this->state_int8; }
+    const floatval_t* get_state_scale() const { return this->state_scale; }
+    const floatval_t* get_trans_weight() const { return this->trans_weight; }
+    const floatval_t* crf1dm_get_trans() const { return this->trans.data(); }
+    const floatval_t* crf1dm_get_exp_trans() const { return this->exp_trans.data(); }
+
+    /*
+        The offset of a version-1 reference is in the unit of uint32_t in the
+        image; the offset of a version-2 reference is the first feature id.
+     */
+    feature_refs_t crf1dm_get_labelref(int lid) const;
+    feature_refs_t crf1dm_get_attrref(int aid) const;
+    const crf1dm_attr_states_t* crf1dm_get_attr_states(int aid) const;
+    int crf1dm_get_featureid(const feature_refs_t& ref, int i) const;
+    crf1dm_feature_t crf1dm_get_feature(int fid) const;
     void dump(FILE *fp);
+    int write(const char *filename, int version, int weight_type = CRFSUITE_WEIGHT_FP64, int dict_flag = CRFSUITE_DICT_DEFAULT);
+    int compact(const char *filename, crfsuite_compact_t *param);
 public:
     crfsuite_tagger_t* get_tagger();
     const StringLookup* get_labels()  { return new StringLookup(labels, header->num_labels); }
-    const StringLookup* get_attrs()  { return new StringLookup(attrs, header->num_attrs); }
+    const StringLookup* get_attrs()
+    {
+        if (header->attr_hash != CRFSUITE_ATTRHASH_NONE) {
+            return new StringLookup(this->get_hasher());
+        }
+        return new StringLookup(attrs, header->num_attrs);
+    }
+    AttributeHasher get_hasher() const
+    {
+        return AttributeHasher(this->header->attr_hash, this->header->attr_hash_bits, this->header->attr_hash_seed);
+    }
 };
 
+/*
+    The model writer builds the features and feature references of a chunk
+    in memory (this->section) and writes the chunk at once when it is
+    closed; features can be encoded in parallel by crf1dmw_put_features().
+ */
 struct tag_crf1dmw {
     FILE *fp;
     int state;
     header_t header;
     cqdb_writer_t* dbw;
-    featureref_header_t* href;
-    feature_header_t* hfeat;
+    std::vector<uint8_t> section;   /**< Image of the chunk being written. */
+    uint32_t section_begin;         /**< File offset of the chunk being written. */
+    uint32_t section_num;           /**< Number of items in the chunk. */
+    int num_threads;                /**< Number of threads for encoding features and attributes (0: all cores). */
+    int attr_flag;                  /**< CQDB flags of the attribute dictionary. */
 
-    tag_crf1dmw(const char *filename);
+private:
+    int open_refs(int num, const char *chunk, uint64_t *off_chunk, int state);
+    int close_refs(int state);
+    int put_ref(int i, const feature_refs_t* ref, const int *map, int state);
+
+public:
+    tag_crf1dmw(const char *filename, const AttributeHasher *hasher = NULL);
     ~tag_crf1dmw();
+    int crf1dmw_close();
     int crf1dmw_open_labels(int num_labels);
     int crf1dmw_close_labels();
     int crf1dmw_put_label(int lid, const char *value);
     int crf1dmw_open_attrs(int num_attributes);
     int crf1dmw_close_attrs();
     int crf1dmw_put_attr(int aid, const char *value);
+    int crf1dmw_put_attrs(const char * const *values, int n);
     int crf1dmw_open_labelrefs(int num_labels);
     int crf1dmw_close_labelrefs();
     int crf1dmw_put_labelref(int lid, const feature_refs_t* ref, int *map);
@@ -452,10 +677,56 @@ struct tag_crf1dmw {
     int crf1dmw_open_features(int num_features);
     int crf1dmw_close_features();
     int crf1dmw_put_feature(int fid, const crf1dm_feature_t* f);
+    int crf1dmw_put_features(const crf1dm_feature_t* features, int n);
 };
 
 /** @} */
 
+/**
+ * Estimate the size of a CQDB chunk storing the strings.
+ */
+uint64_t crf1dm_estimate_cqdb_size(const std::vector<const char*>& strs, int flag = 0);
+
+/**
+ * Estimate the size of a model in the version-1 format.
+ */
+uint64_t crf1dm_estimate_v1_size(
+    int num_features,
+    int num_labels,
+    int num_attrs,
+    const std::vector<const char*>& labels,
+    const std::vector<const char*>& attrs,
+    int attr_flag = 0
+    );
+
+/**
+ * Write a model in the version-2 format.
+ *  States are grouped by attributes: the state features of attribute #a are
+ *  states[attr_offsets[a]], ..., states[attr_offsets[a+1]-1]. Sizes and
+ *  offsets become 64-bit (version 201, and CQDB_OFFSET64 for a dictionary)
+ *  when the estimated size exceeds 4 GB.
+ *  @param  attr_flag   CQDB flags of the attribute dictionary.
+ *  @param  size        Receives the file size if not NULL.
+ */
+int crf1dm_write_v2(
+    const char *filename,
+    const std::vector<const char*>& labels,
+    const std::vector<const char*>& attrs,
+    const AttributeHasher& hasher,
+    const std::vector<crf1dm_feature_t>& trans,
+    const std::vector<crf1dm_feature_t>& states,
+    const std::vector<uint32_t>& attr_offsets,
+    int weight_type,
+    int attr_flag,
+    uint64_t *size
+    );
+
+/*
+    A tagger holds a reference to its model and a context for an instance;
+    the transition scores are shared with the model. A tagger must not be
+    used by multiple threads at a time, but any number of taggers can be
+    used concurrently on one model.
+ */
 struct crf1dt_t : tag_crfsuite_tagger {
 
     crf1dm_t *model;        /**< CRF model. */
@@ -463,6 +734,9 @@ struct crf1dt_t : tag_crfsuite_tagger {
     int level;
 public:
     crf1dt_t(crf1dm_t* crf1dm);
+    virtual ~crf1dt_t();
+    crf1dt_t(const crf1dt_t&) = delete;
+    crf1dt_t& operator=(const crf1dt_t&) = delete;
     void crf1dt_set_level(int level);
 public: // interface
     /*
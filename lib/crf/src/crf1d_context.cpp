@@ -85,13 +85,13 @@ void crf1d_context_t::crf1dc_reset(int flag)
         for (auto &x: this->state)
             x = 0.0;
     }
-    if (flag & RF_TRANS) {
-        std::fill_n(this->trans.begin(), L*L, 0.0);
+    if (flag & RF_TRANS && !(this->flag & CTXF_SHARED_TRANS)) {
+        std::fill_n(this->trans, L*L, 0.0);
     }
 
     if (this->flag & CTXF_MARGINALS) {
         std::fill_n(this->mexp_state.begin(), T*L, 0.0);
-        std::fill_n(this->mexp_trans.begin(), L*L, 0.0);
+        std::fill(this->mexp_trans.begin(), this->mexp_trans.end(), 0.0);
         this->log_norm = 0;
     }
 }
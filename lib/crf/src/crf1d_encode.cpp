@@ -38,14 +38,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <memory.h>
 #include <time.h>
+#include <chrono>
+#include <algorithm>
+#include <thread>
 
 #include <crfsuite.h>
 #include "crfsuite_internal.h"
 #include "crf1d.h"
 #include "params.h"
 #include "logging.h"
+#include "vecmath.h"
 
 /**
  * Parameters for feature generation.
@@ -54,7 +59,20 @@
     floatval_t  feature_minfreq;                /** The threshold for occurrences of features. */
     int         feature_possible_states;        /** Dense state features. */
     int         feature_possible_transitions;   /** Dense transition features. */
+    int         feature_sketch_memory;          /** Memory (MB) for the minfreq pre-pass. */
+    int         feature_hash_bits;              /** Bits of the hashed attribute space. */
+    int         feature_hash_seed;              /** Seed of the attribute hash. */
+    int         num_threads;                    /** Number of worker threads. */
+    int         dataset_sort_by_length;         /** Bucket instances by lengths. */
 } ;
+
+/**
+ * Work space of a thread that processes a slice of a mini-batch.
+ */
+struct crf1de_worker_t {
+    crf1d_context_t *ctx;           /**< CRF1d context of the worker. */
+    sparse_gradient_t grad;         /**< Gradients of the slice. */
+};
 #define    FEATURE(crf1de, k) \
     (&(crf1de)->features[(k)])
 #define    ATTRIBUTE(crf1de, a) \
@@ -69,15 +87,51 @@
     std::vector<feature_refs_t> attributes;     /**< References to attribute features [A]. */
     std::vector<feature_refs_t> forward_trans;  /**< References to transition features [L]. */
 
+    /**
+     * Dense block of state features (feature.possible_states).
+     *  When enabled, state features are not stored in the feature array;
+     *  the state feature (a, l) has the id (features.size() + a * L + l),
+     *  i.e., the reference of the attribute #a is the range of L ids, and
+     *  the label of the r-th feature is #r.
+     */
+    int dense_states;
+    std::vector<floatval_t> dense_freq;         /**< Observed frequencies of the dense block [A*L]. */
+
     crf1d_context_t *ctx;           /**< CRF1d context. */
     crf1de_option_t opt;            /**< CRF1d options. */
+    std::vector<crf1de_worker_t> workers;   /**< Work spaces for threads #1, ..., #(n-1). */
 public:
-    crf1de_t() {}
+    crf1de_t() : dense_states(0), ctx(NULL) {}
+    ~crf1de_t()
+    {
+        for (auto& wk: this->workers) {
+            delete wk.ctx;
+        }
+        delete this->ctx;
+    }
     size_t num_labels() const { return this->forward_trans.size(); }
-    void state_score(const crfsuite_instance_t& inst,const floatval_t* w)
+    /** Number of all features including the dense block. */
+    int num_features() const { return (int)(this->features.size() + this->dense_freq.size()); }
+
+    void state_score_dense(floatval_t *state, const crfsuite_item_t *item, const floatval_t* w, const floatval_t scale)
+    {
+        const int L = this->num_labels();
+
+        /* Add the weight rows of the attributes to the state scores. */
+        if (item->is_binary() && scale == 1.) {
+            for (int a: item->aids) {
+                vecadd(state, w + ATTRIBUTE(this, a)->offset, L);
+            }
+        } else {
+            for (int c = 0;c < item->num_contents();++c) {
+                vecaadd(state, item->value(c) * scale, w + ATTRIBUTE(this, item->aid(c))->offset, L);
+            }
+        }
+    }
+
+    void state_score(crf1d_context_t* ctx, const crfsuite_instance_t& inst,const floatval_t* w)
     {
         int i, t, r;
-        crf1d_context_t* ctx = this->ctx;
         const int T = inst.num_items();
         const int L = this->num_labels();
 
@@ -86,6 +140,23 @@ public:
             const crfsuite_item_t *item = &inst.items[t];
             floatval_t *state = STATE_SCORE(ctx, t);
 
+            if (this->dense_states) {
+                this->state_score_dense(state, item, w, 1.);
+                continue;
+            }
+
+            /* Binary item: no need to multiply attribute values. */
+            if (item->is_binary()) {
+                for (int a: item->aids) {
+                    const feature_refs_t& attr = this->attributes[a];
+                    for (r = 0;r < attr.num_features;++r) {
+                        int fid = attr.offset + r;
+                        state[this->features[fid].dst] += w[fid];
+                    }
+                }
+                continue;
+            }
+
             /* Loop over the contents (attributes) attached to the item. */
             for (const auto & content: item->contents) {
                 /* Access the list of state features associated with the attribute. */
@@ -96,7 +167,7 @@ public:
                 /* Loop over the state features associated with the attribute. */
                 for (r = 0;r < attr.num_features;++r) {
                     /* State feature associates the attribute #a with the label #(f->dst). */
-                    int fid = attr.fids[r];
+                    int fid = attr.offset + r;
                     const crf1df_feature_t f = this->features[fid];
                     state[f.dst] += w[fid] * value;
                 }
@@ -113,7 +184,7 @@ public:
 
         /* Forward to the non-scaling version for fast computation when scale == 1. */
         if (scale == 1.) {
-            this->state_score( *inst, w);
+            this->state_score(ctx, *inst, w);
             return;
         }
 
@@ -122,27 +193,31 @@ public:
             const crfsuite_item_t *item = &inst->items[t];
             floatval_t *state = STATE_SCORE(ctx, t);
 
+            if (this->dense_states) {
+                this->state_score_dense(state, item, w, scale);
+                continue;
+            }
+
             /* Loop over the contents (attributes) attached to the item. */
             for (i = 0;i < item->num_contents();++i) {
                 /* Access the list of state features associated with the attribute. */
-                int a = item->contents[i].aid;
+                int a = item->aid(i);
                 const feature_refs_t *attr = ATTRIBUTE(this, a);
-                floatval_t value = item->contents[i].value * scale;
+                floatval_t value = item->value(i) * scale;
 
                 /* Loop over the state features associated with the attribute. */
                 for (r = 0;r < attr->num_features;++r) {
                     /* State feature associates the attribute #a with the label #(f->dst). */
-                    int fid = attr->fids[r];
+                    int fid = attr->offset + r;
                     const crf1df_feature_t *f = FEATURE(this, fid);
                     state[f->dst] += w[fid] * value;
                 }
             }
         }
     }
-    void transition_score(const floatval_t* w)
+    void transition_score(crf1d_context_t* ctx, const floatval_t* w)
     {
         int i, r;
-        crf1d_context_t* ctx = this->ctx;
         const int L = this->num_labels();
 
         /* Compute transition scores between two labels. */
@@ -151,7 +226,7 @@ public:
             const feature_refs_t *edge = TRANSITION(this, i);
             for (r = 0;r < edge->num_features;++r) {
                 /* Transition feature from #i to #(f->dst). */
-                int fid = edge->fids[r];
+                int fid = edge->offset + r;
                 const crf1df_feature_t *f = FEATURE(this, fid);
                 trans[f->dst] = w[fid];
             }        
@@ -165,7 +240,7 @@ public:
 
         /* Forward to the non-scaling version for fast computation when scale == 1. */
         if (scale == 1.) {
-            this->transition_score( w);
+            this->transition_score(ctx, w);
             return;
         }
 
@@ -175,7 +250,7 @@ public:
             const feature_refs_t *edge = TRANSITION(this, i);
             for (r = 0;r < edge->num_features;++r) {
                 /* Transition feature from #i to #(f->dst). */
-                int fid = edge->fids[r];
+                int fid = edge->offset + r;
                 const crf1df_feature_t *f = FEATURE(this, fid);
                 trans[f->dst] = w[fid] * scale;
             }        
@@ -204,14 +279,20 @@ public:
             /* Loop over the contents (attributes) attached to the item. */
             for (c = 0;c < item->num_contents();++c) {
                 /* Access the list of state features associated with the attribute. */
-                int a = item->contents[c].aid;
+                int a = item->aid(c);
                 const feature_refs_t *attr = ATTRIBUTE(this, a);
-                floatval_t value = item->contents[c].value;
+                floatval_t value = item->value(c);
+
+                /* The feature (a, j) of the dense block. */
+                if (this->dense_states) {
+                    func(instance, attr->offset + j, value);
+                    continue;
+                }
 
                 /* Loop over the state features associated with the attribute. */
                 for (r = 0;r < attr->num_features;++r) {
                     /* State feature associates the attribute #a with the label #(f->dst). */
-                    int fid = attr->fids[r];
+                    int fid = attr->offset + r;
                     const crf1df_feature_t *f = FEATURE(this, fid);
                     if (f->dst == j) {
                         func(instance, fid, value);
@@ -223,7 +304,7 @@ public:
                 const feature_refs_t *edge = TRANSITION(this, i);
                 for (r = 0;r < edge->num_features;++r) {
                     /* Transition feature from #i to #(f->dst). */
-                    int fid = edge->fids[r];
+                    int fid = edge->offset + r;
                     const crf1df_feature_t *f = FEATURE(this, fid);
                     if (f->dst == j) {
                         func(instance, fid, 1.);
@@ -253,20 +334,38 @@ public:
             const crfsuite_item_t *item = &inst->items[t];
             const int j = labels[t];
 
-            /* Loop over the contents (attributes) attached to the item. */
-            for (c = 0;c < item->num_contents();++c) {
-                /* Access the list of state features associated with the attribute. */
-                int a = item->contents[c].aid;
-                const feature_refs_t *attr = ATTRIBUTE(this, a);
-                floatval_t value = item->contents[c].value;
-
-                /* Loop over the state features associated with the attribute. */
-                for (r = 0;r < attr->num_features;++r) {
-                    /* State feature associates the attribute #a with the label #(f->dst). */
-                    int fid = attr->fids[r];
-                    const crf1df_feature_t *f = FEATURE(this, fid);
-                    if (f->dst == j) {
-                        w[fid] += value * scale;
+            if (this->dense_states) {
+                /* Dense block: the feature (a, j) is located directly. */
+                for (c = 0;c < item->num_contents();++c) {
+                    w[ATTRIBUTE(this, item->aid(c))->offset + j] += item->value(c) * scale;
+                }
+            } else if (item->is_binary()) {
+                /* Binary item: every attribute contributes the scale. */
+                for (int a: item->aids) {
+                    const feature_refs_t *attr = ATTRIBUTE(this, a);
+                    for (r = 0;r < attr->num_features;++r) {
+                        int fid = attr->offset + r;
+                        if (FEATURE(this, fid)->dst == j) {
+                            w[fid] += scale;
+                        }
+                    }
+                }
+            } else {
+                /* Loop over the contents (attributes) attached to the item. */
+                for (c = 0;c < item->num_contents();++c) {
+                    /* Access the list of state features associated with the attribute. */
+                    int a = item->contents[c].aid;
+                    const feature_refs_t *attr = ATTRIBUTE(this, a);
+                    floatval_t value = item->contents[c].value;
+
+                    /* Loop over the state features associated with the attribute. */
+                    for (r = 0;r < attr->num_features;++r) {
+                        /* State feature associates the attribute #a with the label #(f->dst). */
+                        int fid = attr->offset + r;
+                        const crf1df_feature_t *f = FEATURE(this, fid);
+                        if (f->dst == j) {
+                            w[fid] += value * scale;
+                        }
                     }
                 }
             }
@@ -275,7 +374,7 @@ public:
                 const feature_refs_t *edge = TRANSITION(this, i);
                 for (r = 0;r < edge->num_features;++r) {
                     /* Transition feature from #i to #(f->dst). */
-                    int fid = edge->fids[r];
+                    int fid = edge->offset + r;
                     const crf1df_feature_t *f = FEATURE(this, fid);
                     if (f->dst == j) {
                         w[fid] += scale;
@@ -288,13 +387,13 @@ public:
     }
     void
     model_expectation(
+        crf1d_context_t* ctx,
         const crfsuite_instance_t *inst,
         floatval_t *w,
         const floatval_t scale
         )
     {
         int a, c, i, t, r;
-        crf1d_context_t* ctx = this->ctx;
         const feature_refs_t *attr = NULL, *trans = NULL;
         const crfsuite_item_t* item = NULL;
         const int T = inst->num_items();
@@ -305,6 +404,25 @@ public:
 
             /* Compute expectations for state features at position #t. */
             item = &inst->items[t];
+            if (this->dense_states) {
+                /* Dense block: add the marginals to the weight rows. */
+                for (c = 0;c < item->num_contents();++c) {
+                    attr = ATTRIBUTE(this, item->aid(c));
+                    vecaadd(w + attr->offset, item->value(c) * scale, prob, L);
+                }
+                continue;
+            }
+            if (item->is_binary()) {
+                /* Binary item: skip the multiplication by attribute values. */
+                for (int a: item->aids) {
+                    attr = ATTRIBUTE(this, a);
+                    for (r = 0;r < attr->num_features;++r) {
+                        int fid = attr->offset + r;
+                        w[fid] += prob[FEATURE(this, fid)->dst] * scale;
+                    }
+                }
+                continue;
+            }
             for (c = 0;c < item->num_contents();++c) {
                 /* Access the attribute. */
                 floatval_t value = item->contents[c].value;
@@ -313,7 +431,7 @@ public:
 
                 /* Loop over state features for the attribute. */
                 for (r = 0;r < attr->num_features;++r) {
-                    int fid = attr->fids[r];
+                    int fid = attr->offset + r;
                     crf1df_feature_t *f = FEATURE(this, fid);
                     w[fid] += prob[f->dst] * value * scale;
                 }
@@ -326,13 +444,216 @@ public:
             const feature_refs_t *edge = TRANSITION(this, i);
             for (r = 0;r < edge->num_features;++r) {
                 /* Transition feature from #i to #(f->dst). */
-                int fid = edge->fids[r];
+                int fid = edge->offset + r;
                 crf1df_feature_t *f = FEATURE(this, fid);
                 w[fid] += prob[f->dst] * scale;
             }
         }
     }
 
+    /**
+     * Accumulate the gradients of an instance to a sparse gradient vector.
+     *  Transition scores (and their exponents) must be set to the context in
+     *  advance; transition features are not marked active by this function.
+     */
+    floatval_t
+    instance_gradients(
+        crf1d_context_t* ctx,
+        const crfsuite_instance_t *inst,
+        const floatval_t* w,
+        sparse_gradient_t& grad
+        )
+    {
+        /* Set state scores and compute the marginal probabilities. */
+        ctx->crf1dc_set_num_items(inst->num_items());
+        ctx->crf1dc_reset(RF_STATE);
+        this->state_score(ctx, *inst, w);
+        ctx->crf1dc_exp_state();
+        ctx->crf1dc_alpha_score();
+        ctx->crf1dc_beta_score();
+        ctx->crf1dc_marginals();
+
+        /* Mark the state features that the instance may fire. */
+        for (const auto& item: inst->items) {
+            for (int c = 0;c < (int)item.num_contents();++c) {
+                const feature_refs_t& attr = this->attributes[item.aid(c)];
+                for (int r = 0;r < attr.num_features;++r) {
+                    grad.touch(attr.offset + r);
+                }
+            }
+        }
+
+        /* Gradients of the negative log-likelihood: mexp - oexp. */
+        this->model_expectation(ctx, inst, grad.g.data(), inst->weight);
+        this->observation_expectation(inst, inst->labels, grad.g.data(), -inst->weight);
+
+        return (ctx->crf1dc_lognorm() - ctx->crf1dc_score(inst->labels)) * inst->weight;
+    }
+
+    floatval_t
+    objective_and_gradients_minibatch(
+        dataset_t& ds,
+        int begin,
+        int end,
+        const floatval_t* w,
+        sparse_gradient_t& grad
+        )
+    {
+        const int K = this->num_features();
+        const int L = this->num_labels();
+        int n = this->opt.num_threads;
+
+        /* Determine the number of threads for this batch. */
+        if (n <= 0) {
+            n = std::max(1u, std::thread::hardware_concurrency());
+        }
+        n = std::max(1, std::min(n, end - begin));
+
+        /* Prepare work spaces for threads #1, ..., #(n-1). */
+        while ((int)this->workers.size() < n-1) {
+            crf1de_worker_t wk;
+            wk.ctx = new crf1d_context_t(CTXF_MARGINALS | CTXF_VITERBI, L, this->ctx->cap_items);
+            this->workers.push_back(std::move(wk));
+        }
+        for (int i = 0;i < n-1;++i) {
+            if ((int)this->workers[i].grad.g.size() != K) {
+                this->workers[i].grad.init(K);
+            }
+        }
+        if ((int)grad.g.size() != K) {
+            grad.init(K);
+        } else {
+            grad.reset();
+        }
+
+        /*
+            Split the batch into contiguous slices with roughly the same
+            number of items so that the result does not depend on thread
+            scheduling.
+         */
+        std::vector<int> bounds(n+1, end);
+        long long total = 0, acc = 0;
+        for (int i = begin;i < end;++i) {
+            total += ds.get(i)->num_items();
+        }
+        bounds[0] = begin;
+        for (int i = begin, j = 1;i < end && j < n;++i) {
+            acc += ds.get(i)->num_items();
+            while (j < n && acc * n >= total * j) {
+                bounds[j++] = i+1;
+            }
+        }
+
+        std::vector<floatval_t> losses(n, 0.);
+        auto run = [&](int j) {
+            crf1d_context_t* ctx = (j == 0) ? this->ctx : this->workers[j-1].ctx;
+            sparse_gradient_t& g = (j == 0) ? grad : this->workers[j-1].grad;
+
+            /* Set the transition scores for the worker context. */
+            ctx->crf1dc_reset(RF_TRANS);
+            this->transition_score(ctx, w);
+            ctx->crf1dc_exp_transition();
+
+            for (int i = bounds[j];i < bounds[j+1];++i) {
+                losses[j] += this->instance_gradients(ctx, ds.get(i), w, g);
+            }
+
+            /*
+                Every transition feature receives a model expectation; mark
+                them active so that they are merged and reset as well.
+             */
+            for (int i = 0;i < L;++i) {
+                const feature_refs_t *edge = TRANSITION(this, i);
+                for (int r = 0;r < edge->num_features;++r) {
+                    g.touch(edge->offset + r);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int j = 1;j < n;++j) {
+            threads.emplace_back(run, j);
+        }
+        run(0);
+        for (auto& th: threads) {
+            th.join();
+        }
+
+        /* Merge the gradients of the other threads. */
+        floatval_t loss = losses[0];
+        for (int j = 1;j < n;++j) {
+            sparse_gradient_t& g = this->workers[j-1].grad;
+            for (int k: g.actives) {
+                grad.add(k, g.g[k]);
+            }
+            g.reset();
+            loss += losses[j];
+        }
+
+        return loss;
+    }
+
+    void
+    objective_and_gradients_batch(
+        dataset_t& ds,
+        const floatval_t *w,
+        floatval_t *f,
+        floatval_t *g
+        )
+    {
+        floatval_t logp = 0, logl = 0;
+        crf1d_context_t* ctx = this->ctx;
+        const int N = ds.size();
+        const int S = this->features.size();
+
+        /*
+            Initialize the gradients with observation expectations.
+         */
+        for (int i = 0;i < S;++i) {
+            crf1df_feature_t* f = &this->features[i];
+            g[i] = -f->freq;
+        }
+        for (size_t i = 0;i < this->dense_freq.size();++i) {
+            g[S + i] = -this->dense_freq[i];
+        }
+
+        /*
+            Set the scores (weights) of transition features here because
+            these are independent of input label sequences.
+         */
+        ctx->crf1dc_reset(RF_TRANS);
+        this->transition_score(ctx, w);
+        ctx->crf1dc_exp_transition();
+
+        /*
+            Compute model expectations.
+         */
+        for (int i = 0;i < N;++i) {
+            const crfsuite_instance_t *seq = ds.get(i);
+
+            /* Set label sequences and state scores. */
+            ctx->crf1dc_set_num_items(seq->num_items());
+            ctx->crf1dc_reset(RF_STATE);
+            this->state_score(ctx, *seq, w);
+            ctx->crf1dc_exp_state();
+
+            /* Compute forward/backward scores. */
+            ctx->crf1dc_alpha_score();
+            ctx->crf1dc_beta_score();
+            ctx->crf1dc_marginals();
+
+            /* Compute the probability of the input sequence on the model. */
+            logp = ctx->crf1dc_score(seq->labels) - ctx->crf1dc_lognorm();
+            /* Update the log-likelihood. */
+            logl += logp * seq->weight;
+
+            /* Update the model expectations of features. */
+            this->model_expectation(ctx, seq, g, seq->weight);
+        }
+
+        *f = -logl;
+    }
+
     void set_data(dataset_t &ds,logging_t *lg)
     {
         clock_t begin = 0;
@@ -357,17 +678,43 @@ public:
         logging(lg, "feature.minfreq: %f\n", opt->feature_minfreq);
         logging(lg, "feature.possible_states: %d\n", opt->feature_possible_states);
         logging(lg, "feature.possible_transitions: %d\n", opt->feature_possible_transitions);
+        logging(lg, "feature.sketch_memory: %d\n", opt->feature_sketch_memory);
+        if (opt->feature_possible_states && 0 < opt->feature_minfreq) {
+            logging(lg, "feature.minfreq is ignored for state features (feature.possible_states)\n");
+        }
         begin = clock();
+        /* Possible state features form a dense A*L block, so that only
+           transition features are generated as feature records. */
+        this->dense_states = opt->feature_possible_states ? 1 : 0;
         crf1df_generate(
             this->features,
             ds,
-            opt->feature_possible_states ? 1 : 0,
+            0,
+            this->dense_states,
             opt->feature_possible_transitions ? 1 : 0,
             opt->feature_minfreq,
+            opt->feature_sketch_memory,
+            opt->num_threads,
             lg->func,
             lg->instance
             );
-        auto num_features = this->features.size();
+        if (this->dense_states) {
+            /* Feature ids of the dense block must fit in int. */
+            if (INT_MAX < (int64_t)this->features.size() + (int64_t)A * L) {
+                throw std::runtime_error("Too many possible state features");
+            }
+            this->dense_freq.assign((size_t)A * L, 0.);
+            for (int i = 0;i < N;++i) {
+                const crfsuite_instance_t *seq = ds.get(i);
+                for (int t = 0;t < seq->num_items();++t) {
+                    const crfsuite_item_t& item = seq->items[t];
+                    for (int c = 0;c < item.num_contents();++c) {
+                        this->dense_freq[(size_t)item.aid(c) * L + seq->labels[t]] += seq->weight * item.value(c);
+                    }
+                }
+            }
+        }
+        auto num_features = this->num_features();
         logging(lg, "Number of features: %d\n", num_features);
         logging(lg, "Seconds required: %.3f\n", (clock() - begin) / (double)CLOCKS_PER_SEC);
         logging(lg, "\n");
@@ -375,11 +722,39 @@ public:
         /* Initialize the feature references. */
         this->attributes = std::vector<feature_refs_t>(A);
         this->forward_trans = std::vector<feature_refs_t>(L);
-        crf1df_init_references(
+        if (crf1df_init_references(
             this->attributes,
             this->forward_trans,
-            this->features)
-           ;
+            this->features) != 0) {
+            throw std::runtime_error("Features are not sorted");
+        }
+        if (this->dense_states) {
+            const int S = this->features.size();
+            for (int a = 0;a < A;++a) {
+                this->attributes[a].offset = (int)(S + (int64_t)a * L);
+                this->attributes[a].num_features = L;
+            }
+        }
+
+        /*
+            Order the instances by their lengths so that the encoder and
+            trainers visit equal-length instances consecutively.
+         */
+        if (opt->dataset_sort_by_length) {
+            int B = 0;
+            size_t T_prev = 0;
+            logging(lg, "Length bucketing\n");
+            ds.reset_order();
+            ds.sort_by_length();
+            for (int i = 0;i < N;++i) {
+                if (i == 0 || ds.get(i)->num_items() != T_prev) {
+                    T_prev = ds.get(i)->num_items();
+                    ++B;
+                }
+            }
+            logging(lg, "Number of buckets: %d\n", B);
+            logging(lg, "\n");
+        }
     }
 
 
@@ -390,7 +765,7 @@ public:
     const floatval_t threshold = 0.01;
     const int L = this->num_labels();
     const int A = this->attributes.size();
-    const int K = this->features.size();
+    const int K = this->num_features();
     int J = 0, B = 0;
 
     /* Start storing the model. */
@@ -407,6 +782,13 @@ public:
     for (int k = 0;k < K;++k) fmap[k] = -1;
 #endif/*CRF_TRAIN_SAVE_NO_PRUNING*/
 
+    /* In the feature hashing mode, attribute ids are hash values. */
+    const int hashing = (0 < this->opt.feature_hash_bits);
+    AttributeHasher hasher;
+    if (hashing) {
+        hasher = AttributeHasher(CRFSUITE_ATTRHASH_FNV1A, this->opt.feature_hash_bits, (uint32_t)this->opt.feature_hash_seed);
+    }
+
     /* Allocate and initialize the attribute mapping. */
     int *amap = new int[A];    
 #ifdef  CRF_TRAIN_SAVE_NO_PRUNING
@@ -416,20 +798,26 @@ public:
     for (int a = 0;a < A;++a) amap[a] = -1;
 #endif/*CRF_TRAIN_SAVE_NO_PRUNING*/
 
-    /*
-     *  Open a model writer.
-     */
-    tag_crf1dmw* writer = new tag_crf1dmw(filename);
-
-    /* Open a feature chunk in the model file. */
-    writer->crf1dmw_open_features(K);
+    auto wall_begin = std::chrono::steady_clock::now();
 
     /*
-     *  Write the feature values.
-     *     (with determining active features and attributes).
+     *  Collect the feature values (with determining active features and
+     *  attributes).
      */
+    std::vector<crf1dm_feature_t> active;
+    const int S = this->features.size();
     for (int k = 0;k < K;++k) {
-        crf1df_feature_t* f = &this->features[k];
+        crf1df_feature_t dense;
+        crf1df_feature_t* f = &dense;
+        if (k < S) {
+            f = &this->features[k];
+        } else {
+            /* A state feature in the dense block. */
+            dense.type = FT_STATE;
+            dense.src = (k - S) / L;
+            dense.dst = (k - S) % L;
+            dense.freq = this->dense_freq[k - S];
+        }
         if (w[k] != 0) {
             int src;
             crf1dm_feature_t feat;
@@ -440,8 +828,9 @@ public:
 
             /* Map the source of the field. */
             if (f->type == FT_STATE) {
-                /* The attribute #(f->src) will have a new attribute id (#B). */
-                if (amap[f->src] < 0) amap[f->src] = B++;    /* Attribute #a -> #amap[a]. */
+                /* The attribute #(f->src) will have a new attribute id (#B).
+                   Hashed attributes keep their ids. */
+                if (amap[f->src] < 0) amap[f->src] = hashing ? f->src : B++;    /* Attribute #a -> #amap[a]. */
                 src = amap[f->src];
             } else {
                 src = f->src;
@@ -452,74 +841,160 @@ public:
             feat.src = src;
             feat.dst = f->dst;
             feat.weight = w[k];
-
-            /* Write the feature. */
-            writer->crf1dmw_put_feature(fmap[k], &feat);
+            active.push_back(feat);
         }
     }
 
-    /* Close the feature chunk. */
-    writer->crf1dmw_close_features();
-
+    if (hashing) {
+        for (int a = 0;a < A;++a) {
+            if (0 <= amap[a]) ++B;
+        }
+    }
     logging(lg, "Number of active features: %d (%d)\n", J, K);
     logging(lg, "Number of active attributes: %d (%d)\n", B, A);
     logging(lg, "Number of active labels: %d (%d)\n", L, L);
 
-    /* Write labels. */
-    logging(lg, "Writing labels\n", L);
-    writer->crf1dmw_open_labels(L);
+    /* Collect the strings of labels and active attributes. */
+    const int NA = hashing ? A : B;
+    std::vector<const char*> label_strs(L, NULL), attr_strs;
     for (int l = 0;l < L;++l) {
-        const char *str = NULL;
-        labels->to_string( l, &str);
-        if (str != NULL) {
-            writer->crf1dmw_put_label(l, str);
+        labels->to_string(l, &label_strs[l]);
+    }
+    if (!hashing) {
+        attr_strs.assign(B, NULL);
+        for (int a = 0;a < A;++a) {
+            if (0 <= amap[a]) {
+                attrs->to_string(a, &attr_strs[amap[a]]);
+            }
         }
     }
-    writer->crf1dmw_close_labels();
 
-    /* Write attributes. */
-    logging(lg, "Writing attributes\n");
-    writer->crf1dmw_open_attrs(B);
-    for (int a = 0;a < A;++a) {
-        if (0 <= amap[a]) {
-            const char *str = NULL;
-            attrs->to_string( a, &str);
-            if (str != NULL) {
-                writer->crf1dmw_put_attr(amap[a], str);
+    /* The version-1 format has 32-bit offsets; check if the model fits. */
+    const uint64_t estimate = crf1dm_estimate_v1_size(J, L, NA, label_strs, attr_strs);
+
+    int ret = 0;
+    uint64_t size = 0;
+    if (0xFFFFFFFFULL < estimate) {
+        /*
+         *  The version-1 format cannot address the model; store it in the
+         *  version-2 format with 64-bit offsets, grouping state features
+         *  by attributes.
+         */
+        std::vector<crf1dm_feature_t> trans, states;
+        std::vector<uint32_t> attr_offsets(NA + 1, 0);
+        logging(lg, "The model exceeds 4 GB; storing it in the version-2 format with 64-bit offsets\n");
+
+        for (const crf1dm_feature_t& f: active) {
+            if (f.type == FT_STATE) {
+                ++attr_offsets[f.src + 1];
+            } else {
+                trans.push_back(f);
             }
         }
-    }
-    writer->crf1dmw_close_attrs();
+        for (int a = 0;a < NA;++a) {
+            attr_offsets[a+1] += attr_offsets[a];
+        }
+        states.resize(attr_offsets[NA]);
+        {
+            std::vector<uint32_t> pos(attr_offsets.begin(), attr_offsets.end() - 1);
+            for (const crf1dm_feature_t& f: active) {
+                if (f.type == FT_STATE) {
+                    states[pos[f.src]++] = f;
+                }
+            }
+        }
+        std::vector<crf1dm_feature_t>().swap(active);
 
-    /* Write label feature references. */
-    logging(lg, "Writing feature references for transitions\n");
+        ret = crf1dm_write_v2(filename, label_strs, attr_strs, hasher, trans, states, attr_offsets, CRFSUITE_WEIGHT_FP64, 0, &size);
+        if (ret != 0) {
+            logging(lg, "ERROR: failed to write the model\n");
+        }
+    } else {
+        /*
+         *  Open a model writer.
+         */
+        tag_crf1dmw* writer = new tag_crf1dmw(filename, hashing ? &hasher : NULL);
+        if (writer->fp == NULL) {
+            logging(lg, "ERROR: failed to open the model file: %s\n", filename);
+            delete writer;
+            delete[] amap;
+            delete[] fmap;
+            return CRFSUITEERR_INTERNAL_LOGIC;
+        }
+        writer->num_threads = this->opt.num_threads;
+
+        /* Write the features. */
+        writer->crf1dmw_open_features(K);
+        writer->crf1dmw_put_features(active.data(), (int)active.size());
+        writer->crf1dmw_close_features();
+        std::vector<crf1dm_feature_t>().swap(active);
+
+        /* Write labels. */
+        logging(lg, "Writing labels\n", L);
+        writer->crf1dmw_open_labels(L);
+        for (int l = 0;l < L;++l) {
+            if (label_strs[l] != NULL) {
+                writer->crf1dmw_put_label(l, label_strs[l]);
+            }
+        }
+        writer->crf1dmw_close_labels();
+
+        /* Write attributes (no attribute dictionary in the hashing mode). */
+        if (!hashing) {
+            logging(lg, "Writing attributes\n");
+            writer->crf1dmw_open_attrs(B);
+            writer->crf1dmw_put_attrs(attr_strs.data(), B);
+            writer->crf1dmw_close_attrs();
+        } else {
+            logging(lg, "Attribute hashing: %d bits (seed = %d)\n", this->opt.feature_hash_bits, this->opt.feature_hash_seed);
+        }
 
-    writer->crf1dmw_open_labelrefs(L+2);
-    for (int l = 0;l < L;++l) {
-        const feature_refs_t *edge = TRANSITION(this, l);
-        writer->crf1dmw_put_labelref(l, edge, fmap);
-    }
-    writer->crf1dmw_close_labelrefs();
+        /* Write label feature references. */
+        logging(lg, "Writing feature references for transitions\n");
+
+        writer->crf1dmw_open_labelrefs(L+2);
+        for (int l = 0;l < L;++l) {
+            const feature_refs_t *edge = TRANSITION(this, l);
+            writer->crf1dmw_put_labelref(l, edge, fmap);
+        }
+        writer->crf1dmw_close_labelrefs();
+
+        /* Write attribute feature references. */
+        logging(lg, "Writing feature references for attributes\n");
+        writer->crf1dmw_open_attrrefs(NA);
+        for (int a = 0;a < A;++a) {
+            if (0 <= amap[a]) {
+                const feature_refs_t *attr = ATTRIBUTE(this, a);
+                writer->crf1dmw_put_attrref(amap[a], attr, fmap);
+            } else if (hashing) {
+                /* Every hash bucket needs a (possibly empty) reference. */
+                const feature_refs_t empty = {0, 0};
+                writer->crf1dmw_put_attrref(a, &empty, fmap);
+            }
+        }
+        writer->crf1dmw_close_attrrefs();
 
-    /* Write attribute feature references. */
-    logging(lg, "Writing feature references for attributes\n");
-     writer->crf1dmw_open_attrrefs(B);
-    for (int a = 0;a < A;++a) {
-        if (0 <= amap[a]) {
-            const feature_refs_t *attr = ATTRIBUTE(this, a);
-            writer->crf1dmw_put_attrref(amap[a], attr, fmap);
+        /* Close the writer. */
+        if (writer->crf1dmw_close() != 0) {
+            logging(lg, "ERROR: failed to write the model\n");
+            ret = CRFSUITEERR_INTERNAL_LOGIC;
         }
+        size = writer->header.size;
+        delete writer;
     }
-    writer->crf1dmw_close_attrrefs();
 
-    /* Close the writer. */
-    delete writer;
+    if (ret == 0) {
+        const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+        const double mb = size / 1048576.;
+        logging(lg, "Model size: %.3f MB\n", mb);
+        logging(lg, "Write throughput: %.1f MB/s\n", 0 < sec ? mb / sec : 0.);
+    }
     logging(lg, "Seconds required: %.3f\n", (clock() - begin) / (double)CLOCKS_PER_SEC);
     logging(lg, "\n");
 
     delete[] amap;
     delete[] fmap;
-    return 0;
+    return ret;
     }
 };
 
@@ -538,8 +1013,33 @@ static int crf1de_exchange_options(crfsuite_params_t* params, crf1de_option_t* o
             "feature.possible_transitions", opt->feature_possible_transitions, 0,
             "Force to generate possible transition features."
             )
+        DDX_PARAM_INT(
+            "feature.sketch_memory", opt->feature_sketch_memory, 0,
+            "The memory size (in MB) of the count-min sketch that screens candidates for feature.minfreq (0 to count exactly in one pass)."
+            )
+        DDX_PARAM_INT(
+            "feature.hash_bits", opt->feature_hash_bits, 0,
+            "Hash attribute strings into 2^bits ids without an attribute dictionary (1 to 30 bits; 0 to disable)."
+            )
+        DDX_PARAM_INT(
+            "feature.hash_seed", opt->feature_hash_seed, 0,
+            "The seed of the attribute hash function."
+            )
+        DDX_PARAM_INT(
+            "num_threads", opt->num_threads, 1,
+            "The number of threads for parallel computations (0 to use all hardware threads)."
+            )
+        DDX_PARAM_INT(
+            "dataset.sort_by_length", opt->dataset_sort_by_length, 0,
+            "Order (bucket) training instances by their lengths; SGD-style trainers shuffle instances within buckets."
+            )
     END_PARAM_MAP()
 
+    /* AttributeHasher rejects the number of bits outside the valid range. */
+    if (mode == PARAMS_READ && opt->feature_hash_bits != 0) {
+        AttributeHasher(CRFSUITE_ATTRHASH_FNV1A, opt->feature_hash_bits, (uint32_t)opt->feature_hash_seed);
+    }
+
     return 0;
 }
 
@@ -612,61 +1112,22 @@ void tag_encoder::set_data(dataset_t &ds, logging_t *lg)
     crf1de_t *crf1de = (crf1de_t*)this->internal;
 
     crf1de->set_data(ds,lg);
-    this->num_features = crf1de->features.size();
+    this->num_features = crf1de->num_features();
     this->cap_items = crf1de->ctx->cap_items;
 }
 
 /* LEVEL_NONE -> LEVEL_NONE. */
 void tag_encoder::objective_and_gradients_batch(dataset_t& ds, const floatval_t *w, floatval_t *f, floatval_t *g)
 {
-    floatval_t logp = 0, logl = 0;
     crf1de_t *crf1de = (crf1de_t*)this->internal;
-    const int N = ds.size();
-    const int K = crf1de->features.size();
-
-    /*
-        Initialize the gradients with observation expectations.
-     */
-    for (int i = 0;i < K;++i) {
-        crf1df_feature_t* f = &crf1de->features[i];
-        g[i] = -f->freq;
-    }
-
-    /*
-        Set the scores (weights) of transition features here because
-        these are independent of input label sequences.
-     */
-    crf1de->ctx->crf1dc_reset(RF_TRANS);
-    crf1de->transition_score( w);
-    crf1de->ctx->crf1dc_exp_transition();
-
-    /*
-        Compute model expectations.
-     */
-    for (int i = 0;i < N;++i) {
-        const crfsuite_instance_t *seq = ds.get( i);
-
-        /* Set label sequences and state scores. */
-        crf1de->ctx->crf1dc_set_num_items(seq->num_items());
-        crf1de->ctx->crf1dc_reset(RF_STATE);
-        crf1de->state_score(*seq, w);
-        crf1de->ctx->crf1dc_exp_state();
-
-        /* Compute forward/backward scores. */
-        crf1de->ctx->crf1dc_alpha_score();
-        crf1de->ctx->crf1dc_beta_score();
-        crf1de->ctx->crf1dc_marginals();
-
-        /* Compute the probability of the input sequence on the model. */
-        logp = crf1de->ctx->crf1dc_score(seq->labels) - crf1de->ctx->crf1dc_lognorm();
-        /* Update the log-likelihood. */
-        logl += logp * seq->weight;
-
-        /* Update the model expectations of features. */
-        crf1de->model_expectation( seq, g, seq->weight);
-    }
+    crf1de->objective_and_gradients_batch(ds, w, f, g);
+}
 
-    *f = -logl;
+/* LEVEL_NONE -> LEVEL_NONE. */
+floatval_t tag_encoder::objective_and_gradients_minibatch(dataset_t& ds, int begin, int end, const floatval_t *w, sparse_gradient_t& grad)
+{
+    crf1de_t *crf1de = (crf1de_t*)this->internal;
+    return crf1de->objective_and_gradients_minibatch(ds, begin, end, w, grad);
 }
 
 /* LEVEL_NONE -> LEVEL_NONE. */
@@ -677,10 +1138,10 @@ void tag_encoder::features_on_path(const crfsuite_instance_t *inst, const std::v
 }
 
 /* LEVEL_NONE -> LEVEL_NONE. */
-void tag_encoder::save_model(const char *filename, const std::vector<floatval_t> &w, const TextVectorization *attrs, const TextVectorization *labels, logging_t *lg)
+int tag_encoder::save_model(const char *filename, const std::vector<floatval_t> &w, const TextVectorization *attrs, const TextVectorization *labels, logging_t *lg)
 {
     crf1de_t *crf1de = (crf1de_t*)this->internal;
-    crf1de->save_model( filename, w, attrs,  labels, lg);
+    return crf1de->save_model( filename, w, attrs,  labels, lg);
 }
 
 /* LEVEL_NONE -> LEVEL_WEIGHT. */
@@ -729,7 +1190,7 @@ floatval_t tag_encoder::objective_and_gradients( floatval_t *g, floatval_t gain,
     this->set_level(LEVEL_MARGINAL);
     gain *= weight;
     crf1de->observation_expectation( this->inst, this->inst->labels, g, gain);
-    crf1de->model_expectation( this->inst, g, -gain);
+    crf1de->model_expectation(crf1de->ctx, this->inst, g, -gain);
     return (-crf1de->ctx->crf1dc_score(this->inst->labels) + crf1de->ctx->crf1dc_lognorm()) * weight;
 }
 
@@ -743,3 +1204,76 @@ tag_encoder::tag_encoder()
 {
     this->internal = new crf1de_t();
 }
+
+/*
+    Check that the gradients of mini-batches do not depend on the number
+    of threads: the gradients computed by several threads must agree with
+    those by a single thread, also when the work spaces are reused.
+ */
+void crf1de_debug_minibatch(FILE *fp)
+{
+    const int L = 4, A = 50, N = 40, B = 10;
+    logging_t lg;
+    dataset_t ds(L, A);
+    tag_encoder gm;
+    crfsuite_params_t* params = params_create_instance();
+    std::vector<floatval_t> w, single;
+    unsigned int x = 1;
+
+    /* Generate instances with pseudo-random attributes and labels. */
+    for (int i = 0;i < N;++i) {
+        crfsuite_instance_t inst;
+        const int T = 1 + i % 7;
+        for (int t = 0;t < T;++t) {
+            crfsuite_item_t item;
+            for (int c = 0;c < 3;++c) {
+                x = x * 1103515245 + 12345;
+                item.append(crfsuite_attribute_t((int)((x >> 16) % A), 1.0));
+            }
+            inst.append(item, (i + t) % L);
+        }
+        ds.append(inst);
+    }
+
+    memset(&lg, 0, sizeof(lg));
+    gm.exchange_options(params, PARAMS_INIT);
+    gm.exchange_options(params, PARAMS_READ);
+    gm.set_data(ds, &lg);
+
+    const int K = gm.num_features;
+    w.resize(K);
+    for (int k = 0;k < K;++k) {
+        w[k] = 0.1 * (k % 7) - 0.3;
+    }
+
+    for (int n: {1, 3, 3}) {
+        sparse_gradient_t grad;
+        params->set_int(params, "num_threads", n);
+        gm.exchange_options(params, PARAMS_READ);
+
+        for (int b = 0;b < N;b += B) {
+            std::vector<floatval_t> g(K, 0.);
+            gm.objective_and_gradients_minibatch(ds, b, b + B, w.data(), grad);
+            for (int k: grad.actives) {
+                g[k] = grad.g[k];
+            }
+
+            if ((int)single.size() < N / B * K) {
+                single.insert(single.end(), g.begin(), g.end());
+            } else {
+                floatval_t diff = 0.;
+                for (int k = 0;k < K;++k) {
+                    diff = std::max(diff, (floatval_t)fabs(g[k] - single[(size_t)b / B * K + k]));
+                }
+                fprintf(fp, "Check for the gradients of the batch #%d with %d threads... ", b / B, n);
+                if (diff < 1e-9) {
+                    fprintf(fp, "OK\n");
+                } else {
+                    fprintf(fp, "FAIL: %g\n", diff);
+                }
+            }
+        }
+    }
+
+    params->release(params);
+}
@@ -40,82 +40,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
 
 #include <crfsuite.h>
 
 #include "logging.h"
 #include "crf1d.h"
+#include "crf1d_featureset.h"
 // #include "rumavl.h"    /* AVL tree library necessary for feature generation. */
 
 /**
- * Feature set.
+ * Features collected by a worker, grouped by shards of attribute ids (state
+ * features) or source labels (transition features). The features of shard
+ * #s are features[offsets[s]], ..., features[offsets[s+1]-1], in the order
+ * of their first occurrences.
  */
-
-struct FeatureEqual {
-    bool operator()(const crf1df_feature_t& lhs, const crf1df_feature_t& rhs) const {
-        return lhs.type == rhs.type && lhs.src == rhs.src && lhs.dst == rhs.dst;
-    }
-};
-
-struct FeatureHash {
-    int operator()(const crf1df_feature_t& f) {
-        return f.type + f.src + f.dst;
-    }
+struct featureset_part_t {
+    std::vector<crf1df_feature_t>   features;
+    std::vector<size_t>             offsets;
 };
 
-struct featureset_t
+static inline int shard_of(const crf1df_feature_t& f, int S)
 {
-std::unordered_set<crf1df_feature_t, FeatureHash, FeatureEqual> m;
-public:
-    void add(const crf1df_feature_t& f)
-    {
-        auto p = this->m.find(f);
-        if (p != this->m.end()) {
-            crf1df_feature_t o = *p;
-            o.freq += f.freq;
-            this->m.erase(p);
-            this->m.insert(o);
-        } else {
-            this->m.insert(f);
-        }
-    }
-    void featureset_generate(std::vector<crf1df_feature_t>& features, floatval_t minfreq) const
-    {
-        std::copy_if(this->m.begin(), this->m.end(), std::back_inserter(features), [=](const auto& x){ return x.freq >= minfreq; });
-    }
-};
-
+    return f.src % S;
+}
 
+/**
+ * Count the state features of a range of instances with a sketch
+ * (the first pass of the two-pass mode).
+ */
+static void crf1df_count_range(
+    countmin_t& sketch,
+    dataset_t &ds,
+    int begin,
+    int end
+    )
+{
+    crf1df_feature_t f;
 
+    for (int s = begin;s < end;++s) {
+        const crfsuite_instance_t* seq = ds.get( s);
+        const int T = seq->num_items();
 
+        for (int t = 0;t < T;++t) {
+            const crfsuite_item_t* item = &seq->items[t];
+            for (int c = 0;c < item->num_contents();++c) {
+                f.type = FT_STATE;
+                f.src = item->aid(c);
+                f.dst = seq->labels[t];
+                f.freq = seq->weight * item->value(c);
+                sketch.add(f);
+            }
+        }
+    }
+}
 
-void crf1df_generate(
-    std::vector<crf1df_feature_t>& features,
+/**
+ * Collect features of a range of instances into a table, and group them
+ * by S shards.
+ *  If a sketch is given, state features whose estimated frequencies are
+ *  below minfreq are not inserted.
+ */
+static void crf1df_generate_range(
+    featureset_part_t& part,
     dataset_t &ds,
-    int connect_all_attrs,
-    int connect_all_edges,
+    int begin,
+    int end,
+    int S,
+    int skip_states,
+    const countmin_t *sketch,
     floatval_t minfreq,
-    crfsuite_logging_callback func,
-    void *instance
+    logging_t *lg
     )
 {
     crf1df_feature_t f;
-    const int N = ds.size();
-    const int L = ds.num_labels();
-    logging_t lg;
-
-    lg.func = func;
-    lg.instance = instance;
-    lg.percent = 0;
-
-    /* Create an instance of feature set. */
     featureset_t set;
+    const int L = ds.num_labels();
 
-    /* Loop over the sequences in the training data. */
-    logging_progress_start(&lg);
-
-    for (int s = 0;s < N;++s) {
+    for (int s = begin;s < end;++s) {
         int prev = L, cur = 0;
         const crfsuite_instance_t* seq = ds.get( s);
         const int T = seq->num_items();
@@ -135,40 +140,86 @@ void crf1df_generate(
                 set.add(f);
             }
 
-            for (int c = 0;c < item->num_contents();++c) {
+            for (int c = 0;!skip_states && c < item->num_contents();++c) {
                 /* State feature: attribute #a -> state #(item->yid). */
                 f.type = FT_STATE;
-                f.src = item->contents[c].aid;
+                f.src = item->aid(c);
                 f.dst = cur;
-                f.freq = seq->weight * item->contents[c].value;
-                set.add(f);
-
-                /* Generate state features connecting attributes with all
-                   output labels. These features are not unobserved in the
-                   training data (zero expexcations). */
-                if (connect_all_attrs) {
-                    for (int i = 0;i < L;++i) {
-                        f.type = FT_STATE;
-                        f.src = item->contents[c].aid;
-                        f.dst = i;
-                        f.freq = 0;
-                        set.add(f);
-                    }
+                f.freq = seq->weight * item->value(c);
+                if (sketch != NULL && sketch->estimate(f) < minfreq) {
+                    continue;
                 }
+                set.add(f);
             }
 
             prev = cur;
         }
 
-        logging_progress(&lg, s * 100 / N);
+        if (lg != NULL) {
+            logging_progress(lg, (s - begin + 1) * 100 / (end - begin));
+        }
+    }
+
+    /* Group the features by shards, keeping the order within a shard. */
+    part.offsets.assign(S + 1, 0);
+    for (size_t k = 0;k < set.size();++k) {
+        ++part.offsets[shard_of(set[k], S) + 1];
+    }
+    for (int i = 0;i < S;++i) {
+        part.offsets[i+1] += part.offsets[i];
+    }
+    std::vector<size_t> pos(part.offsets.begin(), part.offsets.end() - 1);
+    part.features.resize(set.size());
+    for (size_t k = 0;k < set.size();++k) {
+        part.features[pos[shard_of(set[k], S)]++] = set[k];
+    }
+}
+
+static void crf1df_merge_shard(
+    std::vector<crf1df_feature_t>& features,
+    const std::vector<featureset_part_t>& workers,
+    int shard,
+    int L,
+    int connect_all_attrs,
+    int connect_all_edges,
+    floatval_t minfreq
+    )
+{
+    crf1df_feature_t f;
+    const int S = (int)workers.size();
+    featureset_t set;
+
+    /* Merge the shards of the workers in the order of instance ranges. */
+    for (const auto& part: workers) {
+        for (size_t k = part.offsets[shard];k < part.offsets[shard+1];++k) {
+            set.add(part.features[k]);
+        }
+    }
+
+    /* Generate state features connecting attributes with all output
+       labels. These features are not unobserved in the training data
+       (zero expexcations). */
+    if (connect_all_attrs) {
+        const size_t K = set.size();
+        for (size_t k = 0;k < K;++k) {
+            if (set[k].type == FT_STATE) {
+                const int a = set[k].src;
+                for (int i = 0;i < L;++i) {
+                    f.type = FT_STATE;
+                    f.src = a;
+                    f.dst = i;
+                    f.freq = 0;
+                    set.add(f);
+                }
+            }
+        }
     }
-    logging_progress_end(&lg);
 
     /* Generate edge features representing all pairs of labels.
        These features are not unobserved in the training data
        (zero expexcations). */
     if (connect_all_edges) {
-        for (int i = 0;i < L;++i) {
+        for (int i = shard;i < L;i += S) {
             for (int j = 0;j < L;++j) {
                 f.type = FT_TRANS;
                 f.src = i;
@@ -180,7 +231,107 @@ void crf1df_generate(
     }
 
     /* Convert the feature set to an feature array. */
-    set.featureset_generate(features,  minfreq);
+    set.featureset_generate(features, minfreq);
+}
+
+void crf1df_generate(
+    std::vector<crf1df_feature_t>& features,
+    dataset_t &ds,
+    int connect_all_attrs,
+    int skip_states,
+    int connect_all_edges,
+    floatval_t minfreq,
+    int sketch_memory,
+    int num_threads,
+    crfsuite_logging_callback func,
+    void *instance
+    )
+{
+    const int N = ds.size();
+    const int L = ds.num_labels();
+    logging_t lg;
+
+    lg.func = func;
+    lg.instance = instance;
+    lg.percent = 0;
+
+    /* Determine the number of workers (and shards). */
+    int P = num_threads;
+    if (P <= 0) {
+        P = std::max(1u, std::thread::hardware_concurrency());
+    }
+    P = std::max(1, std::min(P, N));
+
+    std::vector<featureset_part_t> workers(P);
+    std::vector<std::thread> threads;
+    std::unique_ptr<countmin_t> sketch;
+
+    /*
+        Two-pass mode: count state features with a count-min sketch of
+        bounded memory, shared by the workers at its full width, so that
+        the exact tables receive only candidates that may clear minfreq.
+     */
+    if (0 < sketch_memory && 0 < minfreq && !skip_states) {
+        sketch.reset(new countmin_t((size_t)sketch_memory * 1024 * 1024));
+        for (int w = 0;w < P;++w) {
+            threads.emplace_back(
+                crf1df_count_range,
+                std::ref(*sketch), std::ref(ds),
+                (int)((long long)N * w / P), (int)((long long)N * (w+1) / P)
+                );
+        }
+        for (auto& th: threads) {
+            th.join();
+        }
+        threads.clear();
+    }
+
+    /* Workers scan ranges of instances into their own tables. */
+
+    logging_progress_start(&lg);
+    for (int w = 1;w < P;++w) {
+        threads.emplace_back(
+            crf1df_generate_range,
+            std::ref(workers[w]), std::ref(ds),
+            (int)((long long)N * w / P), (int)((long long)N * (w+1) / P), P,
+            skip_states, sketch.get(), minfreq, (logging_t*)NULL
+            );
+    }
+    /* The calling thread reports the progress of its own range. */
+    crf1df_generate_range(workers[0], ds, 0, (int)((long long)N / P), P, skip_states, sketch.get(), minfreq, &lg);
+    for (auto& th: threads) {
+        th.join();
+    }
+    logging_progress_end(&lg);
+
+    /* Merge the tables shard by shard; shards do not share features. */
+    std::vector<std::vector<crf1df_feature_t> > merged(P);
+    threads.clear();
+    for (int s = 0;s < P;++s) {
+        threads.emplace_back(
+            crf1df_merge_shard,
+            std::ref(merged[s]), std::cref(workers), s, L,
+            connect_all_attrs, connect_all_edges, minfreq
+            );
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+
+    /* Concatenate the features of the shards, and sort them by
+       (type, src, dst) so that feature ids are reproducible and the
+       features of an attribute (or a label) are contiguous. */
+    const size_t offset = features.size();
+    for (const auto& part: merged) {
+        features.insert(features.end(), part.begin(), part.end());
+    }
+    std::sort(
+        features.begin() + offset, features.end(),
+        [](const crf1df_feature_t& x, const crf1df_feature_t& y) {
+            if (x.type != y.type) return x.type < y.type;
+            if (x.src != y.src) return x.src < y.src;
+            return x.dst < y.dst;
+        });
 }
 
 int crf1df_init_references(
@@ -189,27 +340,34 @@ int crf1df_init_references(
     const std::vector<crf1df_feature_t> &features)
 {
     const int K = features.size();
-    const int      A = attributes.size();
-    const int L = trans.size();
-    printf("generate: attrs: %lld, A = %d, trans: %lld, L = %d, features: %lld, K = %d\n", attributes.size(), A, trans.size(), L, features.size(), K);
+
     /*
         The purpose of this routine is to collect references (indices) of:
         - state features fired by each attribute (attributes)
         - transition features pointing from each label (trans)
+        Features are sorted by (type, src, dst), so a reference is the
+        range of the features sharing (type, src).
     */
-
     for (int k = 0;k < K;++k) {
         const crf1df_feature_t *f = &features[k];
+        feature_refs_t *ref = NULL;
         switch (f->type) {
         case FT_STATE:
-            attributes[f->src].num_features++;
-            attributes[f->src].fids.push_back(k);
+            ref = &attributes[f->src];
             break;
         case FT_TRANS:
-            trans[f->src].num_features++;
-            trans[f->src].fids.push_back(k);
+            ref = &trans[f->src];
             break;
+        default:
+            continue;
+        }
+        if (ref->num_features == 0) {
+            ref->offset = k;
+        } else if (ref->offset + ref->num_features != k) {
+            return CRFSUITEERR_INTERNAL_LOGIC;
         }
+        ref->num_features++;
     }
 
+    return 0;
 }
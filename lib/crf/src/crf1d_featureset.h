@@ -0,0 +1,214 @@
+/*
+ *      Feature set for the CRF1d feature generator.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef    __CRF1D_FEATURESET_H__
+#define    __CRF1D_FEATURESET_H__
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "crf1d.h"
+
+/** Pack a feature identity into a 64-bit key (src, dst < 2^31). */
+static inline uint64_t crf1df_pack(const crf1df_feature_t& f)
+{
+    return ((uint64_t)f.type << 62) | ((uint64_t)(uint32_t)f.src << 31) | (uint64_t)(uint32_t)f.dst;
+}
+
+/** Mix the bits of a key (the finalizer of splitmix64). */
+static inline uint64_t crf1df_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * Feature set.
+ *  An open-addressing hash table (linear probing) that maps a feature
+ *  (type, src, dst) packed into a 64-bit key to the position of the feature
+ *  in an array. Features are kept in the order of their first occurrence,
+ *  and the frequency of a repeated feature is updated in place.
+ */
+struct featureset_t
+{
+private:
+    /** A slot of the hash table. */
+    struct slot_t {
+        uint64_t    key;        /**< Packed (type, src, dst), or EMPTY. */
+        int         index;      /**< Index of the feature in the array. */
+    };
+
+    static const uint64_t EMPTY = ~(uint64_t)0;
+
+    std::vector<slot_t>             slots;
+    std::vector<crf1df_feature_t>   features;
+    uint64_t                        mask;
+
+    void rehash(size_t size)
+    {
+        std::vector<slot_t> old(size);
+        old.swap(this->slots);
+        for (auto& slot: this->slots) {
+            slot.key = EMPTY;
+        }
+        this->mask = size - 1;
+        for (const auto& slot: old) {
+            if (slot.key != EMPTY) {
+                uint64_t i = crf1df_mix(slot.key) & this->mask;
+                while (this->slots[i].key != EMPTY) {
+                    i = (i + 1) & this->mask;
+                }
+                this->slots[i] = slot;
+            }
+        }
+    }
+
+public:
+    featureset_t(size_t capacity = 1024) : mask(0)
+    {
+        size_t size = 16;
+        while (size < capacity * 2) {
+            size <<= 1;
+        }
+        this->rehash(size);
+        this->features.reserve(capacity);
+    }
+
+    /** Number of distinct features. */
+    size_t size() const { return this->features.size(); }
+
+    /** Access the i-th feature (in the order of first occurrence). */
+    const crf1df_feature_t& operator[](size_t i) const { return this->features[i]; }
+
+    /**
+     * Add a feature, or accumulate its frequency if it already exists.
+     */
+    void add(const crf1df_feature_t& f)
+    {
+        const uint64_t key = crf1df_pack(f);
+        uint64_t i = crf1df_mix(key) & this->mask;
+
+        for (;;) {
+            slot_t& slot = this->slots[i];
+            if (slot.key == key) {
+                this->features[slot.index].freq += f.freq;
+                return;
+            }
+            if (slot.key == EMPTY) {
+                break;
+            }
+            i = (i + 1) & this->mask;
+        }
+
+        /* Insert a new feature; keep the load factor below 1/2. */
+        this->slots[i].key = key;
+        this->slots[i].index = (int)this->features.size();
+        this->features.push_back(f);
+        if (this->slots.size() < this->features.size() * 2) {
+            this->rehash(this->slots.size() * 2);
+        }
+    }
+
+    /**
+     * Append the features whose frequencies are no smaller than minfreq.
+     */
+    void featureset_generate(std::vector<crf1df_feature_t>& features, floatval_t minfreq) const
+    {
+        for (const auto& f: this->features) {
+            if (f.freq >= minfreq) {
+                features.push_back(f);
+            }
+        }
+    }
+};
+
+/**
+ * Count-min sketch of feature frequencies.
+ *  A fixed-size table of DEPTH rows of integer counters, each of which
+ *  accumulates frequencies of features hashed with a different seed. The
+ *  counters are atomic so that threads can share one sketch of the full
+ *  width. Frequencies are rounded up to integers; the estimate (the minimum
+ *  over the rows) thus never underestimates the frequency of a feature as
+ *  long as the frequencies added are non-negative.
+ */
+struct countmin_t
+{
+    enum { DEPTH = 4 };
+
+private:
+    uint64_t                            width;
+    std::vector<std::atomic<uint32_t> > table;
+
+    inline uint64_t index(uint64_t key, int d) const
+    {
+        return (uint64_t)d * this->width + crf1df_mix(key + 0x9e3779b97f4a7c15ULL * (d + 1)) % this->width;
+    }
+
+public:
+    /**
+     * Construct a sketch.
+     *  @param  bytes       The memory size of the table in bytes.
+     */
+    countmin_t(size_t bytes)
+        : width(std::max((size_t)1, bytes / (sizeof(uint32_t) * DEPTH))), table(width * DEPTH)
+    {
+    }
+
+    /** Add the frequency of a feature; threads may call this concurrently. */
+    void add(const crf1df_feature_t& f)
+    {
+        const uint64_t key = crf1df_pack(f);
+        const uint32_t freq = (0 < f.freq) ? (uint32_t)ceil(f.freq) : 0;
+        for (int d = 0;d < DEPTH;++d) {
+            this->table[this->index(key, d)].fetch_add(freq, std::memory_order_relaxed);
+        }
+    }
+
+    floatval_t estimate(const crf1df_feature_t& f) const
+    {
+        const uint64_t key = crf1df_pack(f);
+        uint32_t freq = this->table[this->index(key, 0)].load(std::memory_order_relaxed);
+        for (int d = 1;d < DEPTH;++d) {
+            freq = std::min(freq, this->table[this->index(key, d)].load(std::memory_order_relaxed));
+        }
+        return (floatval_t)freq;
+    }
+};
+
+#endif/*__CRF1D_FEATURESET_H__*/
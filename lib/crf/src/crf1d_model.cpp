@@ -33,23 +33,46 @@
 #include "os.h"
 
 #include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <cqdb.h>
 
+#if     defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <crfsuite.h>
 #include "crf1d.h"
 
 #define FILEMAGIC       "lCRF"
 #define MODELTYPE       "FOMC"
 #define VERSION_NUMBER  (100)
+#define VERSION_HASHING (101)   /* Version with the attribute hash fields. */
+#define VERSION_V2      (200)   /* Version with the aligned SoA sections. */
+#define VERSION_V2_LARGE (201)  /* Version 200 with 64-bit sizes and offsets. */
 #define CHUNK_LABELREF  "LFRF"
 #define CHUNK_ATTRREF   "AFRF"
 #define CHUNK_FEATURE   "FEAT"
 #define HEADER_SIZE     48
+#define HEADER_SIZE_HASHING 60
+#define HEADER_SIZE_V2  128
+#define SECTION_ALIGN   64
 #define CHUNK_SIZE      12
 #define FEATURE_SIZE    20
+#define ATTR_CQDB_FLAG_V2 CQDB_FASTHASH /* Version-2 attribute dictionaries use the fast hash. */
 
 enum {
     WSTATE_NONE,
@@ -70,27 +93,12 @@ enum {
     KT_FEATURE,
 };
 
-static int write_uint8(FILE *fp, uint8_t value)
-{
-    return fwrite(&value, sizeof(value), 1, fp) == 1 ? 0 : 1;
-}
-
 static int read_uint8(const uint8_t* buffer, uint8_t* value)
 {
     *value = *buffer;
     return sizeof(*value);
 }
 
-static int write_uint32(FILE *fp, uint32_t value)
-{
-    uint8_t buffer[4];
-    buffer[0] = (uint8_t)(value & 0xFF);
-    buffer[1] = (uint8_t)(value >> 8);
-    buffer[2] = (uint8_t)(value >> 16);
-    buffer[3] = (uint8_t)(value >> 24);
-    return fwrite(buffer, sizeof(uint8_t), 4, fp) == 4 ? 0 : 1;
-}
-
 static int read_uint32(const uint8_t* buffer, uint32_t* value)
 {
     *value  = ((uint32_t)buffer[0]);
@@ -100,14 +108,21 @@ static int read_uint32(const uint8_t* buffer, uint32_t* value)
     return sizeof(*value);
 }
 
-static int write_uint8_array(FILE *fp, uint8_t *array, size_t n)
+static int read_uint32(const uint8_t* buffer, uint64_t* value)
 {
-    size_t i;
-    int ret = 0;
-    for (i = 0;i < n;++i) {
-        ret |= write_uint8(fp, array[i]);
-    }
-    return ret;
+    uint32_t v;
+    int size = read_uint32(buffer, &v);
+    *value = v;
+    return size;
+}
+
+static int read_uint64(const uint8_t* buffer, uint64_t* value)
+{
+    uint32_t lo, hi;
+    read_uint32(buffer, &lo);
+    read_uint32(buffer + 4, &hi);
+    *value = ((uint64_t)hi << 32) | lo;
+    return sizeof(*value);
 }
 
 static int read_uint8_array(const uint8_t* buffer, uint8_t *array, size_t n)
@@ -122,31 +137,6 @@ static int read_uint8_array(const uint8_t* buffer, uint8_t *array, size_t n)
     return ret;
 }
 
-static void write_float(FILE *fp, floatval_t value)
-{
-    /*
-        We assume:
-            - sizeof(floatval_t) = sizeof(double) = sizeof(uint64_t)
-            - the byte order of floatval_t and uint64_t is the same
-            - ARM's mixed-endian is not supported
-    */
-    uint64_t iv;
-    uint8_t buffer[8];
-
-    /* Copy the memory image of floatval_t value to uint64_t. */
-    memcpy(&iv, &value, sizeof(iv));
-
-    buffer[0] = (uint8_t)(iv & 0xFF);
-    buffer[1] = (uint8_t)(iv >> 8);
-    buffer[2] = (uint8_t)(iv >> 16);
-    buffer[3] = (uint8_t)(iv >> 24);
-    buffer[4] = (uint8_t)(iv >> 32);
-    buffer[5] = (uint8_t)(iv >> 40);
-    buffer[6] = (uint8_t)(iv >> 48);
-    buffer[7] = (uint8_t)(iv >> 56);
-    fwrite(buffer, sizeof(uint8_t), 8, fp);
-}
-
 static int read_float(const uint8_t* buffer, floatval_t* value)
 {
     uint64_t iv;
@@ -162,60 +152,206 @@ static int read_float(const uint8_t* buffer, floatval_t* value)
     return sizeof(*value);
 }
 
-tag_crf1dmw::tag_crf1dmw(const char *filename)
+static uint16_t float_to_half(floatval_t value)
+{
+    /* Round to the nearest even half-precision value; saturate at 65504. */
+    const float f = (float)value;
+    uint32_t x, man, half;
+    int exp;
+
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    exp = (int)((x >> 23) & 0xFF) - 127 + 15;
+    man = x & 0x7FFFFF;
+
+    if (exp >= 31) {
+        return sign | 0x7BFF;
+    } else if (exp <= 0) {
+        /* A subnormal half (or zero). */
+        int shift = 14 - exp;
+        if (24 < shift) {
+            return sign;
+        }
+        man |= 0x800000;
+        half = man >> shift;
+        if ((man >> (shift - 1)) & 1) {
+            if ((man & ((1u << (shift - 1)) - 1)) || (half & 1)) {
+                ++half;
+            }
+        }
+        return sign | (uint16_t)half;
+    }
+
+    half = ((uint32_t)exp << 10) | (man >> 13);
+    if ((man & 0x1000) && ((man & 0xFFF) || (half & 1))) {
+        ++half;
+    }
+    return (half >= 0x7C00) ? (sign | 0x7BFF) : (sign | (uint16_t)half);
+}
+
+static inline uint8_t* encode_uint32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)(value & 0xFF);
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + sizeof(value);
+}
+
+static inline uint8_t* encode_uint64(uint8_t* p, uint64_t value)
+{
+    encode_uint32(p, (uint32_t)(value & 0xFFFFFFFF));
+    encode_uint32(p + 4, (uint32_t)(value >> 32));
+    return p + sizeof(value);
+}
+
+static inline uint8_t* encode_float(uint8_t* p, floatval_t value)
+{
+    /*
+        We assume:
+            - sizeof(floatval_t) = sizeof(double) = sizeof(uint64_t)
+            - the byte order of floatval_t and uint64_t is the same
+            - ARM's mixed-endian is not supported
+    */
+    uint64_t iv;
+    memcpy(&iv, &value, sizeof(iv));
+    return encode_uint64(p, iv);
+}
+
+static inline void append_uint32(std::vector<uint8_t>& buffer, uint32_t value)
+{
+    size_t n = buffer.size();
+    buffer.resize(n + sizeof(value));
+    encode_uint32(&buffer[n], value);
+}
+
+static int write_zeros(FILE *fp, size_t n)
+{
+    static const uint8_t zeros[64] = {0};
+    while (0 < n) {
+        size_t m = n < sizeof(zeros) ? n : sizeof(zeros);
+        if (fwrite(zeros, 1, m, fp) != m) {
+            return 1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+static uint64_t tell64(FILE *fp)
+{
+#if     defined(_WIN32)
+    return (uint64_t)_ftelli64(fp);
+#else
+    return (uint64_t)ftello(fp);
+#endif
+}
+
+static uint64_t align_file(FILE *fp, uint64_t align)
+{
+    /* Pad the file with zeros so that the next write starts at an aligned offset. */
+    uint64_t offset = tell64(fp);
+    uint64_t pad = (align - offset % align) % align;
+    write_zeros(fp, (size_t)pad);
+    return offset + pad;
+}
+
+tag_crf1dmw::tag_crf1dmw(const char *filename, const AttributeHasher *hasher)
+    : fp(NULL), state(WSTATE_NONE), dbw(NULL), section_begin(0), section_num(0), num_threads(1), attr_flag(0)
 {
     header_t *header = NULL;
+    long header_size = HEADER_SIZE;
     /* Open the file for writing. */
     this->fp = fopen(filename, "wb");
     if (this->fp == NULL) {
         printf("ERROR fopen\n");
+        return;
     }
 
+    /* Sections are written with a few large writes; CQDB chunks benefit from a large stdio buffer. */
+    setvbuf(this->fp, NULL, _IOFBF, 1 << 20);
+
     /* Fill the members in the header. */
     header = &this->header;
+    memset(header, 0, sizeof(*header));
     memcpy(header->magic, FILEMAGIC, 4);
     memcpy(header->type, MODELTYPE, 4);
     header->version = VERSION_NUMBER;
 
-    /* Advance the file position to skip the file header. */
-    if (fseek(this->fp, HEADER_SIZE, SEEK_CUR) != 0) {
-        printf("ERR fseek\n");
+    /* Record the hash function and its seed in the feature hashing mode. */
+    if (hasher != NULL && hasher->enabled()) {
+        header->version = VERSION_HASHING;
+        header->num_attrs = (uint32_t)hasher->num();
+        header->attr_hash = (uint32_t)hasher->type;
+        header->attr_hash_bits = (uint32_t)hasher->bits;
+        header->attr_hash_seed = hasher->seed;
+        header_size = HEADER_SIZE_HASHING;
     }
+
+    /* Reserve the space for the file header. */
+    write_zeros(this->fp, header_size);
 }
 
 tag_crf1dmw::~tag_crf1dmw()
+{
+    this->crf1dmw_close();
+}
+
+int tag_crf1dmw::crf1dmw_close()
 {
     FILE *fp = this->fp;
     header_t *header = &this->header;
+    uint8_t buffer[HEADER_SIZE_HASHING], *p = buffer;
+    int ret = 0;
+
+    if (fp == NULL) {
+        return 0;
+    }
 
     /* Store the file size. */
-    header->size = (uint32_t)ftell(fp);
+    header->size = tell64(fp);
+    if (0xFFFFFFFF < header->size) {
+        /* The caller should have chosen the version-2 format (see crf1dm_write_v2()). */
+        printf("ERROR: the model exceeds 4 GB\n");
+        ret = 1;
+    }
+
+    /* Encode the file header. */
+    memcpy(p, header->magic, 4);
+    p += 4;
+    p = encode_uint32(p, header->size);
+    memcpy(p, header->type, 4);
+    p += 4;
+    p = encode_uint32(p, header->version);
+    p = encode_uint32(p, header->num_features);
+    p = encode_uint32(p, header->num_labels);
+    p = encode_uint32(p, header->num_attrs);
+    p = encode_uint32(p, header->off_features);
+    p = encode_uint32(p, header->off_labels);
+    p = encode_uint32(p, header->off_attrs);
+    p = encode_uint32(p, header->off_labelrefs);
+    p = encode_uint32(p, header->off_attrrefs);
+    if (VERSION_HASHING <= header->version) {
+        p = encode_uint32(p, header->attr_hash);
+        p = encode_uint32(p, header->attr_hash_bits);
+        p = encode_uint32(p, header->attr_hash_seed);
+    }
 
-    /* Move the file position to the head. */
+    /* Write the file header at the head of the file. */
     if (fseek(fp, 0, SEEK_SET) != 0) {
         printf("EE fseek\n");
     }
-
-    /* Write the file header. */
-    write_uint8_array(fp, header->magic, sizeof(header->magic));
-    write_uint32(fp, header->size);
-    write_uint8_array(fp, header->type, sizeof(header->type));
-    write_uint32(fp, header->version);
-    write_uint32(fp, header->num_features);
-    write_uint32(fp, header->num_labels);
-    write_uint32(fp, header->num_attrs);
-    write_uint32(fp, header->off_features);
-    write_uint32(fp, header->off_labels);
-    write_uint32(fp, header->off_attrs);
-    write_uint32(fp, header->off_labelrefs);
-    write_uint32(fp, header->off_attrrefs);
+    fwrite(buffer, 1, (size_t)(p - buffer), fp);
 
     /* Check for any error occurrence. */
     if (ferror(fp)) {
         printf("ERR ferror\n");
+        ret = 1;
     }
     /* Close the writer. */
     fclose(fp);
+    this->fp = NULL;
+    return ret;
 }
 
 int tag_crf1dmw::crf1dmw_open_labels(int num_labels)
@@ -283,7 +419,7 @@ int tag_crf1dmw::crf1dmw_open_attrs(int num_attrs)
     this->header.off_attrs = (uint32_t)ftell(this->fp);
 
     /* Open a CQDB chunk for writing. */
-    this->dbw = cqdb_writer(this->fp, 0);
+    this->dbw = cqdb_writer(this->fp, this->attr_flag);
     if (this->dbw == NULL) {
         this->header.off_attrs = 0;
         return 1;
@@ -326,245 +462,148 @@ int tag_crf1dmw::crf1dmw_put_attr(int aid, const char *value)
     return 0;
 }
 
-int tag_crf1dmw::crf1dmw_open_labelrefs(int num_labels)
+int tag_crf1dmw::crf1dmw_put_attrs(const char * const *values, int n)
 {
-    tag_crf1dmw* writer = this;
-    uint32_t offset;
-    FILE *fp = writer->fp;
-    featureref_header_t* href = NULL;
-    size_t size = CHUNK_SIZE + sizeof(uint32_t) * num_labels;
+    int T = this->num_threads;
 
-    /* Check if we aren't writing anything at this moment. */
-    if (writer->state != WSTATE_NONE) {
-        return CRFSUITEERR_INTERNAL_LOGIC;
+    /* Make sure that we are writing attributes. */
+    if (this->state != WSTATE_ATTRS) {
+        return 1;
     }
 
-    /* Allocate a feature reference array. */
-    href = (featureref_header_t*)calloc(size, 1);
-    if (href == NULL) {
-        return CRFSUITEERR_OUTOFMEMORY;
+    /* Put the attributes #0, #1, ..., #(n-1), skipping NULL values. */
+    if (T <= 0) {
+        T = std::max(1u, std::thread::hardware_concurrency());
     }
-
-    /* Align the offset to a DWORD boundary. */
-    offset = (uint32_t)ftell(fp);
-    while (offset % 4 != 0) {
-        uint8_t c = 0;
-        fwrite(&c, sizeof(uint8_t), 1, fp);
-        ++offset;
+    if (cqdb_writer_put_many(this->dbw, values, NULL, n, T)) {
+        return 1;
     }
 
-    /* Store the current offset position to the file header. */
-    writer->header.off_labelrefs = offset;
-    fseek(fp, size, SEEK_CUR);
-
-    /* Fill members in the feature reference header. */
-    memcpy(href->chunk, CHUNK_LABELREF, 4);
-    href->size = 0;
-    href->num = num_labels;
-
-    writer->href = href;
-    writer->state = WSTATE_LABELREFS;
     return 0;
 }
 
-int tag_crf1dmw::crf1dmw_close_labelrefs()
+/*
+    A feature reference chunk is built in memory: the chunk header and the
+    offset array at the head of this->section, followed by the references.
+    The chunk is written with a single fwrite() when it is closed. Offsets
+    are absolute, which is fine because nothing else is written to the file
+    while the chunk is open.
+ */
+int tag_crf1dmw::open_refs(int num, const char *chunk, uint64_t *off_chunk, int state)
 {
-    tag_crf1dmw* writer = this;
-    uint32_t i;
-    FILE *fp = writer->fp;
-    featureref_header_t* href = writer->href;
-    uint32_t begin = writer->header.off_labelrefs, end = 0;
-
-    /* Make sure that we are writing label feature references. */
-    if (writer->state != WSTATE_LABELREFS) {
+    /* Check if we aren't writing anything at this moment. */
+    if (this->state != WSTATE_NONE) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* Store the current offset position. */
-    end = (uint32_t)ftell(fp);
+    /* Align the offset to a DWORD boundary and store it to the file header. */
+    this->section_begin = (uint32_t)align_file(this->fp, sizeof(uint32_t));
+    *off_chunk = this->section_begin;
+    this->section_num = (uint32_t)num;
 
-    /* Compute the size of this chunk. */
-    href->size = (end - begin);
-
-    /* Write the chunk header and offset array. */
-    fseek(fp, begin, SEEK_SET);
-    write_uint8_array(fp, href->chunk, 4);
-    write_uint32(fp, href->size);
-    write_uint32(fp, href->num);
-    for (i = 0;i < href->num;++i) {
-        write_uint32(fp, href->offsets[i]);
-    }
+    /* Reserve the chunk header and offset array (zero for unset items). */
+    this->section.assign(CHUNK_SIZE + sizeof(uint32_t) * num, 0);
+    memcpy(&this->section[0], chunk, 4);
 
-    /* Move the file pointer to the tail. */
-    fseek(fp, end, SEEK_SET);
-
-    /* Uninitialize. */
-    free(href);
-    writer->href = NULL;
-    writer->state = WSTATE_NONE;
+    this->state = state;
     return 0;
 }
 
-int tag_crf1dmw::crf1dmw_put_labelref(int lid, const feature_refs_t* ref, int *map)
+int tag_crf1dmw::close_refs(int state)
 {
-    tag_crf1dmw* writer = this;
-    int i, fid;
-    uint32_t n = 0, offset = 0;
-    FILE *fp = writer->fp;
-    featureref_header_t* href = writer->href;
+    uint8_t *p = NULL;
 
-    /* Make sure that we are writing label feature references. */
-    if (writer->state != WSTATE_LABELREFS) {
+    /* Make sure that we are writing feature references. */
+    if (this->state != state) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* Store the current offset to the offset array. */
-    href->offsets[lid] = ftell(fp);
-
-    /* Count the number of references to active features. */
-    for (i = 0;i < ref->num_features;++i) {
-        if (0 <= map[ref->fids[i]]) ++n;
-    }
+    /* Fill the chunk size and the number of items. */
+    p = &this->section[4];
+    p = encode_uint32(p, (uint32_t)this->section.size());
+    p = encode_uint32(p, this->section_num);
 
-    /* Write the feature reference. */
-    write_uint32(fp, (uint32_t)n);
-    for (i = 0;i < ref->num_features;++i) {
-        fid = map[ref->fids[i]];
-        if (0 <= fid) write_uint32(fp, (uint32_t)fid);
-    }
+    /* Write the whole chunk at once. */
+    fwrite(this->section.data(), 1, this->section.size(), this->fp);
+    std::vector<uint8_t>().swap(this->section);
 
-    return 0;
+    this->state = WSTATE_NONE;
+    return ferror(this->fp) ? CRFSUITEERR_INTERNAL_LOGIC : 0;
 }
 
-int tag_crf1dmw::crf1dmw_open_attrrefs(int num_attrs)
+int tag_crf1dmw::put_ref(int i, const feature_refs_t* ref, const int *map, int state)
 {
-    tag_crf1dmw* writer = this;
-    uint32_t offset;
-    FILE *fp = writer->fp;
-    featureref_header_t* href = NULL;
-    size_t size = CHUNK_SIZE + sizeof(uint32_t) * num_attrs;
+    int r, fid;
+    uint32_t n = 0;
+    std::vector<uint8_t>& buffer = this->section;
 
-    /* Check if we aren't writing anything at this moment. */
-    if (writer->state != WSTATE_NONE) {
+    /* Make sure that we are writing feature references. */
+    if (this->state != state) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* Allocate a feature reference array. */
-    href = (featureref_header_t*)calloc(size, 1);
-    if (href == NULL) {
-        return CRFSUITEERR_OUTOFMEMORY;
-    }
+    /* Store the offset of the reference to the offset array. */
+    encode_uint32(&buffer[CHUNK_SIZE + sizeof(uint32_t) * i], this->section_begin + (uint32_t)buffer.size());
 
-    /* Align the offset to a DWORD boundary. */
-    offset = (uint32_t)ftell(fp);
-    while (offset % 4 != 0) {
-        uint8_t c = 0;
-        fwrite(&c, sizeof(uint8_t), 1, fp);
-        ++offset;
+    /* Count the number of references to active features. */
+    for (r = 0;r < ref->num_features;++r) {
+        if (0 <= map[ref->offset + r]) ++n;
     }
 
-    /* Store the current offset position to the file header. */
-    writer->header.off_attrrefs = offset;
-    fseek(fp, size, SEEK_CUR);
-
-    /* Fill members in the feature reference header. */
-    memcpy(href->chunk, CHUNK_ATTRREF, 4);
-    href->size = 0;
-    href->num = num_attrs;
+    /* Append the feature reference. */
+    append_uint32(buffer, n);
+    for (r = 0;r < ref->num_features;++r) {
+        fid = map[ref->offset + r];
+        if (0 <= fid) append_uint32(buffer, (uint32_t)fid);
+    }
 
-    writer->href = href;
-    writer->state = WSTATE_ATTRREFS;
     return 0;
 }
 
-int tag_crf1dmw::crf1dmw_close_attrrefs()
+int tag_crf1dmw::crf1dmw_open_labelrefs(int num_labels)
 {
-    uint32_t i;
-    FILE *fp = this->fp;
-    featureref_header_t* href = this->href;
-    uint32_t begin = this->header.off_attrrefs, end = 0;
-
-    /* Make sure that we are writing attribute feature references. */
-    if (this->state != WSTATE_ATTRREFS) {
-        return CRFSUITEERR_INTERNAL_LOGIC;
-    }
-
-    /* Store the current offset position. */
-    end = (uint32_t)ftell(fp);
+    return this->open_refs(num_labels, CHUNK_LABELREF, &this->header.off_labelrefs, WSTATE_LABELREFS);
+}
 
-    /* Compute the size of this chunk. */
-    href->size = (end - begin);
+int tag_crf1dmw::crf1dmw_close_labelrefs()
+{
+    return this->close_refs(WSTATE_LABELREFS);
+}
 
-    /* Write the chunk header and offset array. */
-    fseek(fp, begin, SEEK_SET);
-    write_uint8_array(fp, href->chunk, 4);
-    write_uint32(fp, href->size);
-    write_uint32(fp, href->num);
-    for (i = 0;i < href->num;++i) {
-        write_uint32(fp, href->offsets[i]);
-    }
+int tag_crf1dmw::crf1dmw_put_labelref(int lid, const feature_refs_t* ref, int *map)
+{
+    return this->put_ref(lid, ref, map, WSTATE_LABELREFS);
+}
 
-    /* Move the file pointer to the tail. */
-    fseek(fp, end, SEEK_SET);
+int tag_crf1dmw::crf1dmw_open_attrrefs(int num_attrs)
+{
+    return this->open_refs(num_attrs, CHUNK_ATTRREF, &this->header.off_attrrefs, WSTATE_ATTRREFS);
+}
 
-    /* Uninitialize. */
-    free(href);
-    this->href = NULL;
-    this->state = WSTATE_NONE;
-    return 0;
+int tag_crf1dmw::crf1dmw_close_attrrefs()
+{
+    return this->close_refs(WSTATE_ATTRREFS);
 }
 
 int tag_crf1dmw::crf1dmw_put_attrref(int aid, const feature_refs_t* ref, int *map)
 {
-    int i, fid;
-    uint32_t n = 0, offset = 0;
-    FILE *fp = this->fp;
-    featureref_header_t* href = this->href;
-
-    /* Make sure that we are writing attribute feature references. */
-    if (this->state != WSTATE_ATTRREFS) {
-        return CRFSUITEERR_INTERNAL_LOGIC;
-    }
-
-    /* Store the current offset to the offset array. */
-    href->offsets[aid] = ftell(fp);
-
-    /* Count the number of references to active features. */
-    for (i = 0;i < ref->num_features;++i) {
-        if (0 <= map[ref->fids[i]]) ++n;
-    }
-
-    /* Write the feature reference. */
-    write_uint32(fp, (uint32_t)n);
-    for (i = 0;i < ref->num_features;++i) {
-        fid = map[ref->fids[i]];
-        if (0 <= fid) write_uint32(fp, (uint32_t)fid);
-    }
-
-    return 0;
+    return this->put_ref(aid, ref, map, WSTATE_ATTRREFS);
 }
 
 int tag_crf1dmw::crf1dmw_open_features(int num_features)
 {
-    FILE *fp = this->fp;
-    feature_header_t* hfeat = NULL;
-
     /* Check if we aren't writing anything at this moment. */
     if (this->state != WSTATE_NONE) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* Allocate a feature chunk header. */
-    hfeat = (feature_header_t*)calloc(sizeof(feature_header_t), 1);
-    if (hfeat == NULL) {
-        return CRFSUITEERR_OUTOFMEMORY;
-    }
-
-    this->header.off_features = (uint32_t)ftell(fp);
-    fseek(fp, CHUNK_SIZE, SEEK_CUR);
+    this->header.off_features = (uint32_t)ftell(this->fp);
+    this->section_num = 0;
 
-    memcpy(hfeat->chunk, CHUNK_FEATURE, 4);
-    this->hfeat = hfeat;
+    /* Reserve the chunk header and the space for the features. */
+    this->section.reserve(CHUNK_SIZE + (size_t)FEATURE_SIZE * num_features);
+    this->section.assign(CHUNK_SIZE, 0);
+    memcpy(&this->section[0], CHUNK_FEATURE, 4);
 
     this->state = WSTATE_FEATURES;
     this->header.num_features = num_features;
@@ -573,71 +612,107 @@ int tag_crf1dmw::crf1dmw_open_features(int num_features)
 
 int tag_crf1dmw::crf1dmw_close_features()
 {
-    FILE *fp = this->fp;
-    feature_header_t* hfeat = this->hfeat;
-    uint32_t begin = this->header.off_features, end = 0;
+    uint8_t *p = NULL;
 
-    /* Make sure that we are writing attribute feature references. */
+    /* Make sure that we are writing features. */
     if (this->state != WSTATE_FEATURES) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* Store the current offset position. */
-    end = (uint32_t)ftell(fp);
-
-    /* Compute the size of this chunk. */
-    hfeat->size = (end - begin);
+    /* Fill the chunk size and the number of features. */
+    p = &this->section[4];
+    p = encode_uint32(p, (uint32_t)this->section.size());
+    p = encode_uint32(p, this->section_num);
 
-    /* Write the chunk header and offset array. */
-    fseek(fp, begin, SEEK_SET);
-    write_uint8_array(fp, hfeat->chunk, 4);
-    write_uint32(fp, hfeat->size);
-    write_uint32(fp, hfeat->num);
+    /* Write the whole chunk at once. */
+    fwrite(this->section.data(), 1, this->section.size(), this->fp);
+    std::vector<uint8_t>().swap(this->section);
 
-    /* Move the file pointer to the tail. */
-    fseek(fp, end, SEEK_SET);
-
-    /* Uninitialize. */
-    free(hfeat);
-    this->hfeat = NULL;
     this->state = WSTATE_NONE;
-    return 0;
+    return ferror(this->fp) ? CRFSUITEERR_INTERNAL_LOGIC : 0;
 }
 
 int tag_crf1dmw::crf1dmw_put_feature(int fid, const crf1dm_feature_t* f)
 {
-    FILE *fp = this->fp;
-    feature_header_t* hfeat = this->hfeat;
+    /* We must put features #0, #1, ..., #(K-1) in this order. */
+    if (this->state != WSTATE_FEATURES || fid != (int)this->section_num) {
+        return CRFSUITEERR_INTERNAL_LOGIC;
+    }
+    return this->crf1dmw_put_features(f, 1);
+}
+
+int tag_crf1dmw::crf1dmw_put_features(const crf1dm_feature_t* features, int n)
+{
+    size_t begin = 0;
+    int T = this->num_threads;
 
-    /* Make sure that we are writing attribute feature references. */
+    /* Make sure that we are writing features. */
     if (this->state != WSTATE_FEATURES) {
         return CRFSUITEERR_INTERNAL_LOGIC;
     }
 
-    /* We must put features #0, #1, ..., #(K-1) in this order. */
-    if (fid != hfeat->num) {
-        return CRFSUITEERR_INTERNAL_LOGIC;
+    begin = this->section.size();
+    this->section.resize(begin + (size_t)FEATURE_SIZE * n);
+    uint8_t *base = &this->section[begin];
+
+    /* Each thread encodes a contiguous range of the features. */
+    auto encode = [features, base](int b, int e) {
+        uint8_t *p = base + (size_t)FEATURE_SIZE * b;
+        for (int i = b;i < e;++i) {
+            p = encode_uint32(p, (uint32_t)features[i].type);
+            p = encode_uint32(p, (uint32_t)features[i].src);
+            p = encode_uint32(p, (uint32_t)features[i].dst);
+            p = encode_float(p, features[i].weight);
+        }
+    };
+
+    if (T <= 0) {
+        T = std::max(1u, std::thread::hardware_concurrency());
+    }
+    /* Small batches are not worth spawning threads for. */
+    T = std::max(1, std::min(T, n / 65536));
+    if (T == 1) {
+        encode(0, n);
+    } else {
+        std::vector<std::thread> threads;
+        for (int t = 1;t < T;++t) {
+            threads.emplace_back(encode, (int)((int64_t)n * t / T), (int)((int64_t)n * (t+1) / T));
+        }
+        encode(0, (int)((int64_t)n / T));
+        for (auto& th: threads) {
+            th.join();
+        }
     }
 
-    write_uint32(fp, f->type);
-    write_uint32(fp, f->src);
-    write_uint32(fp, f->dst);
-    write_float(fp, f->weight);
-    ++hfeat->num;
+    this->section_num += (uint32_t)n;
     return 0;
 }
 
-tag_crf1dm::tag_crf1dm(const void* data, size_t size)
+void tag_crf1dm::init(const uint8_t* buffer, size_t size)
 {
-    const uint8_t* buffer = (const uint8_t*)data;
+    header_t *header = NULL;
 
-    if (size <= sizeof(header_t)) {
-        printf("EEEE\n");
+    uint32_t version = 0;
+
+    if (size < HEADER_SIZE || memcmp(buffer, FILEMAGIC, 4) != 0) {
+        throw std::runtime_error("Invalid model format");
     }
-    
-    header_t *header = (header_t*)calloc(1, sizeof(header_t));
+
+    /* Version-2 images have a different header and layout. */
+    read_uint32(buffer + 12, &version);
+    if (VERSION_V2 <= version) {
+        this->init_v2(buffer, size);
+        return;
+    }
+
+    /* Files in the feature hashing mode have a longer header. */
+    if (VERSION_HASHING <= version && size < HEADER_SIZE_HASHING) {
+        throw std::runtime_error("Invalid model format");
+    }
+
+    header = (header_t*)calloc(1, sizeof(header_t));
     if (header == NULL) {
-        printf("EEEE\n");
+        throw std::runtime_error("OOM");
     }
 
     /* Read the file header. */
@@ -654,124 +729,474 @@ tag_crf1dm::tag_crf1dm(const void* data, size_t size)
     p += read_uint32(p, &header->off_attrs);
     p += read_uint32(p, &header->off_labelrefs);
     p += read_uint32(p, &header->off_attrrefs);
-    printf("nf: %d, nl: %d, na: %d, of: %d, ol:%d, oa: %d, olr: %d, oar: %d\n", header->num_features, header->num_labels, header->num_attrs,
-    header->off_features, header->off_labels, header->off_attrs, header->off_labelrefs, header->off_attrrefs);
+    if (VERSION_HASHING <= header->version) {
+        p += read_uint32(p, &header->attr_hash);
+        p += read_uint32(p, &header->attr_hash_bits);
+        p += read_uint32(p, &header->attr_hash_seed);
+    }
     this->header = header;
+    this->buffer = buffer;
+    this->size = size;
+    if (size < header->off_labels || size < header->off_attrs ||
+        CRFSUITE_ATTRHASH_MAX_BITS < header->attr_hash_bits) {
+        throw std::runtime_error("Invalid model format");
+    }
 
     this->labels = cqdb_reader(
         buffer + header->off_labels,
         size - header->off_labels
         );
 
-    this->attrs = cqdb_reader(
+    /* No attribute dictionary is stored in the feature hashing mode. */
+    this->attrs = (header->off_attrs != 0) ? cqdb_reader(
         buffer + header->off_attrs,
         size - header->off_attrs
+        ) : NULL;
+
+    /*
+        Features and feature references are not decoded here; they are
+        read from the buffer on demand (see crf1dm_get_feature() and
+        crf1dm_get_attrref()), and the state features of an attribute are
+        decoded on its first use (see crf1dm_get_attr_states()).
+     */
+    this->attr_cache = std::vector<std::atomic<attr_block_t*> >(
+        (header->num_attrs + ATTR_BLOCK_SIZE - 1) / ATTR_BLOCK_SIZE);
+}
+
+void tag_crf1dm::init_v2(const uint8_t* buffer, size_t size)
+{
+    const uint32_t one = 1;
+    header_t *header = NULL;
+
+    /* The sections are used in place, which assumes a little-endian host. */
+    if (*(const uint8_t*)&one != 1) {
+        throw std::runtime_error("Version-2 models require a little-endian host");
+    }
+    if (size < HEADER_SIZE_V2) {
+        throw std::runtime_error("Invalid model format");
+    }
+
+    /*
+        Section offsets are aligned relative to the head of the image. Copy
+        the image to an aligned buffer if the caller (or malloc) did not
+        give us an aligned one.
+     */
+    if ((uintptr_t)buffer % SECTION_ALIGN != 0) {
+        uint8_t *aligned = NULL;
+        this->aligned = (uint8_t*)malloc(size + SECTION_ALIGN);
+        if (this->aligned == NULL) {
+            throw std::runtime_error("OOM");
+        }
+        aligned = this->aligned + (SECTION_ALIGN - (uintptr_t)this->aligned % SECTION_ALIGN) % SECTION_ALIGN;
+        memcpy(aligned, buffer, size);
+        buffer = aligned;
+    }
+
+    header = (header_t*)calloc(1, sizeof(header_t));
+    if (header == NULL) {
+        throw std::runtime_error("OOM");
+    }
+
+    /* Read the file header. */
+    const uint8_t* p = buffer;
+    p += read_uint8_array(p, header->magic, sizeof(header->magic));
+    p += read_uint32(p, &header->size);
+    p += read_uint8_array(p, header->type, sizeof(header->type));
+    p += read_uint32(p, &header->version);
+    if (header->version == VERSION_V2_LARGE) {
+        /* Sizes and offsets are 64-bit; the 32-bit size field above is unused. */
+        p += read_uint32(p, &header->num_features);
+        p += read_uint32(p, &header->num_labels);
+        p += read_uint32(p, &header->num_attrs);
+        p += read_uint32(p, &header->num_states);
+        p += read_uint64(p, &header->size);
+        p += read_uint64(p, &header->off_labels);
+        p += read_uint64(p, &header->off_attrs);
+        p += read_uint32(p, &header->attr_hash);
+        p += read_uint32(p, &header->attr_hash_bits);
+        p += read_uint32(p, &header->attr_hash_seed);
+        p += read_uint32(p, &header->state_weight_type);
+        p += read_uint64(p, &header->off_attr_offsets);
+        p += read_uint64(p, &header->off_state_dst);
+        p += read_uint64(p, &header->off_state_weight);
+        p += read_uint64(p, &header->off_trans);
+        p += read_uint64(p, &header->off_state_scale);
+    } else {
+        p += read_uint32(p, &header->num_features);
+        p += read_uint32(p, &header->num_labels);
+        p += read_uint32(p, &header->num_attrs);
+        p += read_uint32(p, &header->num_states);
+        p += read_uint32(p, &header->off_labels);
+        p += read_uint32(p, &header->off_attrs);
+        p += read_uint32(p, &header->attr_hash);
+        p += read_uint32(p, &header->attr_hash_bits);
+        p += read_uint32(p, &header->attr_hash_seed);
+        p += read_uint32(p, &header->off_attr_offsets);
+        p += read_uint32(p, &header->off_state_dst);
+        p += read_uint32(p, &header->off_state_weight);
+        p += read_uint32(p, &header->off_trans);
+        p += read_uint32(p, &header->state_weight_type);
+        p += read_uint32(p, &header->off_state_scale);
+    }
+    this->header = header;
+    this->buffer = buffer;
+    this->size = size;
+    this->v2 = true;
+
+    /* Make sure that every section lies within the image. */
+    const size_t L = header->num_labels, A = header->num_attrs, S = header->num_states;
+    size_t weight_size = 0;
+    switch (header->state_weight_type) {
+    case CRFSUITE_WEIGHT_FP64:
+        weight_size = sizeof(floatval_t);
+        break;
+    case CRFSUITE_WEIGHT_FP16:
+        weight_size = sizeof(uint16_t);
+        break;
+    case CRFSUITE_WEIGHT_INT8:
+        weight_size = sizeof(int8_t);
+        if (size < header->off_state_scale + sizeof(floatval_t) * L) {
+            throw std::runtime_error("Invalid model format");
+        }
+        break;
+    default:
+        throw std::runtime_error("Unsupported weight type in the model");
+    }
+    if (size < header->off_attr_offsets + sizeof(uint32_t) * (A + 1) ||
+        size < header->off_state_dst + sizeof(uint32_t) * S ||
+        size < header->off_state_weight + weight_size * S ||
+        size < header->off_trans + sizeof(floatval_t) * L * L ||
+        CRFSUITE_ATTRHASH_MAX_BITS < header->attr_hash_bits) {
+        throw std::runtime_error("Invalid model format");
+    }
+
+    this->attr_offsets = (const uint32_t*)(buffer + header->off_attr_offsets);
+    this->state_dst = (const uint32_t*)(buffer + header->off_state_dst);
+    switch (header->state_weight_type) {
+    case CRFSUITE_WEIGHT_FP64:
+        this->state_weight = (const floatval_t*)(buffer + header->off_state_weight);
+        break;
+    case CRFSUITE_WEIGHT_FP16:
+        this->state_half = (const uint16_t*)(buffer + header->off_state_weight);
+        break;
+    case CRFSUITE_WEIGHT_INT8:
+        this->state_int8 = (const int8_t*)(buffer + header->off_state_weight);
+        this->state_scale = (const floatval_t*)(buffer + header->off_state_scale);
+        break;
+    }
+    this->trans_weight = (const floatval_t*)(buffer + header->off_trans);
+
+    this->labels = cqdb_reader(
+        buffer + header->off_labels,
+        size - header->off_labels
         );
 
-    // read chunk
-    uint32_t offset = header->off_features;
-    feature_header_t fh;
-    read_uint8_array(buffer+offset, fh.chunk, 4);
-    read_uint32(buffer+offset+4, &fh.size);
-    read_uint32(buffer+offset+8, &fh.num);
-    printf("chunk: %s, sz = %d, num = %d\n", fh.chunk, fh.size, fh.num);
-    for (int i = 0; i < fh.num; ++i) {
-        uint32_t val = 0;
-        crf1dm_feature_t f;
-        uint32_t offset = header->off_features + CHUNK_SIZE;
-        offset += FEATURE_SIZE * i;                
-        p = buffer + offset;
-        p += read_uint32(p, &val);
-        f.type = val;
-        p += read_uint32(p, &val);
-        f.src = val;
-        p += read_uint32(p, &val);
-        f.dst = val;
-        p += read_float(p, &f.weight);
-        this->features.push_back(f);
-    }
-
-    for (int i = 0; i < header->num_labels; ++i) {
-        p = buffer;
-        p += this->header->off_labelrefs;
-        p += CHUNK_SIZE;
-        p += sizeof(uint32_t) * i;
-        uint32_t offset;
-        uint32_t num_features;
-        read_uint32(p, &offset);
-
-        
-        p = buffer + offset;
-        p += read_uint32(p, &num_features);
-        feature_refs_t ref;
-        ref.num_features = num_features;
-        uint32_t fid;
-        for (int j = 0; j < ref.num_features; ++j) {
-            read_uint32(p + sizeof(uint32_t)*j, &fid);
-            ref.fids.push_back(fid);
-        }
-        this->label_refs.push_back(ref);
-    }
-
-    for (int i = 0; i < header->num_attrs; ++i) {
-        p = buffer;
-        p += this->header->off_attrrefs;
-        p += CHUNK_SIZE;
-        p += sizeof(uint32_t) * i;
-        uint32_t offset;
-        uint32_t num_features;
-        read_uint32(p, &offset);
-
-        p = buffer + offset;
-        p += read_uint32(p, &num_features);
-        feature_refs_t ref;
-        ref.num_features = num_features;
-        uint32_t fid;
-        for (int j = 0; j < num_features; ++j) {
-            read_uint32(p + sizeof(uint32_t)*j, &fid);
-            ref.fids.push_back(fid);
+    /* No attribute dictionary is stored in the feature hashing mode. */
+    this->attrs = (header->off_attrs != 0) ? cqdb_reader(
+        buffer + header->off_attrs,
+        size - header->off_attrs
+        ) : NULL;
+}
+
+void tag_crf1dm::init_transition()
+{
+    const int L = (int)this->header->num_labels;
+
+    this->trans = std::vector<floatval_t>(L*L);
+    this->exp_trans = std::vector<floatval_t>(L*L);
+
+    if (this->v2) {
+        /* A version-2 model stores the transition matrix as is. */
+        std::copy_n(this->trans_weight, L*L, this->trans.begin());
+    } else {
+        /* Compute transition scores between two labels. */
+        for (int i = 0;i < L;++i) {
+            const feature_refs_t edge = this->crf1dm_get_labelref(i);
+            for (int r = 0;r < edge.num_features;++r) {
+                /* Transition feature from #i to #(f->dst). */
+                int fid = this->crf1dm_get_featureid(edge, r);
+                const crf1dm_feature_t f = this->crf1dm_get_feature(fid);
+                this->trans[L * i + f.dst] = f.weight;
+            }
         }
-        this->attr_refs.push_back(ref);
+    }
+
+    for (int i = 0;i < L*L;++i) {
+        this->exp_trans[i] = exp(this->trans[i]);
+    }
+}
+
+tag_crf1dm::tag_crf1dm(const void* data, size_t size)
+    : header(NULL), labels(NULL), attrs(NULL), buffer(NULL), size(0), owned(NULL), mapped(NULL), mapped_size(0),
+      aligned(NULL), v2(false), attr_offsets(NULL), state_dst(NULL), state_weight(NULL),
+      state_half(NULL), state_int8(NULL), state_scale(NULL), trans_weight(NULL), nref(1)
+{
+    try {
+        this->init((const uint8_t*)data, size);
+        this->init_transition();
+    } catch (...) {
+        /* The destructor is not called for a partially constructed model. */
+        this->clear();
+        throw;
     }
 }
 
 tag_crf1dm::tag_crf1dm(const char *filename)
+    : header(NULL), labels(NULL), attrs(NULL), buffer(NULL), size(0), owned(NULL), mapped(NULL), mapped_size(0),
+      aligned(NULL), v2(false), attr_offsets(NULL), state_dst(NULL), state_weight(NULL),
+      state_half(NULL), state_int8(NULL), state_scale(NULL), trans_weight(NULL), nref(1)
+{
+    try {
+        this->load(filename);
+    } catch (...) {
+        /* The destructor is not called for a partially constructed model. */
+        this->clear();
+        throw;
+    }
+}
+
+void tag_crf1dm::load(const char *filename)
 {
     FILE *fp = NULL;
-    uint32_t size = 0;
-    uint8_t* buffer_orig = NULL;
-    uint8_t* buffer = NULL;
+    size_t size = 0;
+
+#if     defined(_WIN32)
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER li;
+        if (GetFileSizeEx(file, &li) && 0 < li.QuadPart) {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL) {
+                this->mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                this->mapped_size = (size_t)li.QuadPart;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && 0 < st.st_size) {
+            void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                this->mapped = addr;
+                this->mapped_size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (this->mapped != NULL) {
+        /* Share the pages of the model file with other processes. */
+        this->init((const uint8_t*)this->mapped, this->mapped_size);
+        this->init_transition();
+        return;
+    }
 
+    /* Fall back to reading the whole file. */
     fp = fopen(filename, "rb");
     if (fp == NULL) {
         throw std::runtime_error("fopen");
     }
 
     fseek(fp, 0, SEEK_END);
-    size = (uint32_t)ftell(fp);
+    size = (size_t)tell64(fp);
     fseek(fp, 0, SEEK_SET);
 
-    buffer = buffer_orig = (uint8_t*)malloc(size + 16);
-    if (buffer_orig == NULL) {
+    this->owned = (uint8_t*)malloc(size);
+    if (this->owned == NULL) {
+        fclose(fp);
         throw std::runtime_error("malloc");
     }
 
-    /* Align the buffer to 16 bytes. */
-    while ((uintptr_t)buffer % 16 != 0) {
-        ++buffer;
-    }
-
-    if (fread(buffer, 1, size, fp) != size) {
+    if (fread(this->owned, 1, size, fp) != size) {
+        fclose(fp);
         throw std::runtime_error("fread");
     }
     fclose(fp);
 
-    *this = tag_crf1dm(buffer, size);
+    this->init(this->owned, size);
+    this->init_transition();
+}
+
+tag_crf1dm::~tag_crf1dm()
+{
+    this->clear();
+}
+
+void tag_crf1dm::clear()
+{
+    for (auto& slot: this->attr_cache) {
+        attr_block_t *block = slot.load();
+        if (block != NULL) {
+            for (auto& entry: block->entries) {
+                free((void*)entry.load());
+            }
+            delete block;
+        }
+    }
+    if (this->labels != NULL) {
+        cqdb_delete(this->labels);
+    }
+    if (this->attrs != NULL) {
+        cqdb_delete(this->attrs);
+    }
+    free(this->header);
+    free(this->owned);
+    free(this->aligned);
+    if (this->mapped != NULL) {
+#if     defined(_WIN32)
+        UnmapViewOfFile(this->mapped);
+#else
+        munmap(this->mapped, this->mapped_size);
+#endif
+    }
+}
+
+feature_refs_t tag_crf1dm::get_ref(uint32_t off_chunk, int i) const
+{
+    uint32_t offset, num;
+    feature_refs_t ref;
+
+    /* The offset array follows the chunk header. */
+    read_uint32(this->buffer + off_chunk + CHUNK_SIZE + sizeof(uint32_t) * i, &offset);
+    read_uint32(this->buffer + offset, &num);
+
+    /* Feature ids are DWORD-aligned; offset is in the unit of uint32_t. */
+    ref.offset = (int)((offset + sizeof(uint32_t)) / sizeof(uint32_t));
+    ref.num_features = (int)num;
+    return ref;
+}
+
+feature_refs_t tag_crf1dm::crf1dm_get_labelref(int lid) const
+{
+    if (this->v2) {
+        /* Row #lid of the transition matrix. */
+        const int L = (int)this->header->num_labels;
+        feature_refs_t ref;
+        ref.offset = (int)this->header->num_states + lid * L;
+        ref.num_features = L;
+        return ref;
+    }
+    return this->get_ref(this->header->off_labelrefs, lid);
+}
+
+feature_refs_t tag_crf1dm::crf1dm_get_attrref(int aid) const
+{
+    if (this->v2) {
+        feature_refs_t ref;
+        ref.offset = (int)this->attr_offsets[aid];
+        ref.num_features = (int)(this->attr_offsets[aid+1] - this->attr_offsets[aid]);
+        return ref;
+    }
+    return this->get_ref(this->header->off_attrrefs, aid);
+}
+
+const crf1dm_attr_states_t* tag_crf1dm::crf1dm_get_attr_states(int aid) const
+{
+    std::atomic<attr_block_t*>& slot = this->attr_cache[aid / ATTR_BLOCK_SIZE];
+    attr_block_t *block = slot.load(std::memory_order_acquire);
+
+    if (block == NULL) {
+        /* Another thread may install the block first; use the winner. */
+        attr_block_t *created = new attr_block_t();
+        if (slot.compare_exchange_strong(block, created, std::memory_order_acq_rel)) {
+            block = created;
+        } else {
+            delete created;
+        }
+    }
+
+    std::atomic<const crf1dm_attr_states_t*>& entry = block->entries[aid % ATTR_BLOCK_SIZE];
+    const crf1dm_attr_states_t *states = entry.load(std::memory_order_acquire);
+
+    if (states == NULL) {
+        /* Decode the state features into one allocation. */
+        const feature_refs_t ref = this->crf1dm_get_attrref(aid);
+        crf1dm_attr_states_t *decoded = (crf1dm_attr_states_t*)malloc(
+            sizeof(crf1dm_attr_states_t) + sizeof(crf1dm_state_t) * ref.num_features);
+        if (decoded == NULL) {
+            throw std::runtime_error("OOM");
+        }
+        crf1dm_state_t *p = (crf1dm_state_t*)(decoded + 1);
+        for (int r = 0;r < ref.num_features;++r) {
+            const crf1dm_feature_t f = this->crf1dm_get_feature(this->crf1dm_get_featureid(ref, r));
+            p[r].dst = f.dst;
+            p[r].weight = f.weight;
+        }
+        decoded->num = ref.num_features;
+        decoded->states = p;
+
+        if (entry.compare_exchange_strong(states, decoded, std::memory_order_acq_rel)) {
+            states = decoded;
+        } else {
+            free(decoded);
+        }
+    }
+    return states;
+}
+
+int tag_crf1dm::crf1dm_get_featureid(const feature_refs_t& ref, int i) const
+{
+    uint32_t fid;
+
+    if (this->v2) {
+        return ref.offset + i;
+    }
+
+    read_uint32(this->buffer + sizeof(uint32_t) * ((size_t)ref.offset + i), &fid);
+    return (int)fid;
+}
+
+crf1dm_feature_t tag_crf1dm::crf1dm_get_feature(int fid) const
+{
+    uint32_t val = 0;
+    crf1dm_feature_t f;
+
+    if (this->v2) {
+        const int S = (int)this->header->num_states;
+        if (fid < S) {
+            /* Find the attribute whose CSR range contains the feature. */
+            const uint32_t *begin = this->attr_offsets;
+            const uint32_t *end = begin + this->header->num_attrs + 1;
+            f.type = FT_STATE;
+            f.src = (int)(std::upper_bound(begin, end, (uint32_t)fid) - begin) - 1;
+            f.dst = (int)this->state_dst[fid];
+            if (this->state_weight != NULL) {
+                f.weight = this->state_weight[fid];
+            } else if (this->state_half != NULL) {
+                f.weight = crf1dm_half_to_float(this->state_half[fid]);
+            } else {
+                f.weight = this->state_scale[f.dst] * this->state_int8[fid];
+            }
+        } else {
+            const int L = (int)this->header->num_labels;
+            f.type = FT_TRANS;
+            f.src = (fid - S) / L;
+            f.dst = (fid - S) % L;
+            f.weight = this->trans_weight[fid - S];
+        }
+        return f;
+    }
+
+    const uint8_t *p = this->buffer + this->header->off_features + CHUNK_SIZE + (size_t)FEATURE_SIZE * fid;
+
+    p += read_uint32(p, &val);
+    f.type = val;
+    p += read_uint32(p, &val);
+    f.src = val;
+    p += read_uint32(p, &val);
+    f.dst = val;
+    p += read_float(p, &f.weight);
+    return f;
 }
 
 crfsuite_tagger_t* tag_crf1dm::get_tagger()
 {
-    /* Construct a tagger based on the model. */
+    /* Construct a tagger based on the model; the tagger holds a reference. */
     return new crf1dt_t(this);
 }
 
@@ -785,18 +1210,37 @@ void tag_crf1dm::dump(FILE *fp)
     fprintf(fp, "FILEHEADER = {\n");
     fprintf(fp, "  magic: %c%c%c%c\n",
         hfile->magic[0], hfile->magic[1], hfile->magic[2], hfile->magic[3]);
-    fprintf(fp, "  size: %" PRIu32 "\n", hfile->size);
+    fprintf(fp, "  size: %" PRIu64 "\n", hfile->size);
     fprintf(fp, "  type: %c%c%c%c\n",
         hfile->type[0], hfile->type[1], hfile->type[2], hfile->type[3]);
     fprintf(fp, "  version: %" PRIu32 "\n", hfile->version);
     fprintf(fp, "  num_features: %" PRIu32 "\n", hfile->num_features);
     fprintf(fp, "  num_labels: %" PRIu32 "\n", hfile->num_labels);
     fprintf(fp, "  num_attrs: %" PRIu32 "\n", hfile->num_attrs);
-    fprintf(fp, "  off_features: 0x%" PRIX32 "\n", hfile->off_features);
-    fprintf(fp, "  off_labels: 0x%" PRIX32 "\n", hfile->off_labels);
-    fprintf(fp, "  off_attrs: 0x%" PRIX32 "\n", hfile->off_attrs);
-    fprintf(fp, "  off_labelrefs: 0x%" PRIX32 "\n", hfile->off_labelrefs);
-    fprintf(fp, "  off_attrrefs: 0x%" PRIX32 "\n", hfile->off_attrrefs);
+    if (this->v2) {
+        fprintf(fp, "  num_states: %" PRIu32 "\n", hfile->num_states);
+        fprintf(fp, "  off_labels: 0x%" PRIX64 "\n", hfile->off_labels);
+        fprintf(fp, "  off_attrs: 0x%" PRIX64 "\n", hfile->off_attrs);
+        fprintf(fp, "  off_attr_offsets: 0x%" PRIX64 "\n", hfile->off_attr_offsets);
+        fprintf(fp, "  off_state_dst: 0x%" PRIX64 "\n", hfile->off_state_dst);
+        fprintf(fp, "  off_state_weight: 0x%" PRIX64 "\n", hfile->off_state_weight);
+        fprintf(fp, "  off_trans: 0x%" PRIX64 "\n", hfile->off_trans);
+        fprintf(fp, "  state_weight_type: %" PRIu32 "\n", hfile->state_weight_type);
+        if (hfile->state_weight_type == CRFSUITE_WEIGHT_INT8) {
+            fprintf(fp, "  off_state_scale: 0x%" PRIX64 "\n", hfile->off_state_scale);
+        }
+    } else {
+        fprintf(fp, "  off_features: 0x%" PRIX64 "\n", hfile->off_features);
+        fprintf(fp, "  off_labels: 0x%" PRIX64 "\n", hfile->off_labels);
+        fprintf(fp, "  off_attrs: 0x%" PRIX64 "\n", hfile->off_attrs);
+        fprintf(fp, "  off_labelrefs: 0x%" PRIX64 "\n", hfile->off_labelrefs);
+        fprintf(fp, "  off_attrrefs: 0x%" PRIX64 "\n", hfile->off_attrrefs);
+    }
+    if (hfile->attr_hash != CRFSUITE_ATTRHASH_NONE) {
+        fprintf(fp, "  attr_hash: %" PRIu32 "\n", hfile->attr_hash);
+        fprintf(fp, "  attr_hash_bits: %" PRIu32 "\n", hfile->attr_hash_bits);
+        fprintf(fp, "  attr_hash_seed: %" PRIu32 "\n", hfile->attr_hash_seed);
+    }
     fprintf(fp, "}\n");
     fprintf(fp, "\n");
 
@@ -817,7 +1261,7 @@ void tag_crf1dm::dump(FILE *fp)
 
     /* Dump the attributes. */
     fprintf(fp, "ATTRIBUTES = {\n");
-    for (i = 0;i < hfile->num_attrs;++i) {
+    for (i = 0;this->attrs != NULL && i < hfile->num_attrs;++i) {
         const char *str = this->crf1dm_to_attr(i);
 #if 0
         int check = crf1dm_to_aid(crf1dm, str);
@@ -840,6 +1284,10 @@ void tag_crf1dm::dump(FILE *fp)
             const char *from = NULL, *to = NULL;
 
             const crf1dm_feature_t& f = this->crf1dm_get_feature(fid);
+            /* The dense matrix of a version-2 model has inactive entries. */
+            if (this->v2 && f.weight == 0.) {
+                continue;
+            }
             from = this->crf1dm_to_label(f.src);
             to = this->crf1dm_to_label(f.dst);
             fprintf(fp, "  (%d) %s --> %s: %f\n", f.type, from, to, f.weight);
@@ -865,9 +1313,599 @@ void tag_crf1dm::dump(FILE *fp)
 #endif
             attr = this->crf1dm_to_attr(f.src);
             to = this->crf1dm_to_label(f.dst);
-            fprintf(fp, "  (%d) %s --> %s: %f\n", f.type, attr, to, f.weight);
+            if (attr != NULL) {
+                fprintf(fp, "  (%d) %s --> %s: %f\n", f.type, attr, to, f.weight);
+            } else {
+                /* Hashed attributes are shown by their ids. */
+                fprintf(fp, "  (%d) #%d --> %s: %f\n", f.type, f.src, to, f.weight);
+            }
         }
     }
     fprintf(fp, "}\n");
     fprintf(fp, "\n");
 }
+
+static uint64_t write_section(FILE *fp, const std::vector<uint8_t>& section)
+{
+    /* Write an aligned section with a single fwrite(), and return its offset. */
+    uint64_t offset = align_file(fp, SECTION_ALIGN);
+    if (!section.empty()) {
+        fwrite(section.data(), 1, section.size(), fp);
+    }
+    return offset;
+}
+
+/* CQDB flags of the attribute dictionary of a format version for the options (CRFSUITE_DICT_*). */
+static int attr_cqdb_flag(int version, int dict_flag)
+{
+    return ((version == 2) ? ATTR_CQDB_FLAG_V2 : 0) |
+        ((dict_flag & CRFSUITE_DICT_MPH) ? CQDB_MPH : 0) |
+        ((dict_flag & CRFSUITE_DICT_COMPRESS) ? CQDB_COMPRESS : 0);
+}
+
+static int write_cqdb(FILE *fp, const std::vector<const char*>& strs, int flag, uint64_t *offset)
+{
+    int ret = 0;
+    cqdb_writer_t* dbw = NULL;
+    const int T = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    *offset = tell64(fp);
+    dbw = cqdb_writer(fp, flag);
+    if (dbw == NULL) {
+        return CRFSUITEERR_OUTOFMEMORY;
+    }
+    /* NULL strings are skipped; the identifiers are the indices. */
+    ret = cqdb_writer_put_many(dbw, strs.data(), NULL, (int)strs.size(), T);
+    ret |= cqdb_writer_close(dbw);
+    return ret ? CRFSUITEERR_INTERNAL_LOGIC : 0;
+}
+
+static uint64_t estimate_cqdb_record_size(const char *str, int flag)
+{
+    /*
+        A record (at most three variable-length integers, the suffix and
+        a share of the block offsets if compressed), two buckets and a
+        backlink, and a slot, a pilot and a remap entry.
+     */
+    const uint64_t record = (flag & CQDB_COMPRESS) ? 16 : 9;
+    return (str != NULL) ? record + strlen(str) + 2 * 8 + 4 + ((flag & CQDB_MPH) ? 9 : 0) : 0;
+}
+
+uint64_t crf1dm_estimate_cqdb_size(const std::vector<const char*>& strs, int flag)
+{
+    /* Header and table references (and the index header), and the records. */
+    uint64_t size = 24 + 8 * 256 + ((flag & CQDB_MPH) ? 24 : 0) + ((flag & CQDB_COMPRESS) ? 8 : 0);
+    for (const char *str: strs) {
+        size += estimate_cqdb_record_size(str, flag);
+    }
+    return size;
+}
+
+uint64_t crf1dm_estimate_v1_size(
+    int num_features,
+    int num_labels,
+    int num_attrs,
+    const std::vector<const char*>& labels,
+    const std::vector<const char*>& attrs,
+    int attr_flag
+    )
+{
+    /*
+        The header, the features, the dictionaries, and the references
+        (offset arrays, counts and feature ids) with alignment paddings.
+     */
+    return HEADER_SIZE_HASHING + CHUNK_SIZE + (uint64_t)FEATURE_SIZE * num_features +
+        crf1dm_estimate_cqdb_size(labels) +
+        (attrs.empty() ? 0 : crf1dm_estimate_cqdb_size(attrs, attr_flag)) +
+        2 * (CHUNK_SIZE + 4) +
+        sizeof(uint32_t) * (2 * ((uint64_t)num_labels + 2) + 2 * (uint64_t)num_attrs + num_features);
+}
+
+static uint64_t weight_size(int weight_type)
+{
+    switch (weight_type) {
+    case CRFSUITE_WEIGHT_FP16:
+        return sizeof(uint16_t);
+    case CRFSUITE_WEIGHT_INT8:
+        return sizeof(int8_t);
+    default:
+        return sizeof(floatval_t);
+    }
+}
+
+static uint64_t estimate_v2_size(int L, int A, int S, int weight_type, uint64_t cqdb_size)
+{
+    /* The header, the dictionaries, the sections and alignment paddings. */
+    return HEADER_SIZE_V2 + cqdb_size +
+        sizeof(uint32_t) * ((uint64_t)A + 1) + (sizeof(uint32_t) + weight_size(weight_type)) * S +
+        sizeof(floatval_t) * ((uint64_t)L + (uint64_t)L * L) + 8 * SECTION_ALIGN;
+}
+
+int crf1dm_write_v2(
+    const char *filename,
+    const std::vector<const char*>& labels,
+    const std::vector<const char*>& attrs,
+    const AttributeHasher& hasher,
+    const std::vector<crf1dm_feature_t>& trans,
+    const std::vector<crf1dm_feature_t>& states,
+    const std::vector<uint32_t>& attr_offsets,
+    int weight_type,
+    int attr_flag,
+    uint64_t *size
+    )
+{
+    int i, ret = 0;
+    header_t header;
+    const int L = (int)labels.size();
+    const int A = (int)attr_offsets.size() - 1;
+    const int S = (int)states.size();
+    std::vector<uint8_t> sec_offsets, sec_dst, sec_weight, sec_scale, sec_trans;
+    uint8_t buffer[HEADER_SIZE_V2] = {0}, *p = buffer;
+    FILE *fp = NULL;
+
+    if (weight_type != CRFSUITE_WEIGHT_FP64 &&
+        weight_type != CRFSUITE_WEIGHT_FP16 &&
+        weight_type != CRFSUITE_WEIGHT_INT8) {
+        return CRFSUITEERR_NOTSUPPORTED;
+    }
+
+    /*
+        Choose 64-bit offsets (version 201) if the model may exceed 4 GB.
+        Each CQDB chunk independently uses 64-bit offsets if it may exceed
+        4 GB by itself.
+     */
+    const uint64_t label_size = crf1dm_estimate_cqdb_size(labels);
+    const uint64_t attr_size = attrs.empty() ? 0 : crf1dm_estimate_cqdb_size(attrs, attr_flag | ATTR_CQDB_FLAG_V2);
+    const uint64_t estimate = estimate_v2_size(L, A, S, weight_type, label_size + attr_size);
+    const int large = (0xFFFFFFFFULL < estimate);
+    const int label_flag = (0xFFFFFFFFULL < label_size) ? CQDB_OFFSET64 : 0;
+    attr_flag |= ((0xFFFFFFFFULL < attr_size) ? CQDB_OFFSET64 : 0) | ATTR_CQDB_FLAG_V2;
+
+    /*
+        Encode the sections in parallel; they are independent of each
+        other. The CQDB chunks are written directly to the file.
+     */
+    std::thread encode_csr([&]() {
+        sec_offsets.resize(sizeof(uint32_t) * (A + 1));
+        for (int a = 0;a <= A;++a) {
+            encode_uint32(&sec_offsets[sizeof(uint32_t) * a], attr_offsets[a]);
+        }
+        sec_dst.resize(sizeof(uint32_t) * S);
+        for (int k = 0;k < S;++k) {
+            encode_uint32(&sec_dst[sizeof(uint32_t) * k], (uint32_t)states[k].dst);
+        }
+    });
+    std::thread encode_trans([&]() {
+        sec_trans.assign(sizeof(floatval_t) * L * L, 0);
+        for (const crf1dm_feature_t& f: trans) {
+            encode_float(&sec_trans[sizeof(floatval_t) * ((size_t)L * f.src + f.dst)], f.weight);
+        }
+    });
+
+    if (weight_type == CRFSUITE_WEIGHT_FP64) {
+        sec_weight.resize(sizeof(floatval_t) * S);
+        for (i = 0;i < S;++i) {
+            encode_float(&sec_weight[sizeof(floatval_t) * i], states[i].weight);
+        }
+    } else if (weight_type == CRFSUITE_WEIGHT_FP16) {
+        sec_weight.resize(sizeof(uint16_t) * S);
+        for (i = 0;i < S;++i) {
+            uint16_t h = float_to_half(states[i].weight);
+            sec_weight[2*i] = (uint8_t)(h & 0xFF);
+            sec_weight[2*i+1] = (uint8_t)(h >> 8);
+        }
+    } else {
+        /* Symmetric quantization with the scale max|w| / 127 per label. */
+        std::vector<floatval_t> scale(L, 0.);
+        for (i = 0;i < S;++i) {
+            const floatval_t w = fabs(states[i].weight);
+            if (scale[states[i].dst] < w) {
+                scale[states[i].dst] = w;
+            }
+        }
+        sec_scale.resize(sizeof(floatval_t) * L);
+        for (i = 0;i < L;++i) {
+            scale[i] /= 127.;
+            encode_float(&sec_scale[sizeof(floatval_t) * i], scale[i]);
+        }
+        sec_weight.resize(S);
+        for (i = 0;i < S;++i) {
+            const floatval_t s = scale[states[i].dst];
+            const int q = (0. < s) ? (int)floor(states[i].weight / s + 0.5) : 0;
+            sec_weight[i] = (uint8_t)(int8_t)std::max(-127, std::min(127, q));
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILEMAGIC, 4);
+    memcpy(header.type, MODELTYPE, 4);
+    header.version = large ? VERSION_V2_LARGE : VERSION_V2;
+    header.num_features = (uint32_t)(S + L * L);
+    header.num_labels = (uint32_t)L;
+    header.num_attrs = (uint32_t)A;
+    header.num_states = (uint32_t)S;
+    if (hasher.enabled()) {
+        header.attr_hash = (uint32_t)hasher.type;
+        header.attr_hash_bits = (uint32_t)hasher.bits;
+        header.attr_hash_seed = hasher.seed;
+    }
+    header.state_weight_type = (uint32_t)weight_type;
+
+    fp = fopen(filename, "wb");
+    if (fp != NULL) {
+        setvbuf(fp, NULL, _IOFBF, 1 << 20);
+        write_zeros(fp, HEADER_SIZE_V2);
+
+        /* Dictionaries. */
+        align_file(fp, SECTION_ALIGN);
+        ret |= write_cqdb(fp, labels, label_flag, &header.off_labels);
+        if (!attrs.empty()) {
+            align_file(fp, SECTION_ALIGN);
+            ret |= write_cqdb(fp, attrs, attr_flag, &header.off_attrs);
+        }
+    }
+
+    encode_csr.join();
+    encode_trans.join();
+    if (fp == NULL) {
+        return CRFSUITEERR_INTERNAL_LOGIC;
+    }
+
+    header.off_attr_offsets = write_section(fp, sec_offsets);
+    header.off_state_dst = write_section(fp, sec_dst);
+    header.off_state_weight = write_section(fp, sec_weight);
+    if (weight_type == CRFSUITE_WEIGHT_INT8) {
+        header.off_state_scale = write_section(fp, sec_scale);
+    }
+    header.off_trans = write_section(fp, sec_trans);
+    header.size = tell64(fp);
+    if (!large && 0xFFFFFFFFULL < header.size) {
+        /* The estimate is an upper bound; this should never happen. */
+        ret = CRFSUITEERR_OVERFLOW;
+    }
+
+    /* Encode and write the file header. */
+    memcpy(p, header.magic, 4);
+    p += 4;
+    p = encode_uint32(p, large ? 0 : (uint32_t)header.size);
+    memcpy(p, header.type, 4);
+    p += 4;
+    p = encode_uint32(p, header.version);
+    p = encode_uint32(p, header.num_features);
+    p = encode_uint32(p, header.num_labels);
+    p = encode_uint32(p, header.num_attrs);
+    p = encode_uint32(p, header.num_states);
+    if (large) {
+        p = encode_uint64(p, header.size);
+        p = encode_uint64(p, header.off_labels);
+        p = encode_uint64(p, header.off_attrs);
+        p = encode_uint32(p, header.attr_hash);
+        p = encode_uint32(p, header.attr_hash_bits);
+        p = encode_uint32(p, header.attr_hash_seed);
+        p = encode_uint32(p, header.state_weight_type);
+        p = encode_uint64(p, header.off_attr_offsets);
+        p = encode_uint64(p, header.off_state_dst);
+        p = encode_uint64(p, header.off_state_weight);
+        p = encode_uint64(p, header.off_trans);
+        p = encode_uint64(p, header.off_state_scale);
+    } else {
+        p = encode_uint32(p, (uint32_t)header.off_labels);
+        p = encode_uint32(p, (uint32_t)header.off_attrs);
+        p = encode_uint32(p, header.attr_hash);
+        p = encode_uint32(p, header.attr_hash_bits);
+        p = encode_uint32(p, header.attr_hash_seed);
+        p = encode_uint32(p, (uint32_t)header.off_attr_offsets);
+        p = encode_uint32(p, (uint32_t)header.off_state_dst);
+        p = encode_uint32(p, (uint32_t)header.off_state_weight);
+        p = encode_uint32(p, (uint32_t)header.off_trans);
+        p = encode_uint32(p, header.state_weight_type);
+        p = encode_uint32(p, (uint32_t)header.off_state_scale);
+    }
+    fseek(fp, 0, SEEK_SET);
+    fwrite(buffer, 1, sizeof(buffer), fp);
+
+    if (ferror(fp)) {
+        ret = CRFSUITEERR_INTERNAL_LOGIC;
+    }
+    fclose(fp);
+    if (size != NULL) {
+        *size = header.size;
+    }
+    return ret;
+}
+
+/*
+    Write a model from the features collected from a model. State features
+    are grouped by attributes as in crf1dm_write_v2().
+ */
+static int write_model(
+    const char *filename,
+    int version,
+    int weight_type,
+    int dict_flag,
+    const AttributeHasher& hasher,
+    const std::vector<const char*>& labels,
+    const std::vector<const char*>& attrs,
+    const std::vector<crf1dm_feature_t>& trans,
+    const std::vector<crf1dm_feature_t>& states,
+    const std::vector<uint32_t>& label_offsets,
+    const std::vector<uint32_t>& attr_offsets
+    )
+{
+    int i;
+    const int L = (int)labels.size();
+    const int A = (int)attr_offsets.size() - 1;
+
+    if (version == 1) {
+        const int T = (int)trans.size(), K = T + (int)states.size();
+        std::vector<int> map(K);
+        feature_refs_t ref;
+
+        /* Version 1 stores weights in double precision and plain keys only. */
+        if (weight_type != CRFSUITE_WEIGHT_FP64 || (dict_flag & CRFSUITE_DICT_COMPRESS)) {
+            return CRFSUITEERR_NOTSUPPORTED;
+        }
+
+        tag_crf1dmw writer(filename, hasher.enabled() ? &hasher : NULL);
+        if (writer.fp == NULL) {
+            return CRFSUITEERR_INTERNAL_LOGIC;
+        }
+
+        /* Transition features first, then state features. */
+        writer.num_threads = 0;
+        writer.attr_flag = attr_cqdb_flag(version, dict_flag);
+        if (writer.crf1dmw_open_features(K) ||
+            writer.crf1dmw_put_features(trans.data(), T) ||
+            writer.crf1dmw_put_features(states.data(), (int)states.size()) ||
+            writer.crf1dmw_close_features()) {
+            goto error_exit;
+        }
+
+        if (writer.crf1dmw_open_labels(L)) {
+            goto error_exit;
+        }
+        for (i = 0;i < L;++i) {
+            if (writer.crf1dmw_put_label(i, labels[i])) {
+                goto error_exit;
+            }
+        }
+        if (writer.crf1dmw_close_labels()) {
+            goto error_exit;
+        }
+
+        if (!attrs.empty()) {
+            if (writer.crf1dmw_open_attrs(A) ||
+                writer.crf1dmw_put_attrs(attrs.data(), A) ||
+                writer.crf1dmw_close_attrs()) {
+                goto error_exit;
+            }
+        }
+
+        for (i = 0;i < K;++i) {
+            map[i] = i;
+        }
+
+        if (writer.crf1dmw_open_labelrefs(L+2)) {
+            goto error_exit;
+        }
+        for (i = 0;i < L;++i) {
+            ref.offset = (int)label_offsets[i];
+            ref.num_features = (int)(label_offsets[i+1] - label_offsets[i]);
+            if (writer.crf1dmw_put_labelref(i, &ref, map.data())) {
+                goto error_exit;
+            }
+        }
+        if (writer.crf1dmw_close_labelrefs()) {
+            goto error_exit;
+        }
+
+        if (writer.crf1dmw_open_attrrefs(A)) {
+            goto error_exit;
+        }
+        for (i = 0;i < A;++i) {
+            ref.offset = T + (int)attr_offsets[i];
+            ref.num_features = (int)(attr_offsets[i+1] - attr_offsets[i]);
+            if (writer.crf1dmw_put_attrref(i, &ref, map.data())) {
+                goto error_exit;
+            }
+        }
+        if (writer.crf1dmw_close_attrrefs()) {
+            goto error_exit;
+        }
+
+        /* The header is written and write errors are detected on closing. */
+        return writer.crf1dmw_close() ? CRFSUITEERR_INTERNAL_LOGIC : 0;
+
+error_exit:
+        writer.crf1dmw_close();
+        return CRFSUITEERR_INTERNAL_LOGIC;
+
+    } else if (version == 2) {
+        return crf1dm_write_v2(filename, labels, attrs, hasher, trans, states, attr_offsets, weight_type, attr_cqdb_flag(version, dict_flag), NULL);
+    }
+
+    return CRFSUITEERR_NOTSUPPORTED;
+}
+
+void tag_crf1dm::collect_features(
+    std::vector<const char*>& labels,
+    std::vector<const char*>& attrs,
+    std::vector<crf1dm_feature_t>& trans,
+    std::vector<crf1dm_feature_t>& states,
+    std::vector<uint32_t>& label_offsets,
+    std::vector<uint32_t>& attr_offsets
+    ) const
+{
+    int i, r;
+    const int L = (int)this->header->num_labels;
+    const int A = (int)this->header->num_attrs;
+
+    labels.assign(L, NULL);
+    attrs.clear();
+    trans.clear();
+    states.clear();
+    label_offsets.assign(L+1, 0);
+    attr_offsets.assign(A+1, 0);
+
+    /* Collect the active features grouped by labels and attributes. */
+    for (i = 0;i < L;++i) {
+        const feature_refs_t& ref = this->crf1dm_get_labelref(i);
+        for (r = 0;r < ref.num_features;++r) {
+            const crf1dm_feature_t& f = this->crf1dm_get_feature(this->crf1dm_get_featureid(ref, r));
+            if (!this->v2 || f.weight != 0.) {
+                trans.push_back(f);
+            }
+        }
+        label_offsets[i+1] = (uint32_t)trans.size();
+        labels[i] = cqdb_to_string(this->labels, i);
+    }
+    for (i = 0;i < A;++i) {
+        const feature_refs_t& ref = this->crf1dm_get_attrref(i);
+        for (r = 0;r < ref.num_features;++r) {
+            states.push_back(this->crf1dm_get_feature(this->crf1dm_get_featureid(ref, r)));
+        }
+        attr_offsets[i+1] = (uint32_t)states.size();
+    }
+    if (this->attrs != NULL) {
+        attrs.resize(A);
+        for (i = 0;i < A;++i) {
+            attrs[i] = cqdb_to_string(this->attrs, i);
+        }
+    }
+}
+
+int tag_crf1dm::write(const char *filename, int version, int weight_type, int dict_flag)
+{
+    std::vector<const char*> labels, attrs;
+    std::vector<crf1dm_feature_t> trans, states;
+    std::vector<uint32_t> label_offsets, attr_offsets;
+
+    this->collect_features(labels, attrs, trans, states, label_offsets, attr_offsets);
+    return write_model(filename, version, weight_type, dict_flag, this->get_hasher(), labels, attrs, trans, states, label_offsets, attr_offsets);
+}
+
+int tag_crf1dm::compact(const char *filename, crfsuite_compact_t *param)
+{
+    int a;
+    size_t k;
+    std::vector<const char*> labels, attrs;
+    std::vector<crf1dm_feature_t> trans, states;
+    std::vector<uint32_t> label_offsets, attr_offsets;
+
+    this->collect_features(labels, attrs, trans, states, label_offsets, attr_offsets);
+
+    const int L = (int)labels.size();
+    const int A = (int)attr_offsets.size() - 1;
+    const bool renumber = !attrs.empty();
+    std::vector<char> keep(states.size(), 0);
+    std::vector<size_t> order;
+
+    /* Order state features by the magnitudes of weights (and ids for ties). */
+    auto heavier = [&states](size_t x, size_t y) {
+        const floatval_t wx = fabs(states[x].weight), wy = fabs(states[y].weight);
+        return (wx != wy) ? (wx > wy) : (x < y);
+    };
+
+    /* Prune state features by the threshold and by top-k per attribute. */
+    for (a = 0;a < A;++a) {
+        order.clear();
+        for (k = attr_offsets[a];k < attr_offsets[a+1];++k) {
+            const floatval_t w = fabs(states[k].weight);
+            if (w != 0. && param->threshold <= w) {
+                order.push_back(k);
+            }
+        }
+        if (0 < param->top_k && (size_t)param->top_k < order.size()) {
+            std::partial_sort(order.begin(), order.begin() + param->top_k, order.end(), heavier);
+            order.resize(param->top_k);
+        }
+        for (size_t i: order) {
+            keep[i] = 1;
+        }
+    }
+
+    /*
+        Keep the heaviest state features while the estimated model size fits
+        in the target size. An attribute costs its dictionary record and its
+        references when it gets the first state feature.
+     */
+    if (0 < param->target_size) {
+        const std::vector<const char*> none;
+        const int version = param->version;
+        const uint64_t feature_cost = (version == 1) ?
+            FEATURE_SIZE + sizeof(uint32_t) : sizeof(uint32_t) + weight_size(param->weight_type);
+        const uint64_t attr_cost = (version == 1) ? 2 * sizeof(uint32_t) : sizeof(uint32_t);
+        const int base_attrs = renumber ? 0 : A;
+        const int attr_flag = attr_cqdb_flag(version, param->dict_flag);
+        uint64_t size = (version == 1) ?
+            crf1dm_estimate_v1_size((int)trans.size(), L, base_attrs, labels, none, attr_flag) :
+            estimate_v2_size(L, base_attrs, 0, param->weight_type, crf1dm_estimate_cqdb_size(labels));
+        std::vector<int> owner(states.size());
+        std::vector<char> used(A, 0);
+
+        /* The header and table references of the attribute dictionary. */
+        if (renumber) {
+            size += crf1dm_estimate_cqdb_size(none, attr_flag);
+        }
+
+        order.clear();
+        for (a = 0;a < A;++a) {
+            for (k = attr_offsets[a];k < attr_offsets[a+1];++k) {
+                owner[k] = a;
+                if (keep[k]) {
+                    order.push_back(k);
+                }
+            }
+        }
+        std::sort(order.begin(), order.end(), heavier);
+
+        for (size_t i: order) {
+            uint64_t cost = feature_cost;
+            a = owner[i];
+            if (renumber && !used[a]) {
+                cost += attr_cost + estimate_cqdb_record_size(attrs[a], attr_flag);
+            }
+            if (param->target_size < size + cost) {
+                break;
+            }
+            size += cost;
+            used[a] = 1;
+            keep[i] = 2;
+        }
+        for (k = 0;k < keep.size();++k) {
+            keep[k] = (keep[k] == 2);
+        }
+    }
+
+    /* Renumber the attributes and state features that survived. */
+    std::vector<const char*> new_attrs;
+    std::vector<crf1dm_feature_t> new_states;
+    std::vector<uint32_t> new_offsets(1, 0);
+    for (a = 0;a < A;++a) {
+        const size_t n = new_states.size();
+        const int aid = (int)new_offsets.size() - 1;
+        for (k = attr_offsets[a];k < attr_offsets[a+1];++k) {
+            if (keep[k]) {
+                crf1dm_feature_t f = states[k];
+                f.src = aid;
+                new_states.push_back(f);
+            }
+        }
+        if (renumber && n == new_states.size()) {
+            continue;
+        }
+        new_offsets.push_back((uint32_t)new_states.size());
+        if (renumber) {
+            new_attrs.push_back(attrs[a]);
+        }
+    }
+
+    param->num_features_before = (int)(trans.size() + states.size());
+    param->num_features_after = (int)(trans.size() + new_states.size());
+    param->num_attrs_before = A;
+    param->num_attrs_after = (int)new_offsets.size() - 1;
+
+    return write_model(
+        filename, param->version, param->weight_type, param->dict_flag, this->get_hasher(),
+        labels, new_attrs, trans, new_states, label_offsets, new_offsets);
+}
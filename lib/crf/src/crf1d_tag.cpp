@@ -70,24 +70,19 @@ crf1dt_t::crf1dt_t(crf1dm_t* crf1dm)
 {
     auto L = crf1dm->crf1dm_get_num_labels();
     this->model = crf1dm;
-    this->ctx = new crf1d_context_t(CTXF_VITERBI | CTXF_MARGINALS, L, 0);
-    this->ctx->crf1dc_reset(RF_TRANS);
-    {        
-        /* Compute transition scores between two labels. */
-        for (int i = 0;i < L;++i) {
-            const feature_refs_t &edge = this->model->crf1dm_get_labelref(i);
-            for (int r = 0; r < edge.num_features; ++r) {
-                /* Transition feature from #i to #(f->dst). */
-                int fid = this->model->crf1dm_get_featureid(edge, r);
-                const crf1dm_feature_t &f = this->model->crf1dm_get_feature(fid);
-                this->ctx->trans[this->ctx->num_labels * i + f.dst] = f.weight;
-            }
-        }
-    }
-    this->ctx->crf1dc_exp_transition();
+    this->model->addref();
+    /* Only the work space for instances is allocated; transitions are shared. */
+    this->ctx = new crf1d_context_t(CTXF_VITERBI | CTXF_MARGINALS | CTXF_SHARED_TRANS, L, 0);
+    this->ctx->crf1dc_share_transition(crf1dm->crf1dm_get_trans(), crf1dm->crf1dm_get_exp_trans());
     this->level = LEVEL_NONE;
 }
 
+crf1dt_t::~crf1dt_t()
+{
+    delete this->ctx;
+    this->model->release();
+}
+
 int crf1dt_t::set(const crfsuite_instance_t &inst)
 {
     this->ctx->crf1dc_set_num_items(inst.num_items());
@@ -95,26 +90,86 @@ int crf1dt_t::set(const crfsuite_instance_t &inst)
     {        
         const int T = inst.num_items();
 
+        /* Read the state features of a version-2 model directly from the SoA sections. */
+        if (this->model->is_v2()) {
+            const int L = this->ctx->num_labels;
+            const int type = this->model->get_state_weight_type();
+            const uint32_t *offsets = this->model->get_attr_offsets();
+            const uint32_t *dst = this->model->get_state_dst();
+            const floatval_t *weight = this->model->get_state_weight();
+            const uint16_t *half = this->model->get_state_half();
+            const int8_t *q = this->model->get_state_int8();
+            const floatval_t *scale = this->model->get_state_scale();
+
+            for (int t = 0;t < T;++t) {
+                const crfsuite_item_t& item = inst.items[t];
+                floatval_t *state = &this->ctx->state[L * t];
+                const int n = item.is_binary() ? (int)item.aids.size() : item.num_contents();
+
+                for (int i = 0;i < n;++i) {
+                    const int a = item.is_binary() ? item.aids[i] : item.contents[i].aid;
+                    const floatval_t value = item.is_binary() ? 1. : item.contents[i].value;
+                    const uint32_t begin = offsets[a], end = offsets[a+1];
+
+                    switch (type) {
+                    case CRFSUITE_WEIGHT_FP64:
+                        for (uint32_t k = begin;k < end;++k) {
+                            state[dst[k]] += weight[k] * value;
+                        }
+                        break;
+                    case CRFSUITE_WEIGHT_FP16:
+                        for (uint32_t k = begin;k < end;++k) {
+                            state[dst[k]] += crf1dm_half_to_float(half[k]) * value;
+                        }
+                        break;
+                    case CRFSUITE_WEIGHT_INT8:
+                        /* Accumulate the integers; the row is scaled below. */
+                        for (uint32_t k = begin;k < end;++k) {
+                            state[dst[k]] += q[k] * value;
+                        }
+                        break;
+                    }
+                }
+
+                /* The scale of INT8 weights depends only on the label. */
+                if (type == CRFSUITE_WEIGHT_INT8) {
+                    for (int l = 0;l < L;++l) {
+                        state[l] *= scale[l];
+                    }
+                }
+            }
+            this->level = LEVEL_SET;
+            return 0;
+        }
+
         /* Loop over the items in the sequence. */
         for (int t = 0;t < T;++t) {
-            const crfsuite_item_t& item = inst.items[t];           
+            const crfsuite_item_t& item = inst.items[t];
+            floatval_t *state = &this->ctx->state[this->ctx->num_labels * t];
+
+            /* Binary item: add the weights without scaling. */
+            if (item.is_binary()) {
+                for (int a: item.aids) {
+                    const crf1dm_attr_states_t *attr = this->model->crf1dm_get_attr_states(a);
+                    for (int r = 0;r < attr->num;++r) {
+                        state[attr->states[r].dst] += attr->states[r].weight;
+                    }
+                }
+                continue;
+            }
 
             /* Loop over the contents (attributes) attached to the item. */
             for (int i = 0;i < item.num_contents();++i) {
-                /* Access the list of state features associated with the attribute. */
+                /* Access the state features associated with the attribute. */
                 int a = item.contents[i].aid;
-                const feature_refs_t& attr = this->model->crf1dm_get_attrref(a);
+                const crf1dm_attr_states_t *attr = this->model->crf1dm_get_attr_states(a);
                 /* A scale usually represents the atrribute frequency in the item. */
                 floatval_t value = item.contents[i].value;
 
                 /* Loop over the state features associated with the attribute. */
-                for (int r = 0;r < attr.num_features;++r) {
-                    /* The state feature #(attr->fids[r]), which is represented by
-                    the attribute #a, outputs the label #(f->dst). */
-                    int fid = this->model->crf1dm_get_featureid(attr, r);
-                    const crf1dm_feature_t& f = this->model->crf1dm_get_feature(fid);
-                    int l = f.dst;
-                    (((this->ctx->state)[(this->ctx->num_labels) * (t) + (l)])) += f.weight * value;
+                for (int r = 0;r < attr->num;++r) {
+                    /* The state feature outputs the label #(states[r].dst). */
+                    state[attr->states[r].dst] += attr->states[r].weight * value;
                 }
             }
         }
@@ -35,6 +35,7 @@
 
 #include <crfsuite.h>
 #include "logging.h"
+#include <vector>
 
 enum {
     FTYPE_NONE = 0,             /**< Unselected. */
@@ -60,6 +61,50 @@ typedef struct tag_encoder encoder_t;
 
 typedef void (*crfsuite_encoder_features_on_path_callback)(void *instance, int fid, floatval_t value);
 
+/**
+ * Sparse gradient vector.
+ *  Gradients are accumulated into a dense scratch buffer of K elements while
+ *  the indices of the features touched since the last reset are recorded, so
+ *  that consumers (and reset()) only need to visit the active features.
+ */
+struct sparse_gradient_t {
+    std::vector<floatval_t> g;      /**< Dense gradient buffer [K]. */
+    std::vector<int> actives;       /**< Indices of the touched features. */
+    std::vector<char> used;         /**< Flags of the touched features [K]. */
+
+    void init(int K)
+    {
+        this->g.assign(K, 0.);
+        this->used.assign(K, 0);
+        this->actives.clear();
+    }
+
+    /** Mark the feature #k as active without changing its gradient. */
+    inline void touch(int k)
+    {
+        if (!this->used[k]) {
+            this->used[k] = 1;
+            this->actives.push_back(k);
+        }
+    }
+
+    inline void add(int k, floatval_t value)
+    {
+        this->touch(k);
+        this->g[k] += value;
+    }
+
+    /** Clear the gradients of the active features. */
+    void reset()
+    {
+        for (int k: this->actives) {
+            this->g[k] = 0.;
+            this->used[k] = 0;
+        }
+        this->actives.clear();
+    }
+};
+
 struct Algo {
     virtual int train(encoder_t *gm,dataset_t *trainset,dataset_t *testset,crfsuite_params_t *params,logging_t *lg,std::vector<floatval_t>& output) = 0;
 };
@@ -127,6 +172,22 @@ struct tag_encoder
      */
     void objective_and_gradients_batch(dataset_t &ds, const floatval_t *w, floatval_t *f, floatval_t *g);
 
+    /**
+     * Compute the objective value and sparse gradients for a mini-batch.
+     *  The instances #begin, ..., #(end-1) of the data set are split into
+     *  contiguous slices of (roughly) the same number of items, which are
+     *  processed in parallel by num_threads workers with their own contexts.
+     *  @param  ds          The data set.
+     *  @param  begin       The index of the first instance in the batch.
+     *  @param  end         The index next to the last instance in the batch.
+     *  @param  w           The feature weights.
+     *  @param  grad        The sparse gradient that is reset and receives the
+     *                      gradients of the negative log-likelihood of the
+     *                      batch (without regularization terms).
+     *  @return             The negative log-likelihood of the batch.
+     */
+    floatval_t objective_and_gradients_minibatch(dataset_t &ds, int begin, int end, const floatval_t *w, sparse_gradient_t& grad);
+
     void features_on_path(const crfsuite_instance_t *inst, const std::vector<int>& path, crfsuite_encoder_features_on_path_callback func, void *instance);
 
 
@@ -150,7 +211,7 @@ public:
     tag_encoder();
     ~tag_encoder();
 
-    void save_model(const char *filename, const std::vector<floatval_t> &w, const TextVectorization *attrs, const TextVectorization *labels, logging_t *lg);
+    int save_model(const char *filename, const std::vector<floatval_t> &w, const TextVectorization *attrs, const TextVectorization *labels, logging_t *lg);
     /**
      * Sets the feature weights (and their scale factor).
      *  @param  self        The encoder instance.
@@ -112,8 +112,9 @@ int tag_crfsuite_train_internal::train(const crfsuite_dataset_t *ds, const char
     this->algo->train(gm,&trainset,(holdout != -1 ? &testset : NULL),this->m_params,lg,w);
     /* Store the model file. */
     if (filename != NULL && *filename != '\0') {
-        gm->save_model(filename, w, attrs, labels, lg);
+        return gm->save_model(filename, w, attrs, labels, lg);
     }
+    return 0;
 }
 
 
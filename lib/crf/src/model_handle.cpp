@@ -0,0 +1,173 @@
+/*
+ *      Model handle with hot reload.
+ *
+ * Copyright (c) 2007-2010, Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the names of the authors nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <os.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <crfsuite.h>
+#include "logging.h"
+
+/*
+    The handle publishes the current version of a model in the manner of
+    RCU: a reader holds a reference to the version it obtained, and a writer
+    replaces the pointer and defers the reclamation of the old version to
+    the reference counter. The mutex only guards the pointer swap and the
+    increment of the reference count; loading a model happens outside of it,
+    so readers are never blocked by a reload.
+ */
+struct model_handle_t : tag_crfsuite_model_handle {
+    mutable std::mutex  mutex;
+    crfsuite_model_t*   model;      /**< Current version of the model. */
+    std::string         filename;   /**< File of the current version. */
+    int                 gen;        /**< Number of successful reloads. */
+    double              latency;    /**< Latency of the last reload [sec]. */
+    logging_t           lg;
+
+    model_handle_t() : model(NULL), gen(0), latency(0.)
+    {
+        lg.instance = NULL;
+        lg.func = NULL;
+        lg.percent = 0;
+    }
+
+    virtual ~model_handle_t()
+    {
+        if (this->model != NULL) {
+            this->model->release();
+        }
+    }
+
+    crfsuite_model_t* acquire()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->model->addref();
+        return this->model;
+    }
+
+    crfsuite_tagger_t* get_tagger()
+    {
+        crfsuite_model_t* current = this->acquire();
+        crfsuite_tagger_t* tagger = current->get_tagger();
+        /* The tagger holds its own reference to the model. */
+        current->release();
+        return tagger;
+    }
+
+    int reload(const char *filename)
+    {
+        int gen = 0;
+        double latency = 0.;
+        std::string fn;
+        crfsuite_model_t *loaded = NULL, *old = NULL;
+        auto start = std::chrono::steady_clock::now();
+
+        if (filename != NULL) {
+            fn = filename;
+        } else {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            fn = this->filename;
+        }
+
+        /* Load (map) the new version while readers keep using the current one. */
+        try {
+            if (crfsuite_create_instance_from_file(fn.c_str(), (void**)&loaded) != 0) {
+                loaded = NULL;
+            }
+        } catch (const std::exception& e) {
+            logging(&this->lg, "Failed to load the model %s: %s\n", fn.c_str(), e.what());
+            return 1;
+        }
+        if (loaded == NULL) {
+            logging(&this->lg, "Failed to load the model %s\n", fn.c_str());
+            return 1;
+        }
+
+        /* Publish the new version. */
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            old = this->model;
+            this->model = loaded;
+            this->filename = fn;
+            if (old != NULL) {
+                ++this->gen;
+            }
+            this->latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            gen = this->gen;
+            latency = this->latency;
+        }
+
+        /* The old version is destroyed when its last tagger is deleted. */
+        if (old != NULL) {
+            old->release();
+            logging(&this->lg, "Reloaded the model %s (generation %d) in %.3f ms\n", fn.c_str(), gen, latency * 1000.);
+        }
+        return 0;
+    }
+
+    int generation() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->gen;
+    }
+
+    double reload_latency() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->latency;
+    }
+
+    void set_message_callback(void *user, crfsuite_logging_callback cbm)
+    {
+        this->lg.instance = user;
+        this->lg.func = cbm;
+    }
+};
+
+int crfsuite_create_model_handle(const char *filename, crfsuite_model_handle_t **ptr)
+{
+    model_handle_t *handle = new model_handle_t();
+
+    *ptr = NULL;
+    if (handle->reload(filename) != 0) {
+        delete handle;
+        return 1;
+    }
+    *ptr = handle;
+    return 0;
+}